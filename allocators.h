@@ -10,6 +10,8 @@
 #define MMAPPED_VECTOR_ALLOCATORS_H
 
 #include <cstddef>
+#include <cstdint>
+#include <cstdlib>
 #include <string>
 #include <sys/mman.h>
 #include <mutex>
@@ -19,6 +21,9 @@
 #include <unistd.h>
 #include <cstring>
 #include <atomic>
+#include <algorithm>
+#include <bit>
+#include <type_traits>
 #if false //defined(__APPLE__) && defined(__MACH__)
 #include <mach/vm_map.h>
 #include <mach/mach.h>
@@ -36,14 +41,59 @@
 namespace mmapped_vector {
 
 
+// Smallest page size the mmap allocators work with. Their mappings start on a page boundary, and
+// their alignment constants promise this much, so a larger page size is fine and a smaller one is
+// refused by their constructors, with std::runtime_error.
+static constexpr size_t min_page_size = 4096;
+
 static const size_t page_size = getpagesize();
 
+namespace detail {
+
+// Not done where page_size is initialized: an exception there would end the process before main()
+inline void check_page_size() {
+    static const bool supported = page_size >= min_page_size && page_size % min_page_size == 0;
+    if (!supported)
+        throw std::runtime_error("mmapped_vector: unsupported page size " + std::to_string(page_size));
+}
+
+} // namespace detail
+
+// Bytes past the last element that a vector keeps allocated (and readable), so that SIMD code can
+// load whole registers at the tail instead of finishing with a scalar loop
+static constexpr size_t simd_padding_bytes = 64;
+
+// Tag for constructors that take over memory or a file descriptor created elsewhere
+struct adopt_t { explicit adopt_t() = default; };
+inline constexpr adopt_t adopt_tag{};
+
 template <typename T, typename AllocatorType, bool thread_safe>
 class MmappedVector;
 
 template <typename T, typename AllocatorType>
 class IndexHolder;
 
+// Storage handed out by release(): the caller owns it from then on, and frees it with dispose() or
+// in whatever way the allocator it came from documents.
+template <typename T>
+struct ReleasedBuffer
+{
+    T* ptr = nullptr;
+    size_t size = 0;
+    size_t capacity = 0;
+    int fd = -1;
+    void (*deallocate)(T* ptr, size_t capacity) = nullptr;
+
+    void dispose() {
+        if (ptr && deallocate)
+            deallocate(ptr, capacity);
+        if (fd != -1)
+            close(fd);
+        ptr = nullptr;
+        fd = -1;
+    }
+};
+
 template <typename T>
 class Allocator
 {
@@ -51,6 +101,11 @@ protected:
     T* ptr;
     size_t capacity;
 public:
+    // Guaranteed alignment of ptr
+    static constexpr size_t alignment = alignof(T);
+    // Capacity, if it's fixed at compile time and never changes; 0 if the allocator grows
+    static constexpr size_t fixed_capacity = 0;
+
     Allocator();
     Allocator(const Allocator&) = delete;
     virtual ~Allocator();
@@ -62,7 +117,13 @@ public:
     size_t get_capacity() const;
     T* get_ptr() const;
     virtual size_t get_backing_size() const;
+    virtual int get_fd() const;
+    virtual size_t get_fd_offset() const;
     virtual void sync(size_t used_elements);
+    virtual void flush(size_t used_elements);
+    virtual void flush_range(size_t begin, size_t end);
+    virtual size_t read_from_fd(int fd, size_t byte_offset, size_t max_bytes);
+    virtual ReleasedBuffer<T> release();
 
     friend class MmappedVector<T, Allocator, false>;
     friend class MmappedVector<T, Allocator, true>;
@@ -89,6 +150,18 @@ size_t Allocator<T>::get_backing_size() const {
     return 0;
 }
 
+// File descriptor the memory is a shared mapping of, or -1 if it's private to this allocator
+template <typename T> inline
+int Allocator<T>::get_fd() const {
+    return -1;
+}
+
+// Byte offset of the first element within get_fd()
+template <typename T> inline
+size_t Allocator<T>::get_fd_offset() const {
+    return 0;
+}
+
 template <typename T> inline
 void Allocator<T>::increase_capacity(size_t capacity_needed) {
     if(this->capacity >= capacity_needed) return;
@@ -110,6 +183,43 @@ void Allocator<T>::increase_capacity(size_t capacity_needed) {
 template <typename T> inline
 void Allocator<T>::sync(size_t) {};
 
+template <typename T> inline
+void Allocator<T>::flush(size_t used_elements) {
+    sync(used_elements);
+    flush_range(0, used_elements);
+};
+
+template <typename T> inline
+void Allocator<T>::flush_range(size_t, size_t) {};
+
+// Gives up ownership of the memory (and file descriptor, if any), leaving the allocator empty
+template <typename T>
+ReleasedBuffer<T> Allocator<T>::release() {
+    throw std::runtime_error("Allocator::release: not supported by this allocator");
+}
+
+// Reads up to max_bytes from fd straight into the buffer, starting byte_offset bytes past ptr.
+// Stops early on end of file or when a non-blocking fd has no more data. Returns the number of bytes read.
+template <typename T>
+size_t Allocator<T>::read_from_fd(int fd, size_t byte_offset, size_t max_bytes) {
+    char* target = reinterpret_cast<char*>(this->ptr) + byte_offset;
+    size_t total = 0;
+    while (total < max_bytes) {
+        ssize_t bytes = read(fd, target + total, max_bytes - total);
+        if (bytes == 0)
+            break;
+        if (bytes == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            throw std::runtime_error("Allocator::read_from_fd: read failed: " + mmapped_vector::get_error_message("read"));
+        }
+        total += bytes;
+    }
+    return total;
+}
+
 /*
  * =================================================================================================
  */
@@ -119,8 +229,13 @@ class MmapAllocator : public Allocator<T>
 {
 
 public:
+    // Mappings start on a page boundary
+    static constexpr size_t alignment = min_page_size;
+
     MmapAllocator();
     MmapAllocator(int flags);
+    // Takes ownership of an anonymous mapping of `capacity` elements, the first `size` of which are in use
+    MmapAllocator(adopt_t, T* ptr, size_t size, size_t capacity);
     MmapAllocator(const MmapAllocator&) = delete;
     MmapAllocator(MmapAllocator&&) noexcept;
     MmapAllocator& operator=(MmapAllocator&& other) noexcept;
@@ -128,9 +243,14 @@ public:
     MmapAllocator& operator=(const MmapAllocator&) = delete;
 
     void resize(size_t new_size) override;
+    size_t get_backing_size() const override;
+    // The memory is released with munmap(ptr, capacity * sizeof(T))
+    ReleasedBuffer<T> release() override;
 
     friend class MmappedVector<T, MmapAllocator, false>;
     friend class MmappedVector<T, MmapAllocator, true>;
+private:
+    size_t backing_size = 0;
 };
 
 
@@ -140,6 +260,7 @@ MmapAllocator<T>::MmapAllocator() : MmapAllocator<T>(MAP_ANONYMOUS | MAP_PRIVATE
 
 template <typename T>
 MmapAllocator<T>::MmapAllocator(int flags) : Allocator<T>() {
+    detail::check_page_size();
 #if  false //defined(__APPLE__) && defined(__MACH__)
     // Use Mach API mach_vm_map to allocate memory
     mach_vm_address_t address = 0;
@@ -157,10 +278,20 @@ MmapAllocator<T>::MmapAllocator(int flags) : Allocator<T>() {
     this->capacity = page_size / sizeof(T);
 }
 
+template <typename T>
+MmapAllocator<T>::MmapAllocator(adopt_t, T* ptr, size_t size, size_t capacity) : Allocator<T>() {
+    if (size > capacity)
+        throw std::invalid_argument("MmapAllocator::ctor: adopted size exceeds capacity");
+    this->ptr = ptr;
+    this->capacity = capacity;
+    this->backing_size = size;
+}
+
 template <typename T>
 MmapAllocator<T>::MmapAllocator(MmapAllocator&& other) noexcept : Allocator<T>() {
     this->ptr = other.ptr;
     this->capacity = other.capacity;
+    this->backing_size = other.backing_size;
     other.ptr = nullptr;
     other.capacity = 0;
 }
@@ -173,6 +304,7 @@ MmapAllocator<T>& MmapAllocator<T>::operator=(MmapAllocator&& other) noexcept {
         }
         this->ptr = other.ptr;
         this->capacity = other.capacity;
+        this->backing_size = other.backing_size;
         other.ptr = nullptr;
         other.capacity = 0;
     }
@@ -188,6 +320,19 @@ MmapAllocator<T>::~MmapAllocator() {
     }
 }
 
+template <typename T> inline
+size_t MmapAllocator<T>::get_backing_size() const {
+    return this->backing_size;
+}
+
+template <typename T>
+ReleasedBuffer<T> MmapAllocator<T>::release() {
+    ReleasedBuffer<T> buffer{this->ptr, 0, this->capacity, -1, [](T* ptr, size_t capacity) { munmap(ptr, capacity * sizeof(T)); }};
+    this->ptr = nullptr;
+    this->capacity = 0;
+    return buffer;
+}
+
 template <typename T>
 void MmapAllocator<T>::resize(size_t new_capacity) {
     if (new_capacity == this->capacity) return;
@@ -229,13 +374,129 @@ void MmapAllocator<T>::resize(size_t new_capacity) {
  * =================================================================================================
  */
 
+/*
+ * Capacity fixed at compile time: N elements, plus the vector's tail padding, reserved at
+ * construction as a single anonymous mapping that never moves. The reservation takes address space
+ * only (MAP_NORESERVE); pages are backed when first written, so N may be far more than will ever be
+ * used. MmappedVector sees fixed_capacity and leaves the capacity checks out of push_back(), and out
+ * of the thread-safe store path altogether: a push is a fetch_add and a store.
+ */
+template <typename T, size_t N>
+class FixedCapacityAllocator : public Allocator<T>
+{
+    static_assert(N > 0, "the capacity must be positive");
+public:
+    static constexpr size_t alignment = min_page_size;
+    static constexpr size_t fixed_capacity = N;
 
+    FixedCapacityAllocator();
+    FixedCapacityAllocator(const FixedCapacityAllocator&) = delete;
+    FixedCapacityAllocator(FixedCapacityAllocator&&) noexcept;
+    FixedCapacityAllocator& operator=(FixedCapacityAllocator&& other) noexcept;
+    ~FixedCapacityAllocator() override;
+    FixedCapacityAllocator& operator=(const FixedCapacityAllocator&) = delete;
+
+    // The mapping never changes; only checks that new_size fits
+    void resize(size_t new_size) override;
+    // The memory is released with munmap(ptr, capacity * sizeof(T))
+    ReleasedBuffer<T> release() override;
+
+    friend class MmappedVector<T, FixedCapacityAllocator, false>;
+    friend class MmappedVector<T, FixedCapacityAllocator, true>;
+private:
+    static constexpr size_t reserved = N + (simd_padding_bytes + sizeof(T) - 1) / sizeof(T);
+};
+
+template <typename T, size_t N>
+FixedCapacityAllocator<T, N>::FixedCapacityAllocator() : Allocator<T>() {
+    this->ptr = static_cast<T*>(mmap(nullptr, reserved * sizeof(T), PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0));
+    if (this->ptr == MAP_FAILED) {
+        this->ptr = nullptr;
+        throw std::runtime_error("FixedCapacityAllocator::ctor: mmap failed: " + mmapped_vector::get_error_message("mmap"));
+    }
+    this->capacity = reserved;
+}
+
+template <typename T, size_t N>
+FixedCapacityAllocator<T, N>::FixedCapacityAllocator(FixedCapacityAllocator&& other) noexcept : Allocator<T>() {
+    this->ptr = other.ptr;
+    this->capacity = other.capacity;
+    other.ptr = nullptr;
+    other.capacity = 0;
+}
+
+template <typename T, size_t N>
+FixedCapacityAllocator<T, N>& FixedCapacityAllocator<T, N>::operator=(FixedCapacityAllocator&& other) noexcept {
+    if (this != &other) {
+        if (this->ptr)
+            munmap(this->ptr, this->capacity * sizeof(T));
+        this->ptr = other.ptr;
+        this->capacity = other.capacity;
+        other.ptr = nullptr;
+        other.capacity = 0;
+    }
+    return *this;
+}
+
+template <typename T, size_t N>
+FixedCapacityAllocator<T, N>::~FixedCapacityAllocator() {
+    if (this->ptr) {
+        munmap(this->ptr, this->capacity * sizeof(T));
+        this->ptr = nullptr;
+        this->capacity = 0;
+    }
+}
+
+template <typename T, size_t N>
+void FixedCapacityAllocator<T, N>::resize(size_t new_size) {
+    if (new_size > reserved)
+        throw std::length_error("FixedCapacityAllocator::resize: " + std::to_string(new_size) + " elements requested, capacity is " + std::to_string(reserved));
+}
+
+template <typename T, size_t N>
+ReleasedBuffer<T> FixedCapacityAllocator<T, N>::release() {
+    ReleasedBuffer<T> buffer{this->ptr, 0, this->capacity, -1, [](T* ptr, size_t capacity) { munmap(ptr, capacity * sizeof(T)); }};
+    this->ptr = nullptr;
+    this->capacity = 0;
+    return buffer;
+}
+
+/*
+ * =================================================================================================
+ */
+
+
+// How MmapFileAllocator lays out its file: just the elements, or a NumPy .npy (version 1.0) header
+// padded to a whole page and followed by the elements, so that numpy.load(file, mmap_mode='r') maps
+// the data without conversion. The header's shape is rewritten on sync and close.
+enum class FileLayout { raw, npy };
+
+// The .npy type descriptor for T; element types other than arithmetic ones are stored as raw bytes
+template <typename T>
+std::string npy_descr() {
+    std::string endianness = sizeof(T) == 1 ? "|" : std::endian::native == std::endian::little ? "<" : ">";
+    if constexpr(std::is_same_v<T, bool>)
+        return "|b1";
+    else if constexpr(std::is_floating_point_v<T>)
+        return endianness + "f" + std::to_string(sizeof(T));
+    else if constexpr(std::is_integral_v<T>)
+        return endianness + (std::is_signed_v<T> ? "i" : "u") + std::to_string(sizeof(T));
+    else
+        return "|V" + std::to_string(sizeof(T));
+}
 
 template <typename T>
 class MmapFileAllocator : public Allocator<T>
 {
 public:
+    // Page aligned, also with FileLayout::npy: .npy files written by other tools, whose data is
+    // usually only 64-byte aligned, are refused unless it starts on a page boundary.
+    static constexpr size_t alignment = min_page_size;
+
     MmapFileAllocator(const std::string& file_name, int mmap_flags = MAP_SHARED, int open_flags = O_RDWR | O_CREAT, mode_t mode = S_IRUSR | S_IWUSR);
+    MmapFileAllocator(const std::string& file_name, FileLayout layout, int mmap_flags = MAP_SHARED, int open_flags = O_RDWR | O_CREAT, mode_t mode = S_IRUSR | S_IWUSR);
+    // Takes ownership of an open file descriptor, and maps the file as the constructors above would
+    MmapFileAllocator(adopt_t, int fd, int mmap_flags = MAP_SHARED, FileLayout layout = FileLayout::raw);
     MmapFileAllocator(const MmapFileAllocator&) = delete;
     MmapFileAllocator(MmapFileAllocator&&) noexcept;
     MmapFileAllocator& operator=(MmapFileAllocator&&) noexcept;
@@ -244,15 +505,36 @@ public:
 
     void resize(size_t new_size) override;
     size_t get_backing_size() const override;
+    int get_fd() const override;
+    size_t get_fd_offset() const override;
     void sync(size_t used_elements) override;
+    void flush(size_t used_elements) override;
+    void flush_range(size_t begin, size_t end) override;
+    size_t read_from_fd(int fd, size_t byte_offset, size_t max_bytes) override;
+    // The mapping is released with munmap(ptr, capacity * sizeof(T)), and the file is left at capacity
+    // elements; truncating it to the used size is up to the caller. Not supported for FileLayout::npy.
+    ReleasedBuffer<T> release() override;
+    // Neither resize() nor closing cuts the file below `elements` elements, for callers that keep the
+    // length elsewhere (Catalog's committed lengths); the elements past the vector's size stay as they are
+    void keep_file_size(size_t elements) { kept_size = elements; };
 
     friend class MmappedVector<T, MmapFileAllocator, false>;
     friend class MmappedVector<T, MmapFileAllocator, true>;
 private:
+    void open_file(const std::string& file_name, int open_flags, mode_t mode);
+    void map_file(int fd, int mmap_flags);
+    void read_npy_header(int fd, size_t file_size);
+    void write_npy_header(size_t shape) const;
     void self_close() noexcept;
+    char* mapping() const;
     std::string file_name;
     int file_descriptor;
+    int mmap_flags;
     size_t backing_size;
+    FileLayout layout = FileLayout::raw;
+    // Where the elements start in the file; 0 for FileLayout::raw
+    size_t data_offset = 0;
+    size_t kept_size = 0;
 };
 
 template <typename T> inline
@@ -260,39 +542,146 @@ size_t MmapFileAllocator<T>::get_backing_size() const {
     return this->backing_size;
 }
 
+template <typename T> inline
+int MmapFileAllocator<T>::get_fd() const {
+    return (this->mmap_flags & MAP_SHARED) ? this->file_descriptor : -1;
+}
+
+template <typename T> inline
+size_t MmapFileAllocator<T>::get_fd_offset() const {
+    return this->data_offset;
+}
+
+// Start of the mapping, which also covers the header
+template <typename T> inline
+char* MmapFileAllocator<T>::mapping() const {
+    return reinterpret_cast<char*>(this->ptr) - this->data_offset;
+}
+
 template <typename T>
 MmapFileAllocator<T>::MmapFileAllocator(const std::string& file_name, int mmap_flags, int open_flags, mode_t mode) : Allocator<T>() {
+    open_file(file_name, open_flags, mode);
+    map_file(this->file_descriptor, mmap_flags);
+}
 
-    RAIIFileDescriptor fd(open(file_name.c_str(), open_flags, mode));
-    if (fd.get() == -1) {
+template <typename T>
+MmapFileAllocator<T>::MmapFileAllocator(const std::string& file_name, FileLayout layout, int mmap_flags, int open_flags, mode_t mode) : Allocator<T>(), layout(layout) {
+    open_file(file_name, open_flags, mode);
+    map_file(this->file_descriptor, mmap_flags);
+}
+
+template <typename T>
+MmapFileAllocator<T>::MmapFileAllocator(adopt_t, int fd, int mmap_flags, FileLayout layout) : Allocator<T>(), file_descriptor(fd), layout(layout) {
+    map_file(fd, mmap_flags);
+}
+
+template <typename T>
+void MmapFileAllocator<T>::open_file(const std::string& file_name, int open_flags, mode_t mode) {
+    this->file_descriptor = open(file_name.c_str(), open_flags, mode);
+    if (this->file_descriptor == -1) {
         std::string error_message = "MmapFileAllocator::ctor: " + file_name + ": " + mmapped_vector::get_error_message("open");
         throw std::runtime_error(error_message);
     }
+    this->file_name = file_name;
+}
 
+// Takes ownership of fd, and closes it if mapping fails
+template <typename T>
+void MmapFileAllocator<T>::map_file(int fd, int mmap_flags) {
+    RAIIFileDescriptor owned_fd(fd);
+    detail::check_page_size();
     struct stat st;
-    if (fstat(fd.get(), &st) == -1)
+    if (fstat(fd, &st) == -1)
         throw std::runtime_error("MmapFileAllocator::ctor: fstat failed: " + mmapped_vector::get_error_message("fstat"));
 
-    if(st.st_size % sizeof(T) != 0)
-        throw std::runtime_error("MmapFileAllocator::ctor: file size is not a multiple of sizeof(T). It's probably corrupted.");
-
-    this->backing_size = st.st_size / sizeof(T);
-    this->capacity = this->backing_size;
+    if (layout == FileLayout::npy) {
+        read_npy_header(fd, st.st_size);
+        this->capacity = static_cast<size_t>(st.st_size) > this->data_offset ? (st.st_size - this->data_offset) / sizeof(T) : 0;
+    } else {
+        if(st.st_size % sizeof(T) != 0)
+            throw std::runtime_error("MmapFileAllocator::ctor: file size is not a multiple of sizeof(T). It's probably corrupted.");
+        this->backing_size = st.st_size / sizeof(T);
+        this->capacity = this->backing_size;
+    }
     if(this->capacity < 16)
     {
         this->capacity = 16;
-        if(ftruncate(fd.get(), this->capacity * sizeof(T)) == -1)
+        if(ftruncate(fd, this->data_offset + this->capacity * sizeof(T)) == -1)
             throw std::runtime_error("MmapFileAllocator::ctor: ftruncate failed: " + mmapped_vector::get_error_message("ftruncate"));
 
     }
 
-    this->ptr = static_cast<T*>(mmap(nullptr, this->capacity * sizeof(T), PROT_READ | PROT_WRITE, mmap_flags, fd.get(), 0));
-    if (this->ptr == MAP_FAILED)
+    void* mapped = mmap(nullptr, this->data_offset + this->capacity * sizeof(T), PROT_READ | PROT_WRITE, mmap_flags, fd, 0);
+    if (mapped == MAP_FAILED)
         throw std::runtime_error("MmapFileAllocator::ctor: mmap failed: " + mmapped_vector::get_error_message("mmap"));
+    this->ptr = reinterpret_cast<T*>(static_cast<char*>(mapped) + this->data_offset);
 
-    this->file_name = file_name;
-    this->file_descriptor = fd.release();
+    this->mmap_flags = mmap_flags;
+    owned_fd.release();
+}
 
+// Reads the header of an existing .npy file, or writes one to an empty file
+template <typename T>
+void MmapFileAllocator<T>::read_npy_header(int fd, size_t file_size) {
+    if (file_size == 0) {
+        this->data_offset = page_size;
+        this->backing_size = 0;
+        this->file_descriptor = fd;
+        write_npy_header(0);
+        return;
+    }
+
+    const std::string error_prefix = "MmapFileAllocator::ctor: " + this->file_name + ": ";
+    char preamble[10];
+    if (file_size < sizeof(preamble) || pread(fd, preamble, sizeof(preamble), 0) != sizeof(preamble) || std::memcmp(preamble, "\x93NUMPY", 6) != 0)
+        throw std::runtime_error(error_prefix + "not a .npy file");
+    if (preamble[6] != 1)
+        throw std::runtime_error(error_prefix + "unsupported .npy format version " + std::to_string(preamble[6]));
+    size_t header_length = static_cast<unsigned char>(preamble[8]) | static_cast<unsigned char>(preamble[9]) << 8;
+    this->data_offset = sizeof(preamble) + header_length;
+    if (this->data_offset > file_size || this->data_offset % 64 != 0)
+        throw std::runtime_error(error_prefix + "malformed .npy header");
+    if (this->data_offset % alignment != 0)
+        throw std::runtime_error(error_prefix + "the data of the .npy file is not page aligned");
+
+    std::string header(header_length, '\0');
+    if (pread(fd, header.data(), header_length, sizeof(preamble)) != static_cast<ssize_t>(header_length))
+        throw std::runtime_error(error_prefix + "failed to read the .npy header: " + mmapped_vector::get_error_message("pread"));
+    auto field = [&](const std::string& key) {
+        size_t begin = header.find("'" + key + "':");
+        if (begin == std::string::npos)
+            throw std::runtime_error(error_prefix + "the .npy header has no " + key);
+        begin = header.find_first_not_of(' ', begin + key.size() + 3);
+        size_t end = header[begin] == '(' ? header.find(')', begin) + 1 : header.find_first_of(",}", begin);
+        return header.substr(begin, end - begin);
+    };
+    std::string descr = field("descr");
+    if (descr.size() < 2 || descr.substr(1, descr.size() - 2) != npy_descr<T>())
+        throw std::runtime_error(error_prefix + "element type mismatch (stored: " + descr + ", expected: " + npy_descr<T>() + ")");
+    if (field("fortran_order") != "False")
+        throw std::runtime_error(error_prefix + "Fortran-ordered arrays are not supported");
+    std::string shape = field("shape");
+    size_t elements;
+    int consumed = 0;
+    if (sscanf(shape.c_str(), "(%zu,)%n", &elements, &consumed) != 1 || consumed != static_cast<int>(shape.size()))
+        throw std::runtime_error(error_prefix + "only one-dimensional arrays are supported, shape is " + shape);
+    if (elements > (file_size - this->data_offset) / sizeof(T))
+        throw std::runtime_error(error_prefix + "file is shorter than the shape in its header. It's probably corrupted.");
+    this->backing_size = elements;
+}
+
+// The header is padded with spaces to fill the space before data_offset, which doesn't change
+template <typename T>
+void MmapFileAllocator<T>::write_npy_header(size_t shape) const {
+    std::string header = "{'descr': '" + npy_descr<T>() + "', 'fortran_order': False, 'shape': (" + std::to_string(shape) + ",), }";
+    size_t header_length = this->data_offset - 10;
+    if (header.size() + 1 > header_length)
+        throw std::runtime_error("MmapFileAllocator: " + this->file_name + ": the .npy header doesn't fit before the data");
+    header.resize(header_length - 1, ' ');
+    header += '\n';
+    std::string contents = std::string("\x93NUMPY\x01\x00", 8) + static_cast<char>(header_length & 0xff) + static_cast<char>(header_length >> 8) + header;
+    if (pwrite(this->file_descriptor, contents.data(), contents.size(), 0) != static_cast<ssize_t>(contents.size()))
+        throw std::runtime_error("MmapFileAllocator: " + this->file_name + ": failed to write the .npy header: " + mmapped_vector::get_error_message("pwrite"));
 }
 
 template <typename T>
@@ -302,6 +691,10 @@ MmapFileAllocator<T>::MmapFileAllocator(MmapFileAllocator&& other) noexcept : Al
     this->backing_size = other.backing_size;
     this->file_name = std::move(other.file_name);
     this->file_descriptor = other.file_descriptor;
+    this->mmap_flags = other.mmap_flags;
+    this->layout = other.layout;
+    this->data_offset = other.data_offset;
+    this->kept_size = other.kept_size;
     other.ptr = nullptr;
     other.capacity = 0;
     other.backing_size = 0;
@@ -317,6 +710,10 @@ MmapFileAllocator<T>& MmapFileAllocator<T>::operator=(MmapFileAllocator&& other)
         this->backing_size = other.backing_size;
         this->file_name = std::move(other.file_name);
         this->file_descriptor = other.file_descriptor;
+        this->mmap_flags = other.mmap_flags;
+        this->layout = other.layout;
+        this->data_offset = other.data_offset;
+        this->kept_size = other.kept_size;
         other.ptr = nullptr;
         other.capacity = 0;
         other.backing_size = 0;
@@ -328,8 +725,17 @@ MmapFileAllocator<T>& MmapFileAllocator<T>::operator=(MmapFileAllocator&& other)
 template <typename T>
 void MmapFileAllocator<T>::self_close() noexcept {
     if (this->ptr) {
-        this->resize(this->get_backing_size()); // Truncate the file to the actual size
-        munmap(this->ptr, this->get_backing_size() * sizeof(T));
+        munmap(mapping(), this->data_offset + this->capacity * sizeof(T));
+        // Truncate the file to the actual size. Not done through resize(), which can't map 0 bytes.
+        if (ftruncate(this->file_descriptor, this->data_offset + std::max(this->get_backing_size(), kept_size) * sizeof(T)) == -1)
+            std::cerr << "MmapFileAllocator::self_close: " << mmapped_vector::get_error_message("ftruncate") << std::endl;
+        if (layout == FileLayout::npy) {
+            try {
+                write_npy_header(this->backing_size);
+            } catch (const std::exception& e) {
+                std::cerr << "MmapFileAllocator::self_close: " << e.what() << std::endl;
+            }
+        }
         this->ptr = nullptr;
         this->backing_size = 0;
         this->capacity = 0;
@@ -350,42 +756,279 @@ template <typename T>
 void MmapFileAllocator<T>::resize(size_t new_capacity) {
     if (new_capacity == this->capacity) return;
 
-    if (ftruncate(this->file_descriptor, new_capacity * sizeof(T)) == -1)
+    // The file may stay longer than the mapping
+    if (ftruncate(this->file_descriptor, this->data_offset + std::max(new_capacity, kept_size) * sizeof(T)) == -1)
         throw std::runtime_error("MmapFileAllocator::resize: ftruncate failed: " + mmapped_vector::get_error_message("ftruncate"));
 
 #ifdef MREMAP_MAYMOVE
-    void* new_ptr = mremap(this->ptr, this->capacity * sizeof(T), new_capacity * sizeof(T), MREMAP_MAYMOVE);
+    void* new_ptr = mremap(mapping(), this->data_offset + this->capacity * sizeof(T), this->data_offset + new_capacity * sizeof(T), MREMAP_MAYMOVE);
     if (new_ptr == MAP_FAILED) {
         throw std::runtime_error("MmapFileAllocator: mremap failed: " + mmapped_vector::get_error_message("mremap"));
     }
 #else
-    if(munmap(this->ptr, this->capacity * sizeof(T)) == -1)
+    if(munmap(mapping(), this->data_offset + this->capacity * sizeof(T)) == -1)
         throw std::runtime_error("MmapFileAllocator::resize: munmap failed: " + mmapped_vector::get_error_message("munmap"));
-    void* new_ptr = mmap(nullptr, new_capacity * sizeof(T), PROT_READ | PROT_WRITE, MAP_SHARED, this->file_descriptor, 0);
+    void* new_ptr = mmap(nullptr, this->data_offset + new_capacity * sizeof(T), PROT_READ | PROT_WRITE, this->mmap_flags, this->file_descriptor, 0);
     if (new_ptr == MAP_FAILED) {
         throw std::runtime_error("MmapFileAllocator::resize: mmap failed: " + mmapped_vector::get_error_message("mmap"));
     }
 #endif
 
-    this->ptr = static_cast<T*>(new_ptr);
+    this->ptr = reinterpret_cast<T*>(static_cast<char*>(new_ptr) + this->data_offset);
     this->capacity = new_capacity;
 }
 
 template <typename T>
 void MmapFileAllocator<T>::sync(size_t used_elements) {
+    if (layout == FileLayout::npy && used_elements != this->backing_size)
+        write_npy_header(used_elements);
     this->backing_size = used_elements;
 }
 
+// The elements go to disk before the header that counts them. The header is written with pwrite(),
+// not through the mapping, and the msync() of the elements may not cover its page.
+template <typename T>
+void MmapFileAllocator<T>::flush(size_t used_elements) {
+    flush_range(0, used_elements);
+    sync(used_elements);
+    if (layout == FileLayout::npy && fdatasync(this->file_descriptor) == -1)
+        throw std::runtime_error("MmapFileAllocator::flush: fdatasync failed: " + mmapped_vector::get_error_message("fdatasync"));
+}
+
+template <typename T>
+ReleasedBuffer<T> MmapFileAllocator<T>::release() {
+    if (this->data_offset != 0)
+        throw std::runtime_error("MmapFileAllocator::release: not supported for files with a header");
+    ReleasedBuffer<T> buffer{this->ptr, 0, this->capacity, this->file_descriptor, [](T* ptr, size_t capacity) { munmap(ptr, capacity * sizeof(T)); }};
+    this->ptr = nullptr;
+    this->capacity = 0;
+    this->backing_size = 0;
+    this->file_descriptor = -1;
+    return buffer;
+}
+
+// Writes elements [begin, end) of the mapping back to the file and waits until they're on stable storage
+template <typename T>
+void MmapFileAllocator<T>::flush_range(size_t begin, size_t end) {
+    if (begin >= end)
+        return;
+    size_t first_byte = (this->data_offset + begin * sizeof(T)) / page_size * page_size;
+    size_t last_byte = this->data_offset + end * sizeof(T);
+    if (msync(mapping() + first_byte, last_byte - first_byte, MS_SYNC) == -1)
+        throw std::runtime_error("MmapFileAllocator::flush_range: msync failed: " + mmapped_vector::get_error_message("msync"));
+}
+
+// For shared mappings of regular files, copy_file_range() moves the data into the backing file inside
+// the kernel, and the mapping sees it through the page cache. Anything else falls back to read().
+template <typename T>
+size_t MmapFileAllocator<T>::read_from_fd(int fd, size_t byte_offset, size_t max_bytes) {
+#ifdef __linux__
+    struct stat st;
+    if ((this->mmap_flags & MAP_SHARED) && fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        loff_t out_offset = this->data_offset + byte_offset;
+        size_t total = 0;
+        while (total < max_bytes) {
+            ssize_t bytes = copy_file_range(fd, nullptr, this->file_descriptor, &out_offset, max_bytes - total, 0);
+            if (bytes == 0)
+                return total;
+            if (bytes == -1) {
+                if (errno == EINTR)
+                    continue;
+                if (total == 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP || errno == EBADF))
+                    break;
+                throw std::runtime_error("MmapFileAllocator::read_from_fd: copy_file_range failed: " + mmapped_vector::get_error_message("copy_file_range"));
+            }
+            total += bytes;
+        }
+        if (total > 0)
+            return total;
+    }
+#endif
+    return Allocator<T>::read_from_fd(fd, byte_offset, max_bytes);
+}
+
 /*
  * =================================================================================================
  */
 
+#ifdef __linux__
+
+// Anonymous memory like MmapAllocator, but backed by a memfd and mapped shared, so the same pages
+// can be mapped again through the file descriptor (for snapshots, or by another process).
+template <typename T>
+class MmapMemfdAllocator : public Allocator<T>
+{
+public:
+    static constexpr size_t alignment = min_page_size;
+
+    MmapMemfdAllocator(const std::string& name = "mmapped_vector");
+    // Takes ownership of memfd `fd`, whose first `size` elements are in use
+    MmapMemfdAllocator(adopt_t, int fd, size_t size);
+    MmapMemfdAllocator(const MmapMemfdAllocator&) = delete;
+    MmapMemfdAllocator(MmapMemfdAllocator&&) noexcept;
+    MmapMemfdAllocator& operator=(MmapMemfdAllocator&& other) noexcept;
+    ~MmapMemfdAllocator() override;
+    MmapMemfdAllocator& operator=(const MmapMemfdAllocator&) = delete;
+
+    void resize(size_t new_size) override;
+    size_t get_backing_size() const override;
+    int get_fd() const override;
+    // The mapping is released with munmap(ptr, capacity * sizeof(T)), together with the memfd
+    ReleasedBuffer<T> release() override;
+
+    friend class MmappedVector<T, MmapMemfdAllocator, false>;
+    friend class MmappedVector<T, MmapMemfdAllocator, true>;
+private:
+    void self_close() noexcept;
+    int file_descriptor;
+    size_t backing_size = 0;
+};
+
+template <typename T>
+MmapMemfdAllocator<T>::MmapMemfdAllocator(const std::string& name) : Allocator<T>() {
+    detail::check_page_size();
+    RAIIFileDescriptor fd(memfd_create(name.c_str(), MFD_CLOEXEC));
+    if (fd.get() == -1)
+        throw std::runtime_error("MmapMemfdAllocator::ctor: " + mmapped_vector::get_error_message("memfd_create"));
+
+    size_t capacity = std::max<size_t>(page_size / sizeof(T), 1);
+    if (ftruncate(fd.get(), capacity * sizeof(T)) == -1)
+        throw std::runtime_error("MmapMemfdAllocator::ctor: ftruncate failed: " + mmapped_vector::get_error_message("ftruncate"));
+
+    this->ptr = static_cast<T*>(mmap(nullptr, capacity * sizeof(T), PROT_READ | PROT_WRITE, MAP_SHARED, fd.get(), 0));
+    if (this->ptr == MAP_FAILED)
+        throw std::runtime_error("MmapMemfdAllocator::ctor: mmap failed: " + mmapped_vector::get_error_message("mmap"));
+
+    this->capacity = capacity;
+    this->file_descriptor = fd.release();
+}
+
+template <typename T>
+MmapMemfdAllocator<T>::MmapMemfdAllocator(adopt_t, int fd, size_t size) : Allocator<T>() {
+    RAIIFileDescriptor owned_fd(fd);
+    detail::check_page_size();
+    struct stat st;
+    if (fstat(fd, &st) == -1)
+        throw std::runtime_error("MmapMemfdAllocator::ctor: fstat failed: " + mmapped_vector::get_error_message("fstat"));
+    size_t capacity = st.st_size / sizeof(T);
+    if (capacity < size)
+        throw std::runtime_error("MmapMemfdAllocator::ctor: memfd is smaller than the adopted vector size");
+    if (capacity == 0) {
+        capacity = std::max<size_t>(page_size / sizeof(T), 1);
+        if (ftruncate(fd, capacity * sizeof(T)) == -1)
+            throw std::runtime_error("MmapMemfdAllocator::ctor: ftruncate failed: " + mmapped_vector::get_error_message("ftruncate"));
+    }
+
+    this->ptr = static_cast<T*>(mmap(nullptr, capacity * sizeof(T), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0));
+    if (this->ptr == MAP_FAILED)
+        throw std::runtime_error("MmapMemfdAllocator::ctor: mmap failed: " + mmapped_vector::get_error_message("mmap"));
+
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    this->capacity = capacity;
+    this->backing_size = size;
+    this->file_descriptor = owned_fd.release();
+}
+
+template <typename T>
+MmapMemfdAllocator<T>::MmapMemfdAllocator(MmapMemfdAllocator&& other) noexcept : Allocator<T>() {
+    this->ptr = other.ptr;
+    this->capacity = other.capacity;
+    this->file_descriptor = other.file_descriptor;
+    this->backing_size = other.backing_size;
+    other.ptr = nullptr;
+    other.capacity = 0;
+    other.file_descriptor = -1;
+}
+
+template <typename T>
+MmapMemfdAllocator<T>& MmapMemfdAllocator<T>::operator=(MmapMemfdAllocator&& other) noexcept {
+    if (this != &other) {
+        self_close();
+        this->ptr = other.ptr;
+        this->capacity = other.capacity;
+        this->file_descriptor = other.file_descriptor;
+        this->backing_size = other.backing_size;
+        other.ptr = nullptr;
+        other.capacity = 0;
+        other.file_descriptor = -1;
+    }
+    return *this;
+}
+
+template <typename T>
+void MmapMemfdAllocator<T>::self_close() noexcept {
+    if (this->ptr) {
+        munmap(this->ptr, this->capacity * sizeof(T));
+        this->ptr = nullptr;
+        this->capacity = 0;
+    }
+    if (this->file_descriptor != -1) {
+        close(this->file_descriptor);
+        this->file_descriptor = -1;
+    }
+}
 
 template <typename T>
+MmapMemfdAllocator<T>::~MmapMemfdAllocator() {
+    self_close();
+}
+
+template <typename T> inline
+size_t MmapMemfdAllocator<T>::get_backing_size() const {
+    return this->backing_size;
+}
+
+template <typename T> inline
+int MmapMemfdAllocator<T>::get_fd() const {
+    return this->file_descriptor;
+}
+
+template <typename T>
+ReleasedBuffer<T> MmapMemfdAllocator<T>::release() {
+    ReleasedBuffer<T> buffer{this->ptr, 0, this->capacity, this->file_descriptor, [](T* ptr, size_t capacity) { munmap(ptr, capacity * sizeof(T)); }};
+    this->ptr = nullptr;
+    this->capacity = 0;
+    this->backing_size = 0;
+    this->file_descriptor = -1;
+    return buffer;
+}
+
+template <typename T>
+void MmapMemfdAllocator<T>::resize(size_t new_capacity) {
+    if (new_capacity == this->capacity) return;
+
+    if (ftruncate(this->file_descriptor, new_capacity * sizeof(T)) == -1)
+        throw std::runtime_error("MmapMemfdAllocator::resize: ftruncate failed: " + mmapped_vector::get_error_message("ftruncate"));
+
+    void* new_ptr = mremap(this->ptr, this->capacity * sizeof(T), new_capacity * sizeof(T), MREMAP_MAYMOVE);
+    if (new_ptr == MAP_FAILED)
+        throw std::runtime_error("MmapMemfdAllocator::resize: mremap failed: " + mmapped_vector::get_error_message("mremap"));
+
+    this->ptr = static_cast<T*>(new_ptr);
+    this->capacity = new_capacity;
+}
+
+#endif // __linux__
+
+/*
+ * =================================================================================================
+ */
+
+
+// With the default alignment this is plain malloc()/realloc(). Larger alignments use
+// posix_memalign(); once a buffer reaches mremap_threshold bytes it moves to its own anonymous
+// mapping (page aligned) and grows with mremap(), so large buffers still aren't copied on growth.
+template <typename T, size_t Alignment = alignof(std::max_align_t)>
 class MallocAllocator : public Allocator<T>
 {
+    static_assert((Alignment & (Alignment - 1)) == 0, "Alignment must be a power of two");
 public:
+    static constexpr size_t alignment = std::max(Alignment, alignof(T));
+    static constexpr size_t mremap_threshold = 128 * 1024;
+
     MallocAllocator();
+    // Takes ownership of a malloc()ed buffer of `capacity` elements, the first `size` of which are in use
+    MallocAllocator(adopt_t, T* ptr, size_t size, size_t capacity);
     MallocAllocator(const MallocAllocator&) = delete;   // Copy constructor is not allowed unless elided
     MallocAllocator(MallocAllocator&&) noexcept;
     MallocAllocator& operator=(MallocAllocator&&) noexcept;
@@ -393,14 +1036,29 @@ public:
     MallocAllocator& operator=(const MallocAllocator&) = delete;
 
     void resize(size_t new_size) override;
+    size_t get_backing_size() const override;
+    // The memory is released with free(), unless it had moved to its own mapping
+    ReleasedBuffer<T> release() override;
 
     friend class MmappedVector<T, MallocAllocator, false>;
     friend class MmappedVector<T, MallocAllocator, true>;
+private:
+    static constexpr bool over_aligned = alignment > alignof(std::max_align_t);
+    void deallocate() noexcept;
+    size_t backing_size = 0;
+    bool mapped = false;
 };
 
-template <typename T>
-MallocAllocator<T>::MallocAllocator() : Allocator<T>() {
-    this->ptr = static_cast<T*>(malloc(16 * sizeof(T)));
+template <typename T, size_t Alignment>
+MallocAllocator<T, Alignment>::MallocAllocator() : Allocator<T>() {
+    if constexpr(over_aligned) {
+        void* new_ptr = nullptr;
+        if (posix_memalign(&new_ptr, alignment, 16 * sizeof(T)) != 0)
+            throw std::runtime_error("MallocAllocator: posix_memalign failed");
+        this->ptr = static_cast<T*>(new_ptr);
+    } else {
+        this->ptr = static_cast<T*>(malloc(16 * sizeof(T)));
+    }
     if (!this->ptr) {
         throw std::runtime_error("MallocAllocator: malloc failed");
     }
@@ -408,45 +1066,100 @@ MallocAllocator<T>::MallocAllocator() : Allocator<T>() {
 
 }
 
-template <typename T>
-MallocAllocator<T>::MallocAllocator(MallocAllocator&& other) noexcept : Allocator<T>() {
+template <typename T, size_t Alignment>
+MallocAllocator<T, Alignment>::MallocAllocator(adopt_t, T* ptr, size_t size, size_t capacity) : Allocator<T>() {
+    if (size > capacity)
+        throw std::invalid_argument("MallocAllocator::ctor: adopted size exceeds capacity");
+    if (reinterpret_cast<uintptr_t>(ptr) % alignment != 0)
+        throw std::invalid_argument("MallocAllocator::ctor: adopted buffer is not sufficiently aligned");
+    this->ptr = ptr;
+    this->capacity = capacity;
+    this->backing_size = size;
+}
+
+template <typename T, size_t Alignment>
+MallocAllocator<T, Alignment>::MallocAllocator(MallocAllocator&& other) noexcept : Allocator<T>() {
     this->ptr = other.ptr;
     this->capacity = other.capacity;
+    this->backing_size = other.backing_size;
+    this->mapped = other.mapped;
     other.ptr = nullptr;
     other.capacity = 0;
 }
 
-template <typename T>
-MallocAllocator<T>& MallocAllocator<T>::operator=(MallocAllocator&& other) noexcept {
+template <typename T, size_t Alignment>
+MallocAllocator<T, Alignment>& MallocAllocator<T, Alignment>::operator=(MallocAllocator&& other) noexcept {
     if (this != &other) {
-        if (this->ptr) {
-            free(this->ptr);
-        }
+        deallocate();
         this->ptr = other.ptr;
         this->capacity = other.capacity;
+        this->backing_size = other.backing_size;
+        this->mapped = other.mapped;
         other.ptr = nullptr;
         other.capacity = 0;
     }
     return *this;
 }
 
-template <typename T>
-MallocAllocator<T>::~MallocAllocator() {
-
+template <typename T, size_t Alignment>
+void MallocAllocator<T, Alignment>::deallocate() noexcept {
     if (this->ptr) {
-        free(this->ptr);
+        if (mapped)
+            munmap(this->ptr, this->capacity * sizeof(T));
+        else
+            free(this->ptr);
         this->ptr = nullptr;
         this->capacity = 0;
     }
 }
 
-template <typename T>
-void MallocAllocator<T>::resize(size_t new_capacity) {
+template <typename T, size_t Alignment>
+MallocAllocator<T, Alignment>::~MallocAllocator() {
+    deallocate();
+}
+
+template <typename T, size_t Alignment> inline
+size_t MallocAllocator<T, Alignment>::get_backing_size() const {
+    return this->backing_size;
+}
+
+template <typename T, size_t Alignment>
+ReleasedBuffer<T> MallocAllocator<T, Alignment>::release() {
+    ReleasedBuffer<T> buffer{this->ptr, 0, this->capacity, -1, [](T* ptr, size_t) { free(ptr); }};
+    if (mapped)
+        buffer.deallocate = [](T* ptr, size_t capacity) { munmap(ptr, capacity * sizeof(T)); };
+    this->ptr = nullptr;
+    this->capacity = 0;
+    mapped = false;
+    return buffer;
+}
+
+template <typename T, size_t Alignment>
+void MallocAllocator<T, Alignment>::resize(size_t new_capacity) {
     if (new_capacity == this->capacity) return;
 
-    void* new_ptr = realloc(this->ptr, new_capacity * sizeof(T));
-    if (!new_ptr) {
-        throw std::runtime_error("MallocAllocator: realloc failed");
+    void* new_ptr;
+    if constexpr(!over_aligned) {
+        new_ptr = realloc(this->ptr, new_capacity * sizeof(T));
+        if (!new_ptr) {
+            throw std::runtime_error("MallocAllocator: realloc failed");
+        }
+    } else if (mapped) {
+        new_ptr = mremap(this->ptr, this->capacity * sizeof(T), new_capacity * sizeof(T), MREMAP_MAYMOVE);
+        if (new_ptr == MAP_FAILED)
+            throw std::runtime_error("MallocAllocator::resize: mremap failed: " + mmapped_vector::get_error_message("mremap"));
+    } else {
+        bool map = new_capacity * sizeof(T) >= mremap_threshold && alignment <= page_size;
+        if (map) {
+            new_ptr = mmap(nullptr, new_capacity * sizeof(T), PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+            if (new_ptr == MAP_FAILED)
+                throw std::runtime_error("MallocAllocator::resize: mmap failed: " + mmapped_vector::get_error_message("mmap"));
+        } else if (posix_memalign(&new_ptr, alignment, new_capacity * sizeof(T)) != 0) {
+            throw std::runtime_error("MallocAllocator: posix_memalign failed");
+        }
+        std::memcpy(new_ptr, this->ptr, std::min(this->capacity, new_capacity) * sizeof(T));
+        free(this->ptr);
+        mapped = map;
     }
 
     this->ptr = static_cast<T*>(new_ptr);
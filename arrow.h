@@ -0,0 +1,735 @@
+/**
+ * @file arrow.h
+ * @brief Writing columns in the Arrow IPC file format, and mapping such files back without copying.
+ * @author Michał Startek
+ * @version 0.1
+ * @copyright Copyright (c) Michał Startek 2024
+ */
+
+#ifndef MMAPPED_VECTOR_ARROW_H
+#define MMAPPED_VECTOR_ARROW_H
+
+#include <algorithm>
+#include <bit>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "mmapped_vector.h"
+
+
+namespace mmapped_vector {
+
+/*
+ * File layout (https://arrow.apache.org/docs/format/Columnar.html#ipc-file-format):
+ *
+ *   "ARROW1\0\0"
+ *   schema message
+ *   record batch message, for every write_batch()
+ *   end-of-stream marker
+ *   footer (schema, and where the record batches are), footer length, "ARROW1"
+ *
+ * A message is 0xFFFFFFFF, the length of its flatbuffer metadata, the metadata, and then the body
+ * holding the column buffers. Bodies and the buffers in them start at 64-byte boundaries.
+ * Supported columns are fixed-width integers and floats, and UTF-8 strings with int32 offsets,
+ * all with optional validity bitmaps. Only little-endian hosts are supported.
+ */
+
+enum class ArrowType : uint8_t { int8, uint8, int16, uint16, int32, uint32, int64, uint64, float32, float64, utf8 };
+
+template <typename T>
+constexpr ArrowType arrow_type_of() {
+    if constexpr(std::is_same_v<T, int8_t>) return ArrowType::int8;
+    else if constexpr(std::is_same_v<T, uint8_t>) return ArrowType::uint8;
+    else if constexpr(std::is_same_v<T, int16_t>) return ArrowType::int16;
+    else if constexpr(std::is_same_v<T, uint16_t>) return ArrowType::uint16;
+    else if constexpr(std::is_same_v<T, int32_t>) return ArrowType::int32;
+    else if constexpr(std::is_same_v<T, uint32_t>) return ArrowType::uint32;
+    else if constexpr(std::is_same_v<T, int64_t>) return ArrowType::int64;
+    else if constexpr(std::is_same_v<T, uint64_t>) return ArrowType::uint64;
+    else if constexpr(std::is_same_v<T, float>) return ArrowType::float32;
+    else if constexpr(std::is_same_v<T, double>) return ArrowType::float64;
+    else static_assert(sizeof(T) == 0, "no Arrow type for T");
+}
+
+struct ArrowField {
+    std::string name;
+    ArrowType type;
+    bool nullable = false;
+
+    template <typename T>
+    static ArrowField of(const std::string& name, bool nullable = false) { return ArrowField{name, arrow_type_of<T>(), nullable}; };
+    static ArrowField utf8(const std::string& name, bool nullable = false) { return ArrowField{name, ArrowType::utf8, nullable}; };
+};
+
+// One column of a record batch. For primitive columns, values points at the elements; for utf8
+// columns, at the character data, with offsets holding length + 1 positions into it.
+// validity is a bitmap, least significant bit first, with 1 meaning "not null"; nullptr if all valid.
+struct ArrowColumnData {
+    const void* values;
+    const uint8_t* validity = nullptr;
+    const int32_t* offsets = nullptr;
+
+    template <typename V>
+    static ArrowColumnData of(const V& vec, const uint8_t* validity = nullptr) { return ArrowColumnData{vec.data(), validity, nullptr}; };
+};
+
+namespace detail {
+
+/*
+ * Just enough of a flatbuffer builder for Arrow's metadata. Objects are written front to back:
+ * a table first, then the objects it refers to, so that every offset points forward as the format
+ * requires, and is patched in once the target's position is known.
+ */
+struct FlatObject {
+    enum Kind { table, string, struct_vector, table_vector } kind = table;
+
+    struct Scalar { uint16_t id; uint8_t size; uint64_t bits; };
+    std::vector<Scalar> scalars;
+    std::vector<std::pair<uint16_t, std::shared_ptr<FlatObject>>> children;
+    // string, struct_vector: contents; table_vector: elements
+    std::string bytes;
+    size_t count = 0;
+    std::vector<std::shared_ptr<FlatObject>> elements;
+
+    template <typename S>
+    FlatObject& add(uint16_t id, S value) {
+        uint64_t bits = 0;
+        std::memcpy(&bits, &value, sizeof(S));
+        scalars.push_back({id, sizeof(S), bits});
+        return *this;
+    };
+    FlatObject& add(uint16_t id, std::shared_ptr<FlatObject> child) {
+        children.emplace_back(id, std::move(child));
+        return *this;
+    };
+};
+
+using FlatPtr = std::shared_ptr<FlatObject>;
+
+inline FlatPtr flat_table() {
+    return std::make_shared<FlatObject>();
+}
+
+inline FlatPtr flat_string(const std::string& text) {
+    auto object = std::make_shared<FlatObject>();
+    object->kind = FlatObject::string;
+    object->bytes = text;
+    object->count = text.size();
+    return object;
+}
+
+// Structs are passed as their raw little-endian bytes; all of Arrow's are 8-byte aligned
+template <typename S>
+FlatPtr flat_struct_vector(const std::vector<S>& structs) {
+    auto object = std::make_shared<FlatObject>();
+    object->kind = FlatObject::struct_vector;
+    object->bytes.assign(reinterpret_cast<const char*>(structs.data()), structs.size() * sizeof(S));
+    object->count = structs.size();
+    return object;
+}
+
+inline FlatPtr flat_table_vector(std::vector<FlatPtr> tables) {
+    auto object = std::make_shared<FlatObject>();
+    object->kind = FlatObject::table_vector;
+    object->count = tables.size();
+    object->elements = std::move(tables);
+    return object;
+}
+
+class FlatBuilder
+{
+public:
+    // The finished buffer: root offset, then the objects
+    static std::string finish(const FlatObject& root) {
+        FlatBuilder builder;
+        builder.out.assign(4, '\0');
+        builder.patch(0, builder.write(root));
+        return std::move(builder.out);
+    };
+
+private:
+    std::string out;
+
+    void align(size_t alignment, size_t extra = 0) {
+        while ((out.size() + extra) % alignment != 0)
+            out.push_back('\0');
+    };
+    template <typename S>
+    void put(size_t position, S value) {
+        std::memcpy(out.data() + position, &value, sizeof(S));
+    };
+    void patch(size_t position, size_t target) {
+        put<uint32_t>(position, target - position);
+    };
+
+    size_t write(const FlatObject& object) {
+        switch (object.kind) {
+        case FlatObject::string: {
+            align(4);
+            size_t position = out.size();
+            out.append(4, '\0');
+            put<uint32_t>(position, object.count);
+            out += object.bytes;
+            out.push_back('\0');
+            return position;
+        }
+        case FlatObject::struct_vector: {
+            align(8, 4);
+            size_t position = out.size();
+            out.append(4, '\0');
+            put<uint32_t>(position, object.count);
+            out += object.bytes;
+            return position;
+        }
+        case FlatObject::table_vector: {
+            align(4);
+            size_t position = out.size();
+            out.append(4 + 4 * object.count, '\0');
+            put<uint32_t>(position, object.count);
+            for (size_t i = 0; i < object.count; i++)
+                patch(position + 4 + 4 * i, write(*object.elements[i]));
+            return position;
+        }
+        case FlatObject::table:
+            break;
+        }
+
+        // Inline fields, largest first, after the offset to the vtable
+        struct Slot { uint16_t id; size_t size; uint64_t bits; const FlatObject* child; size_t offset; };
+        std::vector<Slot> slots;
+        uint16_t field_count = 0;
+        for (const auto& scalar : object.scalars) {
+            slots.push_back({scalar.id, scalar.size, scalar.bits, nullptr, 0});
+            field_count = std::max<uint16_t>(field_count, scalar.id + 1);
+        }
+        for (const auto& [id, child] : object.children) {
+            slots.push_back({id, 4, 0, child.get(), 0});
+            field_count = std::max<uint16_t>(field_count, id + 1);
+        }
+        std::stable_sort(slots.begin(), slots.end(), [](const Slot& a, const Slot& b) { return a.size > b.size; });
+        size_t table_size = 4;
+        for (Slot& slot : slots) {
+            table_size = (table_size + slot.size - 1) / slot.size * slot.size;
+            slot.offset = table_size;
+            table_size += slot.size;
+        }
+        table_size = (table_size + 3) / 4 * 4;
+
+        align(2);
+        size_t vtable = out.size();
+        out.append(4 + 2 * field_count, '\0');
+        put<uint16_t>(vtable, 4 + 2 * field_count);
+        put<uint16_t>(vtable + 2, table_size);
+        for (const Slot& slot : slots)
+            put<uint16_t>(vtable + 4 + 2 * slot.id, slot.offset);
+
+        align(8);
+        size_t position = out.size();
+        out.append(table_size, '\0');
+        put<int32_t>(position, position - vtable);
+        for (const Slot& slot : slots)
+            if (!slot.child)
+                std::memcpy(out.data() + position + slot.offset, &slot.bits, slot.size);
+        for (const Slot& slot : slots)
+            if (slot.child)
+                patch(position + slot.offset, write(*slot.child));
+        return position;
+    };
+};
+
+// Read access to a table in a flatbuffer, with every access checked against the buffer's bounds
+class FlatTable
+{
+public:
+    FlatTable(const uint8_t* buffer, size_t buffer_size, size_t position) : buffer(buffer), buffer_size(buffer_size), position(position) {
+        check(position, 4);
+        size_t vtable = position - load<int32_t>(position);
+        check(vtable, 4);
+        vtable_position = vtable;
+        vtable_size = load<uint16_t>(vtable);
+        check(vtable, vtable_size);
+    };
+
+    static FlatTable root(const uint8_t* buffer, size_t buffer_size) {
+        FlatTable dummy(buffer, buffer_size);
+        return FlatTable(buffer, buffer_size, dummy.load<uint32_t>(0));
+    };
+
+    template <typename S>
+    S scalar(uint16_t id, S default_value = S()) const {
+        size_t offset = field_offset(id);
+        return offset ? load<S>(position + offset) : default_value;
+    };
+    bool has(uint16_t id) const { return field_offset(id) != 0; };
+    FlatTable table(uint16_t id) const { return FlatTable(buffer, buffer_size, target(id)); };
+    std::string string(uint16_t id) const {
+        if (!has(id))
+            return "";
+        size_t at = target(id);
+        uint32_t length = load<uint32_t>(at);
+        check(at + 4, length);
+        return std::string(reinterpret_cast<const char*>(buffer + at + 4), length);
+    };
+    size_t vector_length(uint16_t id) const { return has(id) ? load<uint32_t>(target(id)) : 0; };
+    FlatTable table_element(uint16_t id, size_t index) const {
+        size_t element = target(id) + 4 + 4 * index;
+        return FlatTable(buffer, buffer_size, element + load<uint32_t>(element));
+    };
+    template <typename S>
+    S struct_element(uint16_t id, size_t index) const { return load<S>(target(id) + 4 + sizeof(S) * index); };
+
+private:
+    FlatTable(const uint8_t* buffer, size_t buffer_size) : buffer(buffer), buffer_size(buffer_size), position(0), vtable_position(0), vtable_size(0) {};
+
+    void check(size_t at, size_t length) const {
+        if (at > buffer_size || length > buffer_size - at)
+            throw std::runtime_error("ArrowFileReader: malformed flatbuffer metadata");
+    };
+    template <typename S>
+    S load(size_t at) const {
+        check(at, sizeof(S));
+        S value;
+        std::memcpy(&value, buffer + at, sizeof(S));
+        return value;
+    };
+    uint16_t field_offset(uint16_t id) const {
+        return 4 + 2 * id < vtable_size ? load<uint16_t>(vtable_position + 4 + 2 * id) : 0;
+    };
+    size_t target(uint16_t id) const {
+        size_t offset = field_offset(id);
+        if (!offset)
+            throw std::runtime_error("ArrowFileReader: required metadata field is missing");
+        return position + offset + load<uint32_t>(position + offset);
+    };
+
+    const uint8_t* buffer;
+    size_t buffer_size;
+    size_t position;
+    size_t vtable_position;
+    uint16_t vtable_size;
+};
+
+// Structs of the Arrow schema, as laid out in flatbuffers
+struct ArrowBlock { int64_t offset; int32_t metadata_length; int32_t padding; int64_t body_length; };
+struct ArrowFieldNode { int64_t length; int64_t null_count; };
+struct ArrowBuffer { int64_t offset; int64_t length; };
+
+// Ids of union members and enums from Schema.fbs and Message.fbs
+enum : uint8_t { arrow_type_int = 2, arrow_type_floating_point = 3, arrow_type_utf8 = 5 };
+enum : uint8_t { arrow_header_schema = 1, arrow_header_record_batch = 3 };
+static constexpr int16_t arrow_metadata_version = 4;    // V5
+static constexpr size_t arrow_alignment = 64;
+static constexpr char arrow_magic[] = "ARROW1";
+
+inline size_t arrow_element_size(ArrowType type) {
+    switch (type) {
+    case ArrowType::int8: case ArrowType::uint8: return 1;
+    case ArrowType::int16: case ArrowType::uint16: return 2;
+    case ArrowType::int32: case ArrowType::uint32: case ArrowType::float32: return 4;
+    case ArrowType::int64: case ArrowType::uint64: case ArrowType::float64: return 8;
+    case ArrowType::utf8: return 1;
+    }
+    return 0;
+}
+
+inline FlatPtr arrow_schema(const std::vector<ArrowField>& fields) {
+    std::vector<FlatPtr> field_tables;
+    for (const ArrowField& field : fields) {
+        FlatPtr type = flat_table();
+        uint8_t type_type;
+        switch (field.type) {
+        case ArrowType::float32:
+        case ArrowType::float64:
+            type_type = arrow_type_floating_point;
+            type->add<int16_t>(0, field.type == ArrowType::float32 ? 1 : 2);
+            break;
+        case ArrowType::utf8:
+            type_type = arrow_type_utf8;
+            break;
+        default:
+            type_type = arrow_type_int;
+            type->add<int32_t>(0, 8 * arrow_element_size(field.type));
+            type->add<uint8_t>(1, static_cast<uint8_t>(field.type) % 2 == 0);
+        }
+        FlatPtr table = flat_table();
+        table->add(0, flat_string(field.name)).add<uint8_t>(1, field.nullable).add<uint8_t>(2, type_type).add(3, type);
+        table->add(5, flat_table_vector({}));
+        field_tables.push_back(table);
+    }
+    FlatPtr schema = flat_table();
+    schema->add<int16_t>(0, 0).add(1, flat_table_vector(std::move(field_tables)));
+    return schema;
+}
+
+inline ArrowField arrow_field(const FlatTable& table) {
+    ArrowField field{table.string(0), ArrowType::utf8, table.scalar<uint8_t>(1) != 0};
+    uint8_t type_type = table.scalar<uint8_t>(2);
+    if (type_type == arrow_type_utf8)
+        return field;
+    FlatTable type = table.table(3);
+    if (type_type == arrow_type_floating_point) {
+        int16_t precision = type.scalar<int16_t>(0);
+        if (precision != 1 && precision != 2)
+            throw std::runtime_error("ArrowFileReader: " + field.name + ": unsupported floating point precision");
+        field.type = precision == 1 ? ArrowType::float32 : ArrowType::float64;
+    } else if (type_type == arrow_type_int) {
+        int32_t bit_width = type.scalar<int32_t>(0);
+        bool is_signed = type.scalar<uint8_t>(1) != 0;
+        if (bit_width != 8 && bit_width != 16 && bit_width != 32 && bit_width != 64)
+            throw std::runtime_error("ArrowFileReader: " + field.name + ": unsupported integer width");
+        field.type = static_cast<ArrowType>(2 * std::countr_zero(static_cast<unsigned>(bit_width / 8)) + !is_signed);
+    } else {
+        throw std::runtime_error("ArrowFileReader: " + field.name + ": unsupported column type");
+    }
+    return field;
+}
+
+} // namespace detail
+
+/*
+ * =================================================================================================
+ * Writing
+ */
+
+// Writes the schema on construction, a record batch per write_batch(), and the footer on close().
+// The file grows through an MmapFileAllocator, and column data is copied straight into the mapping.
+class ArrowFileWriter
+{
+public:
+    ArrowFileWriter(const std::string& file_name, std::vector<ArrowField> fields);
+    ArrowFileWriter(const ArrowFileWriter&) = delete;
+    ArrowFileWriter& operator=(const ArrowFileWriter&) = delete;
+    ~ArrowFileWriter();
+
+    // Appends a record batch of `length` rows, with one entry of `columns` per field
+    void write_batch(size_t length, const std::vector<ArrowColumnData>& columns);
+
+    // Writes the footer; the file is complete only after this
+    void close();
+
+private:
+    // Returns the offset the bytes were written at
+    size_t append(const void* data, size_t length);
+    void pad_to(size_t alignment);
+    // Writes a message's metadata, padded so the body that follows starts on a 64-byte boundary
+    int32_t write_metadata(const std::string& flatbuffer);
+
+    MmapFileAllocator<uint8_t> file;
+    size_t used = 0;
+    std::vector<ArrowField> fields;
+    std::vector<detail::ArrowBlock> batches;
+    bool closed = false;
+};
+
+inline ArrowFileWriter::ArrowFileWriter(const std::string& file_name, std::vector<ArrowField> fields)
+    : file(file_name, MAP_SHARED, O_RDWR | O_CREAT | O_TRUNC), fields(std::move(fields)) {
+    static_assert(std::endian::native == std::endian::little, "Arrow files are only written on little-endian hosts");
+    append(detail::arrow_magic, 6);
+    pad_to(8);
+
+    detail::FlatObject message;
+    message.add<int16_t>(0, detail::arrow_metadata_version).add<uint8_t>(1, detail::arrow_header_schema)
+           .add(2, detail::arrow_schema(this->fields)).add<int64_t>(3, 0);
+    write_metadata(detail::FlatBuilder::finish(message));
+}
+
+inline ArrowFileWriter::~ArrowFileWriter() {
+    try {
+        close();
+    } catch (const std::exception& e) {
+        std::cerr << "ArrowFileWriter::dtor: " << e.what() << std::endl;
+    }
+}
+
+inline size_t ArrowFileWriter::append(const void* data, size_t length) {
+    file.increase_capacity(used + length);
+    size_t offset = used;
+    if (length > 0)
+        std::memcpy(file.get_ptr() + used, data, length);
+    used += length;
+    return offset;
+}
+
+inline void ArrowFileWriter::pad_to(size_t alignment) {
+    static const char zeros[detail::arrow_alignment] = {};
+    append(zeros, (alignment - used % alignment) % alignment);
+}
+
+inline int32_t ArrowFileWriter::write_metadata(const std::string& flatbuffer) {
+    size_t start = used;
+    uint32_t continuation = 0xFFFFFFFF;
+    append(&continuation, 4);
+    size_t length_at = append("\0\0\0\0", 4);
+    append(flatbuffer.data(), flatbuffer.size());
+    pad_to(detail::arrow_alignment);
+    int32_t length = used - length_at - 4;
+    std::memcpy(file.get_ptr() + length_at, &length, 4);
+    return used - start;
+}
+
+inline void ArrowFileWriter::write_batch(size_t length, const std::vector<ArrowColumnData>& columns) {
+    if (closed)
+        throw std::runtime_error("ArrowFileWriter::write_batch: the file is already closed");
+    if (columns.size() != fields.size())
+        throw std::invalid_argument("ArrowFileWriter::write_batch: expected " + std::to_string(fields.size()) + " columns, got " + std::to_string(columns.size()));
+
+    // Buffer positions relative to the body, which starts on a 64-byte boundary
+    std::vector<detail::ArrowFieldNode> nodes;
+    std::vector<detail::ArrowBuffer> buffers;
+    std::vector<std::pair<const void*, size_t>> contents;
+    size_t body_length = 0;
+    auto add_buffer = [&](const void* data, size_t bytes) {
+        buffers.push_back({static_cast<int64_t>(body_length), static_cast<int64_t>(bytes)});
+        contents.emplace_back(data, bytes);
+        body_length = (body_length + bytes + detail::arrow_alignment - 1) / detail::arrow_alignment * detail::arrow_alignment;
+    };
+    for (size_t i = 0; i < fields.size(); i++) {
+        const ArrowColumnData& column = columns[i];
+        size_t null_count = 0;
+        if (column.validity) {
+            for (size_t byte = 0; byte < length / 8; byte++)
+                null_count += 8 - std::popcount(column.validity[byte]);
+            if (length % 8)
+                null_count += length % 8 - std::popcount(static_cast<unsigned>(column.validity[length / 8] & ((1u << (length % 8)) - 1)));
+            if (null_count > 0 && !fields[i].nullable)
+                throw std::invalid_argument("ArrowFileWriter::write_batch: " + fields[i].name + ": nulls in a non-nullable column");
+        }
+        nodes.push_back({static_cast<int64_t>(length), static_cast<int64_t>(null_count)});
+        add_buffer(column.validity, null_count > 0 ? (length + 7) / 8 : 0);
+        if (fields[i].type == ArrowType::utf8) {
+            if (!column.offsets)
+                throw std::invalid_argument("ArrowFileWriter::write_batch: " + fields[i].name + ": utf8 column without offsets");
+            add_buffer(column.offsets, (length + 1) * sizeof(int32_t));
+            add_buffer(column.values, column.offsets[length]);
+        } else {
+            add_buffer(column.values, length * detail::arrow_element_size(fields[i].type));
+        }
+    }
+
+    detail::FlatPtr record_batch = detail::flat_table();
+    record_batch->add<int64_t>(0, length).add(1, detail::flat_struct_vector(nodes)).add(2, detail::flat_struct_vector(buffers));
+    detail::FlatObject message;
+    message.add<int16_t>(0, detail::arrow_metadata_version).add<uint8_t>(1, detail::arrow_header_record_batch)
+           .add(2, record_batch).add<int64_t>(3, body_length);
+
+    size_t start = used;
+    int32_t metadata_length = write_metadata(detail::FlatBuilder::finish(message));
+    size_t body = used;
+    file.increase_capacity(body + body_length);
+    for (size_t i = 0; i < buffers.size(); i++) {
+        used = body + buffers[i].offset;
+        append(contents[i].first, contents[i].second);
+        pad_to(detail::arrow_alignment);
+    }
+    used = body + body_length;
+    batches.push_back({static_cast<int64_t>(start), metadata_length, 0, static_cast<int64_t>(body_length)});
+}
+
+inline void ArrowFileWriter::close() {
+    if (closed)
+        return;
+    closed = true;
+    uint32_t end_of_stream[2] = {0xFFFFFFFF, 0};
+    append(end_of_stream, sizeof(end_of_stream));
+
+    detail::FlatObject footer;
+    footer.add<int16_t>(0, detail::arrow_metadata_version).add(1, detail::arrow_schema(fields))
+          .add(2, detail::flat_struct_vector(std::vector<detail::ArrowBlock>()))
+          .add(3, detail::flat_struct_vector(batches));
+    std::string flatbuffer = detail::FlatBuilder::finish(footer);
+    append(flatbuffer.data(), flatbuffer.size());
+    int32_t footer_length = flatbuffer.size();
+    append(&footer_length, 4);
+    append(detail::arrow_magic, 6);
+    file.sync(used);
+    file.flush_range(0, used);
+}
+
+/*
+ * =================================================================================================
+ * Reading
+ */
+
+// Strings of a utf8 column, without copying
+class ArrowStringColumn
+{
+public:
+    ArrowStringColumn(std::span<const int32_t> offsets, const char* data) : offsets(offsets), characters(data) {};
+    size_t size() const { return offsets.empty() ? 0 : offsets.size() - 1; };
+    std::string_view operator[](size_t index) const { return std::string_view(characters + offsets[index], offsets[index + 1] - offsets[index]); };
+    std::span<const int32_t> get_offsets() const { return offsets; };
+    const char* data() const { return characters; };
+private:
+    std::span<const int32_t> offsets;
+    const char* characters;
+};
+
+// Maps an Arrow IPC file read-only. Columns are views into the mapping, valid while the reader is.
+class ArrowFileReader
+{
+public:
+    ArrowFileReader(const std::string& file_name);
+    ArrowFileReader(const ArrowFileReader&) = delete;
+    ArrowFileReader& operator=(const ArrowFileReader&) = delete;
+    ~ArrowFileReader();
+
+    const std::vector<ArrowField>& fields() const { return schema; };
+    size_t batch_count() const { return batches.size(); };
+    size_t num_rows(size_t batch) const { return batches.at(batch).length; };
+
+    template <typename T>
+    std::span<const T> column(size_t batch, const std::string& name) const;
+    ArrowStringColumn strings(size_t batch, const std::string& name) const;
+    // The column's validity bitmap, or nullptr if it has no nulls in this batch
+    const uint8_t* validity(size_t batch, const std::string& name) const;
+
+private:
+    struct Column { int64_t length; int64_t null_count; std::vector<detail::ArrowBuffer> buffers; };
+    struct Batch { int64_t length; std::vector<Column> columns; };
+
+    size_t field_index(const std::string& name) const;
+    const uint8_t* buffer(size_t batch, size_t field, size_t index, size_t minimum_length) const;
+
+    const uint8_t* mapping = nullptr;
+    size_t mapped_bytes = 0;
+    std::vector<ArrowField> schema;
+    std::vector<Batch> batches;
+    std::vector<size_t> body_offsets;
+};
+
+inline ArrowFileReader::ArrowFileReader(const std::string& file_name) {
+    RAIIFileDescriptor fd(open(file_name.c_str(), O_RDONLY));
+    if (fd.get() == -1)
+        throw std::runtime_error("ArrowFileReader::ctor: " + file_name + ": " + mmapped_vector::get_error_message("open"));
+    struct stat st;
+    if (fstat(fd.get(), &st) == -1)
+        throw std::runtime_error("ArrowFileReader::ctor: " + file_name + ": " + mmapped_vector::get_error_message("fstat"));
+    mapped_bytes = st.st_size;
+    if (mapped_bytes < 8 + 10)
+        throw std::runtime_error("ArrowFileReader::ctor: " + file_name + ": not an Arrow file");
+    void* mapped = mmap(nullptr, mapped_bytes, PROT_READ, MAP_SHARED, fd.get(), 0);
+    if (mapped == MAP_FAILED)
+        throw std::runtime_error("ArrowFileReader::ctor: " + file_name + ": " + mmapped_vector::get_error_message("mmap"));
+    mapping = static_cast<const uint8_t*>(mapped);
+
+    try {
+        if (std::memcmp(mapping, detail::arrow_magic, 6) != 0 || std::memcmp(mapping + mapped_bytes - 6, detail::arrow_magic, 6) != 0)
+            throw std::runtime_error("ArrowFileReader::ctor: " + file_name + ": not an Arrow file");
+        int32_t footer_length;
+        std::memcpy(&footer_length, mapping + mapped_bytes - 10, 4);
+        if (footer_length <= 0 || static_cast<size_t>(footer_length) > mapped_bytes - 18)
+            throw std::runtime_error("ArrowFileReader::ctor: " + file_name + ": malformed footer");
+        const uint8_t* footer_start = mapping + mapped_bytes - 10 - footer_length;
+        detail::FlatTable footer = detail::FlatTable::root(footer_start, footer_length);
+
+        detail::FlatTable fields = footer.table(1);
+        for (size_t i = 0; i < fields.vector_length(1); i++)
+            schema.push_back(detail::arrow_field(fields.table_element(1, i)));
+
+        for (size_t i = 0; i < footer.vector_length(3); i++) {
+            auto block = footer.struct_element<detail::ArrowBlock>(3, i);
+            // Metadata starts after the continuation marker and the length
+            if (block.offset < 0 || block.metadata_length < 8 || static_cast<size_t>(block.offset) + block.metadata_length + block.body_length > mapped_bytes)
+                throw std::runtime_error("ArrowFileReader::ctor: " + file_name + ": record batch out of bounds");
+            detail::FlatTable message = detail::FlatTable::root(mapping + block.offset + 8, block.metadata_length - 8);
+            if (message.scalar<uint8_t>(1) != detail::arrow_header_record_batch)
+                throw std::runtime_error("ArrowFileReader::ctor: " + file_name + ": expected a record batch");
+            if (message.table(2).has(3))
+                throw std::runtime_error("ArrowFileReader::ctor: " + file_name + ": compressed record batches are not supported");
+            detail::FlatTable record_batch = message.table(2);
+
+            Batch batch{record_batch.scalar<int64_t>(0), {}};
+            size_t buffer_index = 0;
+            for (size_t field = 0; field < schema.size(); field++) {
+                if (field >= record_batch.vector_length(1))
+                    throw std::runtime_error("ArrowFileReader::ctor: " + file_name + ": record batch has too few columns");
+                auto node = record_batch.struct_element<detail::ArrowFieldNode>(1, field);
+                Column column{node.length, node.null_count, {}};
+                size_t buffer_count = schema[field].type == ArrowType::utf8 ? 3 : 2;
+                for (size_t j = 0; j < buffer_count; j++, buffer_index++) {
+                    if (buffer_index >= record_batch.vector_length(2))
+                        throw std::runtime_error("ArrowFileReader::ctor: " + file_name + ": record batch has too few buffers");
+                    auto described = record_batch.struct_element<detail::ArrowBuffer>(2, buffer_index);
+                    if (described.offset < 0 || described.length < 0 || described.offset + described.length > block.body_length)
+                        throw std::runtime_error("ArrowFileReader::ctor: " + file_name + ": buffer out of bounds");
+                    column.buffers.push_back(described);
+                }
+                batch.columns.push_back(std::move(column));
+            }
+            batches.push_back(std::move(batch));
+            body_offsets.push_back(block.offset + block.metadata_length);
+        }
+    } catch (...) {
+        munmap(const_cast<uint8_t*>(mapping), mapped_bytes);
+        throw;
+    }
+}
+
+inline ArrowFileReader::~ArrowFileReader() {
+    munmap(const_cast<uint8_t*>(mapping), mapped_bytes);
+}
+
+inline size_t ArrowFileReader::field_index(const std::string& name) const {
+    for (size_t i = 0; i < schema.size(); i++)
+        if (schema[i].name == name)
+            return i;
+    throw std::out_of_range("ArrowFileReader: no such column: " + name);
+}
+
+inline const uint8_t* ArrowFileReader::buffer(size_t batch, size_t field, size_t index, size_t minimum_length) const {
+    const detail::ArrowBuffer& described = batches.at(batch).columns[field].buffers[index];
+    if (static_cast<size_t>(described.length) < minimum_length)
+        throw std::runtime_error("ArrowFileReader: " + schema[field].name + ": buffer is shorter than the column");
+    return mapping + body_offsets[batch] + described.offset;
+}
+
+template <typename T>
+std::span<const T> ArrowFileReader::column(size_t batch, const std::string& name) const {
+    size_t field = field_index(name);
+    if (schema[field].type != arrow_type_of<T>())
+        throw std::runtime_error("ArrowFileReader::column: " + name + ": element type mismatch");
+    size_t length = batches.at(batch).columns[field].length;
+    const uint8_t* values = buffer(batch, field, 1, length * sizeof(T));
+    if (reinterpret_cast<uintptr_t>(values) % alignof(T) != 0)
+        throw std::runtime_error("ArrowFileReader::column: " + name + ": buffer is misaligned");
+    return std::span<const T>(reinterpret_cast<const T*>(values), length);
+}
+
+inline ArrowStringColumn ArrowFileReader::strings(size_t batch, const std::string& name) const {
+    size_t field = field_index(name);
+    if (schema[field].type != ArrowType::utf8)
+        throw std::runtime_error("ArrowFileReader::strings: " + name + ": not a utf8 column");
+    const Column& column = batches.at(batch).columns[field];
+    if (column.length < 0)
+        throw std::runtime_error("ArrowFileReader::strings: " + name + ": negative length");
+    auto offsets = reinterpret_cast<const int32_t*>(buffer(batch, field, 1, (column.length + 1) * sizeof(int32_t)));
+    if (reinterpret_cast<uintptr_t>(offsets) % alignof(int32_t) != 0)
+        throw std::runtime_error("ArrowFileReader::strings: " + name + ": buffer is misaligned");
+    // Every string must lie within the character data, which the last offset is checked against
+    if (offsets[0] < 0)
+        throw std::runtime_error("ArrowFileReader::strings: " + name + ": negative offset");
+    for (int64_t i = 0; i < column.length; i++)
+        if (offsets[i + 1] < offsets[i])
+            throw std::runtime_error("ArrowFileReader::strings: " + name + ": offsets are not in order");
+    auto characters = reinterpret_cast<const char*>(buffer(batch, field, 2, offsets[column.length]));
+    return ArrowStringColumn(std::span<const int32_t>(offsets, column.length + 1), characters);
+}
+
+inline const uint8_t* ArrowFileReader::validity(size_t batch, const std::string& name) const {
+    size_t field = field_index(name);
+    const Column& column = batches.at(batch).columns[field];
+    if (column.null_count == 0)
+        return nullptr;
+    return buffer(batch, field, 0, (column.length + 7) / 8);
+}
+
+} // namespace mmapped_vector
+
+#endif // MMAPPED_VECTOR_ARROW_H
@@ -0,0 +1,249 @@
+/**
+ * @file async.h
+ * @brief A small executor that runs blocking vector operations off the caller's thread, with C++20
+ * coroutine awaitables for the results.
+ * @author Michał Startek
+ * @version 0.1
+ * @copyright Copyright (c) Michał Startek 2024
+ */
+
+#ifndef MMAPPED_VECTOR_ASYNC_H
+#define MMAPPED_VECTOR_ASYNC_H
+
+#include <coroutine>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <tuple>
+#include <cstdint>
+#include <type_traits>
+#include <variant>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+#include "error_handling.h"
+
+
+namespace mmapped_vector {
+
+class AsyncExecutor;
+
+class AsyncJob
+{
+public:
+    virtual ~AsyncJob() = default;
+    virtual void execute() noexcept = 0;
+
+    std::coroutine_handle<> continuation;
+};
+
+/*
+ * Worker threads run the jobs; finished jobs are queued and fd() becomes readable. The reactor
+ * thread polls fd() along with its other descriptors and calls run_completions(), which resumes
+ * the awaiting coroutines there, so coroutines never continue on a worker thread.
+ */
+class AsyncExecutor
+{
+public:
+    AsyncExecutor(size_t worker_count = 1);
+    AsyncExecutor(const AsyncExecutor&) = delete;
+    AsyncExecutor& operator=(const AsyncExecutor&) = delete;
+    ~AsyncExecutor();
+
+    // Readable while there are coroutines to resume
+    int fd() const;
+
+    // Resumes the coroutines whose jobs have finished; returns how many were resumed
+    size_t run_completions();
+
+    // Awaitable that runs function() on a worker thread and returns its result
+    template <typename F>
+    auto run(F&& function);
+
+    void submit(AsyncJob* job);
+
+    // Executor used by the vector methods when none is given
+    static AsyncExecutor& instance();
+
+private:
+    void work();
+
+    std::mutex mutex;
+    std::condition_variable job_available;
+    std::deque<AsyncJob*> pending;
+    std::vector<AsyncJob*> completed;
+    std::vector<std::thread> workers;
+    bool stopping = false;
+    int notify_read_fd;
+    int notify_write_fd;
+};
+
+template <typename F>
+class AsyncOperation : public AsyncJob
+{
+    using Result = std::invoke_result_t<F&>;
+public:
+    AsyncOperation(AsyncExecutor& executor, F function) : executor(executor), function(std::move(function)) {};
+
+    bool await_ready() const noexcept { return false; };
+    void await_suspend(std::coroutine_handle<> handle) {
+        continuation = handle;
+        executor.submit(this);
+    };
+    Result await_resume();
+
+    void execute() noexcept override;
+
+private:
+    AsyncExecutor& executor;
+    F function;
+    std::conditional_t<std::is_void_v<Result>, std::monostate, std::optional<Result>> result;
+    std::exception_ptr error;
+};
+
+template <typename F>
+void AsyncOperation<F>::execute() noexcept {
+    try {
+        if constexpr(std::is_void_v<Result>)
+            function();
+        else
+            result.emplace(function());
+    } catch (...) {
+        error = std::current_exception();
+    }
+}
+
+template <typename F>
+typename AsyncOperation<F>::Result AsyncOperation<F>::await_resume() {
+    if (error)
+        std::rethrow_exception(error);
+    if constexpr(!std::is_void_v<Result>)
+        return std::move(*result);
+}
+
+template <typename F>
+auto AsyncExecutor::run(F&& function) {
+    return AsyncOperation<std::decay_t<F>>(*this, std::forward<F>(function));
+}
+
+/*
+ * =================================================================================================
+ */
+
+inline AsyncExecutor::AsyncExecutor(size_t worker_count) {
+#ifdef __linux__
+    notify_read_fd = notify_write_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (notify_read_fd == -1)
+        throw std::runtime_error("AsyncExecutor::ctor: " + mmapped_vector::get_error_message("eventfd"));
+#else
+    int fds[2];
+    if (pipe(fds) == -1)
+        throw std::runtime_error("AsyncExecutor::ctor: " + mmapped_vector::get_error_message("pipe"));
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    fcntl(fds[1], F_SETFL, O_NONBLOCK);
+    notify_read_fd = fds[0];
+    notify_write_fd = fds[1];
+#endif
+    for (size_t i = 0; i < std::max<size_t>(worker_count, 1); i++)
+        workers.emplace_back(&AsyncExecutor::work, this);
+}
+
+// Jobs that were already submitted still run; their coroutines are not resumed
+inline AsyncExecutor::~AsyncExecutor() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    job_available.notify_all();
+    for (auto& worker : workers)
+        worker.join();
+    close(notify_read_fd);
+    if (notify_write_fd != notify_read_fd)
+        close(notify_write_fd);
+}
+
+inline AsyncExecutor& AsyncExecutor::instance() {
+    static AsyncExecutor executor;
+    return executor;
+}
+
+inline int AsyncExecutor::fd() const {
+    return notify_read_fd;
+}
+
+inline void AsyncExecutor::submit(AsyncJob* job) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        pending.push_back(job);
+    }
+    job_available.notify_one();
+}
+
+inline void AsyncExecutor::work() {
+    while (true) {
+        AsyncJob* job;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            job_available.wait(lock, [this]() { return stopping || !pending.empty(); });
+            if (pending.empty())
+                return;
+            job = pending.front();
+            pending.pop_front();
+        }
+        job->execute();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            completed.push_back(job);
+        }
+        uint64_t one = 1;
+        std::ignore = write(notify_write_fd, &one, sizeof(one));
+    }
+}
+
+inline size_t AsyncExecutor::run_completions() {
+    uint64_t counter[8];
+    while (read(notify_read_fd, counter, sizeof(counter)) > 0) {};
+
+    std::vector<AsyncJob*> ready;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        ready.swap(completed);
+    }
+    // The awaitable lives in the coroutine frame, and may be gone once the coroutine is resumed
+    for (AsyncJob* job : ready)
+        job->continuation.resume();
+    return ready.size();
+}
+
+/*
+ * =================================================================================================
+ */
+
+// Awaitable versions of a vector's flush(), reserve() and wait_durable(), which run on one of the
+// executor's worker threads. The vector must not be used elsewhere until the awaiting coroutine
+// resumes.
+template <typename Vector>
+auto flush_async(Vector& vec, AsyncExecutor& executor = AsyncExecutor::instance()) {
+    return executor.run([&vec]() { vec.flush(); });
+}
+
+template <typename Vector>
+auto reserve_async(Vector& vec, size_t new_capacity, AsyncExecutor& executor = AsyncExecutor::instance()) {
+    return executor.run([&vec, new_capacity]() { vec.reserve(new_capacity); });
+}
+
+template <typename Vector>
+auto wait_committed(Vector& vec, size_t index, AsyncExecutor& executor = AsyncExecutor::instance()) {
+    return executor.run([&vec, index]() { vec.wait_durable(index); });
+}
+
+} // namespace mmapped_vector
+
+#endif // MMAPPED_VECTOR_ASYNC_H
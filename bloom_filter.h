@@ -0,0 +1,375 @@
+/**
+ * @file bloom_filter.h
+ * @brief Persistent membership filters: a blocked Bloom filter that takes inserts, an immutable
+ * xor filter for sealed data, and a file vector that keeps a Bloom filter of its keys up to date.
+ * @author Michał Startek
+ * @version 0.1
+ * @copyright Copyright (c) Michał Startek 2024
+ */
+
+#ifndef MMAPPED_VECTOR_BLOOM_FILTER_H
+#define MMAPPED_VECTOR_BLOOM_FILTER_H
+
+#include <algorithm>
+#include <bit>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <optional>
+#include <span>
+#include <string>
+#include <vector>
+
+#include "mmapped_vector.h"
+#include "committed_lengths.h"
+#include "hash.h"
+
+
+namespace mmapped_vector {
+
+/*
+ * Every key sets 8 bits in a single 64-byte block (one cache line), one bit in each of the block's
+ * words. The block is picked by the high half of the key's hash, the bits by the low half multiplied
+ * by per-word odd constants. A lookup thus touches one cache line, and the 8 word tests are
+ * independent, so the compiler turns them into a few vector operations.
+ * With 10 bits per key the false positive rate is about 1%.
+ *
+ * The filter is an MmappedVector<uint64_t>: a one-block header (magic, block count, number of keys
+ * inserted), then the blocks. A file-backed filter is used in place when opened. Its file may be
+ * longer than the header says (a file vector that wasn't closed cleanly is at its capacity); the
+ * excess is cut off.
+ */
+template <template <typename> class AllocatorType = MallocAllocator>
+class BlockedBloomFilter
+{
+public:
+    static constexpr size_t block_words = 8;
+
+    BlockedBloomFilter(size_t expected_keys, double bits_per_key = 10);
+    // Opens the filter in file_name, or creates one sized for expected_keys if the file is empty;
+    // the remaining arguments go to the allocator
+    template <typename... Args>
+        requires std::is_constructible_v<AllocatorType<uint64_t>, std::string, Args...>
+    BlockedBloomFilter(const std::string& file_name, size_t expected_keys, double bits_per_key = 10, Args&&... args);
+
+    void insert(uint64_t hash);
+    bool contains(uint64_t hash) const;
+    template <typename K>
+    void insert_key(const K& key) { insert(hash_key(key)); };
+    template <typename K>
+    bool contains_key(const K& key) const { return contains(hash_key(key)); };
+
+    size_t block_count() const { return words[1]; };
+    size_t inserted_count() const { return words[2]; };
+    void clear();
+    void flush() { words.flush(); };
+
+private:
+    static constexpr uint64_t magic = 0x314d4f4f4c42564dull;   // "MVBLOOM1"
+    static constexpr uint64_t salts[block_words] = {
+        0x47b6137b44974d91ull, 0x8824ad5ba2b7289dull, 0x705495c72df1424bull, 0x9efc49475c6bfb31ull,
+        0x1bd4e5c2a3f1c7a5ull, 0x2df1424b9efc4947ull, 0x5c6bfb31e2d4a8b3ull, 0xa2b7289d44974d91ull,
+    };
+
+    void initialize(size_t expected_keys, double bits_per_key);
+    size_t block_of(uint64_t hash) const { return 1 + static_cast<size_t>((static_cast<unsigned __int128>(hash) * block_count()) >> 64); };
+
+    MmappedVector<uint64_t, AllocatorType<uint64_t>> words;
+};
+
+template <template <typename> class AllocatorType>
+BlockedBloomFilter<AllocatorType>::BlockedBloomFilter(size_t expected_keys, double bits_per_key) {
+    initialize(expected_keys, bits_per_key);
+}
+
+template <template <typename> class AllocatorType>
+template <typename... Args>
+    requires std::is_constructible_v<AllocatorType<uint64_t>, std::string, Args...>
+BlockedBloomFilter<AllocatorType>::BlockedBloomFilter(const std::string& file_name, size_t expected_keys, double bits_per_key, Args&&... args)
+    : words(file_name, std::forward<Args>(args)...) {
+    if (words.empty()) {
+        initialize(expected_keys, bits_per_key);
+        return;
+    }
+    if (words.size() < block_words || words[0] != magic || words[1] >= words.size() / block_words)
+        throw std::runtime_error("BlockedBloomFilter::ctor: " + file_name + ": not a Bloom filter, or corrupted");
+    words.resize(block_words * (1 + words[1]));
+}
+
+template <template <typename> class AllocatorType>
+void BlockedBloomFilter<AllocatorType>::initialize(size_t expected_keys, double bits_per_key) {
+    size_t blocks = std::max<size_t>(static_cast<size_t>(expected_keys * bits_per_key / (64 * block_words)) + 1, 1);
+    words.resize(block_words * (1 + blocks));
+    std::fill(words.data(), words.data() + words.size(), 0);
+    words[0] = magic;
+    words[1] = blocks;
+}
+
+template <template <typename> class AllocatorType>
+void BlockedBloomFilter<AllocatorType>::clear() {
+    std::fill(words.data() + block_words, words.data() + words.size(), 0);
+    words[2] = 0;
+}
+
+template <template <typename> class AllocatorType> inline
+void BlockedBloomFilter<AllocatorType>::insert(uint64_t hash) {
+    uint64_t* block = words.data() + block_words * block_of(hash);
+    uint64_t low = static_cast<uint32_t>(hash);
+    for (size_t i = 0; i < block_words; i++)
+        block[i] |= uint64_t(1) << ((low * salts[i]) >> 58);
+    words[2]++;
+}
+
+template <template <typename> class AllocatorType> inline
+bool BlockedBloomFilter<AllocatorType>::contains(uint64_t hash) const {
+    const uint64_t* block = words.data() + block_words * block_of(hash);
+    uint64_t low = static_cast<uint32_t>(hash);
+    bool result = true;
+    for (size_t i = 0; i < block_words; i++) {
+        uint64_t mask = uint64_t(1) << ((low * salts[i]) >> 58);
+        result &= (block[i] & mask) == mask;
+    }
+    return result;
+}
+
+/*
+ * =================================================================================================
+ */
+
+/*
+ * Xor filter with 8-bit fingerprints (Graf and Lemire, "Xor Filters: Faster and Smaller Than Bloom
+ * and Cuckoo Filters", 2020): about 9.8 bits per key for a 0.4% false positive rate, and exactly
+ * three memory accesses per lookup. The key set is fixed at build(), so it suits sealed vectors.
+ *
+ * Stored in an MmappedVector<uint8_t>: a 16-byte header (seed, segment length), then three segments
+ * of fingerprints. A key's fingerprint is the xor of one byte from each segment.
+ */
+template <template <typename> class AllocatorType = MallocAllocator>
+class XorFilter
+{
+public:
+    XorFilter() = default;
+    // Opens the filter in file_name; an empty file is an empty filter until build()
+    template <typename... Args>
+        requires std::is_constructible_v<AllocatorType<uint8_t>, std::string, Args...>
+    explicit XorFilter(const std::string& file_name, Args&&... args);
+
+    // Replaces the filter with one for the given key hashes; duplicates are allowed
+    void build(std::span<const uint64_t> hashes);
+
+    bool contains(uint64_t hash) const;
+    template <typename K>
+    bool contains_key(const K& key) const { return contains(hash_key(key)); };
+
+    void flush() { data.flush(); };
+
+private:
+    static constexpr size_t header_bytes = 16;
+
+    struct Positions { size_t position[3]; uint8_t fingerprint; };
+    static uint64_t mix(uint64_t hash, uint64_t seed);
+    static Positions positions(uint64_t hash, uint64_t seed, size_t segment_length);
+    uint64_t seed() const;
+    size_t segment_length() const;
+
+    MmappedVector<uint8_t, AllocatorType<uint8_t>> data;
+};
+
+template <template <typename> class AllocatorType>
+template <typename... Args>
+    requires std::is_constructible_v<AllocatorType<uint8_t>, std::string, Args...>
+XorFilter<AllocatorType>::XorFilter(const std::string& file_name, Args&&... args) : data(file_name, std::forward<Args>(args)...) {
+    if (data.empty())
+        return;
+    // As with the Bloom filter, a longer file is cut to the size in the header
+    if (data.size() < header_bytes || segment_length() > (data.size() - header_bytes) / 3)
+        throw std::runtime_error("XorFilter::ctor: " + file_name + ": not an xor filter, or corrupted");
+    data.resize(header_bytes + 3 * segment_length());
+}
+
+template <template <typename> class AllocatorType> inline
+uint64_t XorFilter<AllocatorType>::seed() const {
+    uint64_t value;
+    std::memcpy(&value, data.data(), sizeof(value));
+    return value;
+}
+
+template <template <typename> class AllocatorType> inline
+size_t XorFilter<AllocatorType>::segment_length() const {
+    uint64_t value;
+    std::memcpy(&value, data.data() + 8, sizeof(value));
+    return value;
+}
+
+template <template <typename> class AllocatorType> inline
+uint64_t XorFilter<AllocatorType>::mix(uint64_t hash, uint64_t seed) {
+    hash += seed;
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdull;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ull;
+    return hash ^ (hash >> 33);
+}
+
+template <template <typename> class AllocatorType> inline
+typename XorFilter<AllocatorType>::Positions XorFilter<AllocatorType>::positions(uint64_t hash, uint64_t seed, size_t segment_length) {
+    uint64_t mixed = mix(hash, seed);
+    auto reduce = [segment_length](uint64_t bits) { return static_cast<size_t>((static_cast<uint64_t>(static_cast<uint32_t>(bits)) * segment_length) >> 32); };
+    return Positions{{reduce(mixed), segment_length + reduce(std::rotl(mixed, 21)), 2 * segment_length + reduce(std::rotl(mixed, 42))},
+                     static_cast<uint8_t>(mixed ^ (mixed >> 32))};
+}
+
+template <template <typename> class AllocatorType> inline
+bool XorFilter<AllocatorType>::contains(uint64_t hash) const {
+    if (data.empty())
+        return false;
+    size_t length = segment_length();
+    Positions p = positions(hash, seed(), length);
+    const uint8_t* fingerprints = data.data() + header_bytes;
+    return p.fingerprint == (fingerprints[p.position[0]] ^ fingerprints[p.position[1]] ^ fingerprints[p.position[2]]);
+}
+
+// Each key maps to three slots. Repeatedly taking a key out of a slot it has to itself ("peeling")
+// orders the keys so that, assigned in reverse, every key has one slot free to make its xor right.
+// Peeling fails with small probability; the build then starts over with another seed.
+template <template <typename> class AllocatorType>
+void XorFilter<AllocatorType>::build(std::span<const uint64_t> hashes) {
+    std::vector<uint64_t> keys(hashes.begin(), hashes.end());
+    std::sort(keys.begin(), keys.end());
+    keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+
+    size_t length = (32 + keys.size() * 123 / 100) / 3 + 1;
+    struct Slot { uint64_t keys_xor; uint32_t count; };
+    std::vector<Slot> slots(3 * length);
+    std::vector<size_t> queue;
+    std::vector<std::pair<size_t, uint64_t>> order;   // (slot, key) in peeling order
+    uint64_t seed = 0x726b2b9d438b9d4dull;
+
+    while (true) {
+        seed = mix(seed, 0x9E3779B97F4A7C15ull);
+        std::fill(slots.begin(), slots.end(), Slot{0, 0});
+        queue.clear();
+        order.clear();
+        for (uint64_t key : keys)
+            for (size_t position : positions(key, seed, length).position) {
+                slots[position].keys_xor ^= key;
+                slots[position].count++;
+            }
+        for (size_t i = 0; i < slots.size(); i++)
+            if (slots[i].count == 1)
+                queue.push_back(i);
+        while (!queue.empty()) {
+            size_t i = queue.back();
+            queue.pop_back();
+            if (slots[i].count != 1)
+                continue;
+            uint64_t key = slots[i].keys_xor;
+            order.emplace_back(i, key);
+            for (size_t position : positions(key, seed, length).position) {
+                slots[position].keys_xor ^= key;
+                if (--slots[position].count == 1)
+                    queue.push_back(position);
+            }
+        }
+        if (order.size() == keys.size())
+            break;
+    }
+
+    data.resize(header_bytes + 3 * length);
+    std::memcpy(data.data(), &seed, 8);
+    uint64_t length_field = length;
+    std::memcpy(data.data() + 8, &length_field, 8);
+    uint8_t* fingerprints = data.data() + header_bytes;
+    std::fill(fingerprints, fingerprints + 3 * length, 0);
+    for (auto it = order.rbegin(); it != order.rend(); ++it) {
+        Positions p = positions(it->second, seed, length);
+        fingerprints[it->first] = 0;
+        fingerprints[it->first] = p.fingerprint ^ fingerprints[p.position[0]] ^ fingerprints[p.position[1]] ^ fingerprints[p.position[2]];
+    }
+}
+
+/*
+ * =================================================================================================
+ */
+
+/*
+ * An MmapFileVector of records together with a Bloom filter of their keys, kept in
+ * file_name + ".bloom" and updated on every append. The vector's length is recorded in
+ * file_name + ".lengths" (see CommittedLengths) by flush() and on close, so after a crash it's
+ * reopened as of the last flush(). If the filter is behind the vector when opened (it's created
+ * later, or the process died between the two writes), the missing keys are added; if it's ahead,
+ * it's rebuilt.
+ */
+template <typename T, typename KeyOf = std::identity>
+class BloomIndexedVector
+{
+public:
+    using Key = std::decay_t<std::invoke_result_t<KeyOf, const T&>>;
+
+    BloomIndexedVector(const std::string& file_name, size_t expected_keys, double bits_per_key = 10, KeyOf key_of = KeyOf());
+    BloomIndexedVector(BloomIndexedVector&&) = default;
+    ~BloomIndexedVector() { committed.record_on_close(vec); };
+
+    void push_back(const T& value);
+
+    // False if no element has the key; true if one probably has
+    bool may_contain(const Key& key) const { return filter.contains_key(key); };
+
+    // Index of an element with the key, for a vector sorted by key. Keys the filter rules out
+    // return without the binary search touching the vector's pages.
+    std::optional<size_t> find_sorted(const Key& key) const;
+
+    const MmapFileVector<T>& get_vector() const { return vec; };
+    const BlockedBloomFilter<MmapFileAllocator>& get_filter() const { return filter; };
+    size_t size() const { return vec.size(); };
+    const T& operator[](size_t index) const { return vec[index]; };
+
+    void flush();
+
+private:
+    MmapFileVector<T> vec;
+    CommittedLengths committed;
+    BlockedBloomFilter<MmapFileAllocator> filter;
+    KeyOf key_of;
+};
+
+template <typename T, typename KeyOf>
+BloomIndexedVector<T, KeyOf>::BloomIndexedVector(const std::string& file_name, size_t expected_keys, double bits_per_key, KeyOf key_of)
+    : vec(file_name), committed(file_name + ".lengths"),
+      filter(file_name + ".bloom", std::max(expected_keys, vec.size()), bits_per_key), key_of(std::move(key_of)) {
+    committed.restore(vec);
+    if (filter.inserted_count() > vec.size())
+        filter.clear();
+    for (size_t i = filter.inserted_count(); i < vec.size(); i++)
+        filter.insert_key(this->key_of(vec[i]));
+}
+
+template <typename T, typename KeyOf>
+void BloomIndexedVector<T, KeyOf>::push_back(const T& value) {
+    vec.push_back(value);
+    filter.insert_key(key_of(value));
+}
+
+template <typename T, typename KeyOf>
+std::optional<size_t> BloomIndexedVector<T, KeyOf>::find_sorted(const Key& key) const {
+    if (!may_contain(key))
+        return std::nullopt;
+    const T* end = vec.data() + vec.size();
+    const T* found = std::lower_bound(vec.data(), end, key, [this](const T& element, const Key& k) { return key_of(element) < k; });
+    if (found == end || key_of(*found) != key)
+        return std::nullopt;
+    return found - vec.data();
+}
+
+// The filter after the vector, so a filter on disk never claims more keys than the vector has, and
+// the vector's length last
+template <typename T, typename KeyOf>
+void BloomIndexedVector<T, KeyOf>::flush() {
+    vec.flush();
+    filter.flush();
+    committed.record(true, vec);
+}
+
+} // namespace mmapped_vector
+
+#endif // MMAPPED_VECTOR_BLOOM_FILTER_H
@@ -0,0 +1,237 @@
+/**
+ * @file catalog.h
+ * @brief A directory of named MmapFileVectors sharing a single manifest and a single commit point.
+ * @author Michał Startek
+ * @version 0.1
+ * @copyright Copyright (c) Michał Startek 2024
+ */
+
+#ifndef MMAPPED_VECTOR_CATALOG_H
+#define MMAPPED_VECTOR_CATALOG_H
+
+#include <string>
+#include <map>
+#include <memory>
+#include <vector>
+#include <typeinfo>
+#include <fstream>
+#include <sstream>
+#include <cstdio>
+#include <sys/stat.h>
+
+#include "mmapped_vector.h"
+
+
+namespace mmapped_vector {
+
+/*
+ * Layout on disk:
+ *   <directory>/MANIFEST      one line per vector: "<element size> <committed length> <name>"
+ *   <directory>/<name>.col    the elements, as written by MmapFileAllocator
+ *
+ * Opening a catalog only reads the manifest; a vector's file is opened and mapped on the first get().
+ * commit() flushes every open vector and then atomically replaces the manifest, so the committed
+ * lengths of all vectors move together. Appends that were not committed are dropped the next time
+ * the vector is opened, also after a crash.
+ *
+ * Shrinking a vector (clear(), resize(), pop_back()) never cuts its file below the committed length,
+ * so if it isn't committed, the vector reopens at its committed length again. The file is the
+ * mapping, though: elements below the committed length that are overwritten, in place or by appends
+ * after a shrink, are changed in the file at once, and the old values aren't restored.
+ */
+class Catalog
+{
+public:
+    Catalog(const std::string& directory, mode_t mode = S_IRUSR | S_IWUSR);
+    Catalog(const Catalog&) = delete;
+    Catalog& operator=(const Catalog&) = delete;
+
+    // Returns the vector with the given name, opening (or creating) it on first access
+    template <typename T>
+    MmapFileVector<T>& get(const std::string& name);
+
+    bool contains(const std::string& name) const;
+    std::vector<std::string> names() const;
+
+    // Length of the vector as of the last commit
+    size_t committed_size(const std::string& name) const;
+
+    // Makes the current lengths of all vectors durable, as one atomic step
+    void commit();
+
+    // Number of commits made to this catalog so far
+    size_t generation() const;
+
+private:
+    struct OpenVector {
+        virtual ~OpenVector() = default;
+        virtual const std::type_info& type() const = 0;
+        virtual size_t size() const = 0;
+        virtual void flush() = 0;
+        // The file is never cut below this length
+        virtual void keep_file_size(size_t length) = 0;
+    };
+
+    template <typename T>
+    struct TypedVector : OpenVector {
+        MmapFileVector<T> vec;
+        TypedVector(const std::string& file_name, mode_t mode) : vec(file_name, MAP_SHARED, O_RDWR | O_CREAT, mode) {}
+        const std::type_info& type() const override { return typeid(T); }
+        size_t size() const override { return vec.size(); }
+        void flush() override { vec.flush(); }
+        void keep_file_size(size_t length) override { vec.get_allocator().keep_file_size(length); }
+    };
+
+    struct Entry {
+        size_t element_size = 0;
+        size_t committed_size = 0;
+        bool committed = false;
+        std::unique_ptr<OpenVector> open;
+    };
+
+    std::string path_of(const std::string& file_name) const;
+    void read_manifest();
+
+    std::string directory;
+    mode_t mode;
+    size_t commit_generation = 0;
+    std::map<std::string, Entry> entries;
+
+    static constexpr const char* manifest_header = "mmapped_vector catalog 1";
+};
+
+
+inline Catalog::Catalog(const std::string& directory, mode_t mode) : directory(directory), mode(mode) {
+    if (mkdir(directory.c_str(), S_IRWXU) == -1 && errno != EEXIST)
+        throw std::runtime_error("Catalog::ctor: " + directory + ": " + mmapped_vector::get_error_message("mkdir"));
+    read_manifest();
+}
+
+inline std::string Catalog::path_of(const std::string& file_name) const {
+    return directory + "/" + file_name;
+}
+
+inline void Catalog::read_manifest() {
+    std::ifstream manifest(path_of("MANIFEST"));
+    if (!manifest)
+        return;
+
+    std::string line;
+    if (!std::getline(manifest, line) || line != manifest_header)
+        throw std::runtime_error("Catalog::ctor: " + path_of("MANIFEST") + ": not a catalog manifest");
+    if (!std::getline(manifest, line))
+        throw std::runtime_error("Catalog::ctor: " + path_of("MANIFEST") + ": truncated manifest");
+    commit_generation = std::stoull(line);
+
+    while (std::getline(manifest, line)) {
+        std::istringstream fields(line);
+        Entry entry;
+        std::string name;
+        fields >> entry.element_size >> entry.committed_size;
+        fields.get();
+        std::getline(fields, name);
+        if (name.empty())
+            throw std::runtime_error("Catalog::ctor: " + path_of("MANIFEST") + ": malformed line: " + line);
+        entry.committed = true;
+        entries[name] = std::move(entry);
+    }
+}
+
+template <typename T>
+MmapFileVector<T>& Catalog::get(const std::string& name) {
+    if (name.empty() || name.find_first_of("/\n") != std::string::npos)
+        throw std::invalid_argument("Catalog::get: invalid vector name: " + name);
+
+    Entry& entry = entries[name];
+    if (entry.open) {
+        if (entry.open->type() != typeid(T))
+            throw std::runtime_error("Catalog::get: " + name + ": opened with a different element type");
+        return static_cast<TypedVector<T>*>(entry.open.get())->vec;
+    }
+
+    if (entry.committed && entry.element_size != sizeof(T))
+        throw std::runtime_error("Catalog::get: " + name + ": element size mismatch (stored: " +
+                                 std::to_string(entry.element_size) + ", requested: " + std::to_string(sizeof(T)) + ")");
+
+    auto open = std::make_unique<TypedVector<T>>(path_of(name + ".col"), mode);
+    MmapFileVector<T>& vec = open->vec;
+    open->keep_file_size(entry.committed_size);
+    // Anything past the committed length was appended after the last commit, and is discarded
+    if (vec.size() < entry.committed_size)
+        throw std::runtime_error("Catalog::get: " + name + ": file is shorter than its committed length. It's probably corrupted.");
+    if (entry.committed_size == 0)
+        vec.clear();
+    else if (vec.size() > entry.committed_size)
+        vec.resize(entry.committed_size);
+
+    entry.element_size = sizeof(T);
+    entry.open = std::move(open);
+    return vec;
+}
+
+inline bool Catalog::contains(const std::string& name) const {
+    auto it = entries.find(name);
+    return it != entries.end() && (it->second.open || it->second.committed);
+}
+
+inline std::vector<std::string> Catalog::names() const {
+    std::vector<std::string> result;
+    for (const auto& [name, entry] : entries)
+        if (entry.open || entry.committed)
+            result.push_back(name);
+    return result;
+}
+
+inline size_t Catalog::committed_size(const std::string& name) const {
+    auto it = entries.find(name);
+    if (it == entries.end())
+        throw std::out_of_range("Catalog::committed_size: no such vector: " + name);
+    return it->second.committed_size;
+}
+
+inline size_t Catalog::generation() const {
+    return commit_generation;
+}
+
+inline void Catalog::commit() {
+    for (auto& [name, entry] : entries)
+        if (entry.open)
+            entry.open->flush();
+
+    std::string manifest_name = path_of("MANIFEST");
+    std::string temporary_name = manifest_name + ".tmp";
+    std::ostringstream manifest;
+    manifest << manifest_header << "\n" << commit_generation + 1 << "\n";
+    for (const auto& [name, entry] : entries)
+        if (entry.open || entry.committed)
+            manifest << entry.element_size << " " << (entry.open ? entry.open->size() : entry.committed_size) << " " << name << "\n";
+    std::string contents = manifest.str();
+
+    {
+        RAIIFileDescriptor fd(open(temporary_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, mode));
+        if (fd.get() == -1)
+            throw std::runtime_error("Catalog::commit: " + temporary_name + ": " + mmapped_vector::get_error_message("open"));
+        if (write(fd.get(), contents.data(), contents.size()) != static_cast<ssize_t>(contents.size()))
+            throw std::runtime_error("Catalog::commit: " + temporary_name + ": " + mmapped_vector::get_error_message("write"));
+        if (fsync(fd.get()) == -1)
+            throw std::runtime_error("Catalog::commit: " + temporary_name + ": " + mmapped_vector::get_error_message("fsync"));
+    }
+    // The rename is the commit point
+    if (rename(temporary_name.c_str(), manifest_name.c_str()) == -1)
+        throw std::runtime_error("Catalog::commit: " + manifest_name + ": " + mmapped_vector::get_error_message("rename"));
+    RAIIFileDescriptor dir_fd(open(directory.c_str(), O_RDONLY | O_DIRECTORY));
+    if (dir_fd.get() == -1 || fsync(dir_fd.get()) == -1)
+        throw std::runtime_error("Catalog::commit: " + directory + ": " + mmapped_vector::get_error_message("fsync"));
+
+    commit_generation++;
+    for (auto& [name, entry] : entries)
+        if (entry.open) {
+            entry.committed_size = entry.open->size();
+            entry.committed = true;
+            entry.open->keep_file_size(entry.committed_size);
+        }
+}
+
+} // namespace mmapped_vector
+
+#endif // MMAPPED_VECTOR_CATALOG_H
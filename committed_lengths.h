@@ -0,0 +1,183 @@
+/**
+ * @file committed_lengths.h
+ * @brief The lengths of the vectors making up a file-backed structure, as of its last flush.
+ * @author Michał Startek
+ * @version 0.1
+ * @copyright Copyright (c) Michał Startek 2024
+ */
+
+#ifndef MMAPPED_VECTOR_COMMITTED_LENGTHS_H
+#define MMAPPED_VECTOR_COMMITTED_LENGTHS_H
+
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "error_handling.h"
+#include "misc.h"
+
+
+namespace mmapped_vector {
+
+/*
+ * A file-backed vector reopens at the size of its file. After a clean close that's its size, but
+ * after a crash it's its capacity, and the vector ends in elements that were never written.
+ * Structures made of several vectors keep their lengths in a small file of their own: flush()
+ * records them after flushing the vectors, a clean close records them too, and the constructor
+ * trims the vectors back to them.
+ *
+ * The lengths only protect elements that are appended. Before a structure overwrites elements
+ * that the record covers (after a pop, or to reuse space), it flushes, so that a crash can't bring
+ * the recorded lengths back over elements that have changed since; recorded_length() tells it when.
+ *
+ * A record made on a clean close ends in a line saying so, which the next restore() reports through
+ * closed_cleanly(). Structures that change elements in place between flushes (MmappedPriorityQueue)
+ * use it to tell whether they have to repair themselves after a crash.
+ *
+ * The file is replaced atomically, by writing a temporary file and renaming it over the old one,
+ * as Catalog does with its manifest. A default-constructed CommittedLengths (for structures in
+ * anonymous memory) records nothing.
+ */
+class CommittedLengths
+{
+public:
+    CommittedLengths() = default;
+    explicit CommittedLengths(std::string file_name) : file_name(std::move(file_name)) {};
+    CommittedLengths(const CommittedLengths&) = delete;
+    // The moved-from object records nothing, so only the new owner writes the file
+    CommittedLengths(CommittedLengths&& other) noexcept
+        : file_name(std::exchange(other.file_name, std::string())), recorded(std::move(other.recorded)), found_closed(other.found_closed) {};
+    CommittedLengths& operator=(const CommittedLengths&) = delete;
+
+    // Trims every vector to its recorded length, and records the result. If nothing was recorded
+    // yet, or all the vectors are empty (new files, or opened with O_TRUNC), they're left as they are.
+    template <typename... Vectors>
+    void restore(Vectors&... vectors);
+    // Records the vectors' current lengths; with durable, waits until the record is on stable storage
+    template <typename... Vectors>
+    void record(bool durable, const Vectors&... vectors);
+    // The same, for destructors: a clean close makes the file sizes exact anyway, so errors are ignored
+    template <typename... Vectors>
+    void record_on_close(const Vectors&... vectors) noexcept;
+
+    // Length of the index-th vector as last recorded; 0 if nothing is recorded
+    uint64_t recorded_length(size_t index) const { return index < recorded.size() ? recorded[index] : 0; };
+    // Whether the record restore() found was made by record_on_close(); false if there was none
+    bool closed_cleanly() const { return found_closed; };
+
+private:
+    static constexpr const char* header = "mmapped_vector lengths 1";
+    static constexpr const char* closed_line = "closed";
+
+    // Empty if there is no record; closed tells whether it was made on a clean close
+    std::vector<uint64_t> read(bool& closed) const;
+    void write(const std::vector<uint64_t>& lengths, bool durable, bool closed = false);
+
+    std::string file_name;
+    std::vector<uint64_t> recorded;
+    bool found_closed = false;
+};
+
+template <typename... Vectors>
+void CommittedLengths::restore(Vectors&... vectors) {
+    if (file_name.empty())
+        return;
+    std::vector<uint64_t> lengths = read(found_closed);
+    if (!lengths.empty() && ((vectors.size() > 0) || ...)) {
+        if (lengths.size() != sizeof...(Vectors))
+            throw std::runtime_error("CommittedLengths::restore: " + file_name + ": wrong number of lengths. The file is probably corrupted.");
+        size_t i = 0;
+        auto trim = [&](auto& vec) {
+            if (vec.size() < lengths[i])
+                throw std::runtime_error("CommittedLengths::restore: " + file_name + ": a vector is shorter than its recorded length. It's probably corrupted.");
+            // Elements past the length were appended after the last flush, or never written at all
+            if (vec.size() > lengths[i])
+                vec.resize(lengths[i]);
+            i++;
+        };
+        (trim(vectors), ...);
+    }
+    record(false, vectors...);
+}
+
+template <typename... Vectors>
+void CommittedLengths::record(bool durable, const Vectors&... vectors) {
+    if (!file_name.empty())
+        write({static_cast<uint64_t>(vectors.size())...}, durable);
+}
+
+template <typename... Vectors>
+void CommittedLengths::record_on_close(const Vectors&... vectors) noexcept {
+    try {
+        if (!file_name.empty())
+            write({static_cast<uint64_t>(vectors.size())...}, false, true);
+    } catch (const std::exception&) {
+    }
+}
+
+inline std::vector<uint64_t> CommittedLengths::read(bool& closed) const {
+    std::vector<uint64_t> lengths;
+    closed = false;
+    std::ifstream file(file_name);
+    if (!file)
+        return lengths;
+    std::string line;
+    if (!std::getline(file, line) || line != header)
+        throw std::runtime_error("CommittedLengths::restore: " + file_name + ": not a record of lengths");
+    uint64_t length;
+    while (file >> length)
+        lengths.push_back(length);
+    if (!file.eof()) {
+        // The lengths end at a word, which may only be the clean close's
+        file.clear();
+        std::string word;
+        closed = file >> word && word == closed_line && !(file >> word);
+        if (!closed)
+            throw std::runtime_error("CommittedLengths::restore: " + file_name + ": malformed record of lengths");
+    }
+    return lengths;
+}
+
+inline void CommittedLengths::write(const std::vector<uint64_t>& lengths, bool durable, bool closed) {
+    std::ostringstream text;
+    text << header << "\n";
+    for (uint64_t length : lengths)
+        text << length << "\n";
+    if (closed)
+        text << closed_line << "\n";
+    std::string contents = text.str();
+
+    std::string temporary_name = file_name + ".tmp";
+    {
+        RAIIFileDescriptor fd(open(temporary_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR));
+        if (fd.get() == -1)
+            throw std::runtime_error("CommittedLengths::record: " + temporary_name + ": " + mmapped_vector::get_error_message("open"));
+        if (::write(fd.get(), contents.data(), contents.size()) != static_cast<ssize_t>(contents.size()))
+            throw std::runtime_error("CommittedLengths::record: " + temporary_name + ": " + mmapped_vector::get_error_message("write"));
+        if (durable && fsync(fd.get()) == -1)
+            throw std::runtime_error("CommittedLengths::record: " + temporary_name + ": " + mmapped_vector::get_error_message("fsync"));
+    }
+    // The rename is the commit point
+    if (rename(temporary_name.c_str(), file_name.c_str()) == -1)
+        throw std::runtime_error("CommittedLengths::record: " + file_name + ": " + mmapped_vector::get_error_message("rename"));
+    if (durable) {
+        size_t slash = file_name.rfind('/');
+        std::string directory = slash == std::string::npos ? "." : slash == 0 ? "/" : file_name.substr(0, slash);
+        RAIIFileDescriptor dir_fd(open(directory.c_str(), O_RDONLY | O_DIRECTORY));
+        if (dir_fd.get() == -1 || fsync(dir_fd.get()) == -1)
+            throw std::runtime_error("CommittedLengths::record: " + directory + ": " + mmapped_vector::get_error_message("fsync"));
+    }
+    recorded = lengths;
+}
+
+} // namespace mmapped_vector
+
+#endif // MMAPPED_VECTOR_COMMITTED_LENGTHS_H
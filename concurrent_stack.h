@@ -0,0 +1,143 @@
+/**
+ * @file concurrent_stack.h
+ * @brief A stack pushed to and popped from by many threads at once, without locks, in mmapped memory.
+ * @author Michał Startek
+ * @version 0.1
+ * @copyright Copyright (c) Michał Startek 2024
+ */
+
+#ifndef MMAPPED_VECTOR_CONCURRENT_STACK_H
+#define MMAPPED_VECTOR_CONCURRENT_STACK_H
+
+#include <atomic>
+#include <cstdint>
+#include <limits>
+#include <stdexcept>
+
+#include "mmapped_vector.h"
+
+
+namespace mmapped_vector {
+
+/*
+ * A Treiber stack whose nodes live in a thread-safe MmappedVector and link to each other by index.
+ * The top of the stack is one 64-bit word: the index of the top node (plus one, zero meaning empty)
+ * in the low half, and a tag bumped by every change in the high half. A pop reads the top node's
+ * link and swings the top to it with a compare-and-swap, which fails if the top changed in between,
+ * even if it was popped and pushed back in the meantime (the ABA problem), because the tag differs.
+ *
+ * Popped nodes go to a free list, another such stack, and are reused by later pushes, so the
+ * mapping grows to the largest number of elements held at once and never shrinks. Pushes and pops
+ * only wait for each other while the node vector grows (see MmappedVector's thread-safe mode).
+ *
+ * Pops come in last-in, first-out order. The stack holds at most 2^32 - 1 elements.
+ */
+template <typename T, template <typename> class AllocatorType = MmapAllocator>
+class ConcurrentStack
+{
+    struct Node
+    {
+        T value;
+        // Index of the next node plus one; read while other threads may be rewriting it
+        uint32_t next;
+    };
+    using Nodes = MmappedVector<Node, AllocatorType<Node>, true>;
+    static_assert(AllocatorType<Node>::fixed_capacity == 0, "ConcurrentStack needs a growable allocator");
+
+public:
+    using value_type = T;
+
+    ConcurrentStack() = default;
+    ConcurrentStack(const ConcurrentStack&) = delete;
+    ConcurrentStack& operator=(const ConcurrentStack&) = delete;
+
+    void push_back(const T& value);
+    // Pops the top element into value; false if the stack was empty
+    bool try_pop(T& value);
+
+    // Exact when no push or pop is in progress
+    size_t size() const { return element_count.load(MEMORY_ORDER); };
+    bool empty() const { return size() == 0; };
+    // Number of elements the stack has held at once, which is how many nodes it keeps
+    size_t node_count() const { return nodes.size(); };
+    void reserve(size_t count) { nodes.reserve(count); };
+
+private:
+    static uint32_t index_of(uint64_t word) { return static_cast<uint32_t>(word); };
+    static uint64_t retagged(uint64_t word, uint32_t index) { return ((word >> 32) + 1) << 32 | index; };
+
+    // Index of a node to write, from the free list or appended
+    uint32_t allocate_node();
+    // Links node (index plus one) in at head; the node vector must be pinned by the caller
+    void link(std::atomic<uint64_t>& head, uint32_t node);
+    // Unlinks the node at head, returning its index plus one, or zero if there was none
+    uint32_t unlink(std::atomic<uint64_t>& head);
+
+    uint32_t& next_of(uint32_t node) { return nodes.data()[node - 1].next; };
+
+    Nodes nodes;
+    std::atomic<uint64_t> top = 0;
+    std::atomic<uint64_t> free_list = 0;
+    std::atomic<size_t> element_count = 0;
+};
+
+template <typename T, template <typename> class AllocatorType>
+void ConcurrentStack<T, AllocatorType>::link(std::atomic<uint64_t>& head, uint32_t node) {
+    uint64_t word = head.load(MEMORY_ORDER);
+    do
+        std::atomic_ref<uint32_t>(next_of(node)).store(index_of(word), MEMORY_ORDER);
+    while (!head.compare_exchange_weak(word, retagged(word, node), MEMORY_ORDER));
+}
+
+template <typename T, template <typename> class AllocatorType>
+uint32_t ConcurrentStack<T, AllocatorType>::unlink(std::atomic<uint64_t>& head) {
+    uint64_t word = head.load(MEMORY_ORDER);
+    while (index_of(word) != 0) {
+        // May be stale if the node was popped meanwhile, but then the tag has changed and the CAS fails
+        uint32_t next = std::atomic_ref<uint32_t>(next_of(index_of(word))).load(MEMORY_ORDER);
+        if (head.compare_exchange_weak(word, retagged(word, next), MEMORY_ORDER))
+            return index_of(word);
+    }
+    return 0;
+}
+
+template <typename T, template <typename> class AllocatorType>
+uint32_t ConcurrentStack<T, AllocatorType>::allocate_node() {
+    {
+        IndexHolder<Node, AllocatorType<Node>> holder(nodes, 0);
+        if (uint32_t node = unlink(free_list))
+            return node;
+    }
+    size_t index = nodes.append(Node());
+    if (index >= std::numeric_limits<uint32_t>::max())
+        throw std::length_error("ConcurrentStack::push_back: too many elements");
+    return static_cast<uint32_t>(index + 1);
+}
+
+template <typename T, template <typename> class AllocatorType>
+void ConcurrentStack<T, AllocatorType>::push_back(const T& value) {
+    uint32_t node = allocate_node();
+    IndexHolder<Node, AllocatorType<Node>> holder(nodes, node - 1);
+    // The node is ours alone until it's linked in
+    nodes.data()[node - 1].value = value;
+    // Counted before a pop can see it, so the count never drops below zero
+    element_count.fetch_add(1, MEMORY_ORDER);
+    link(top, node);
+}
+
+template <typename T, template <typename> class AllocatorType>
+bool ConcurrentStack<T, AllocatorType>::try_pop(T& value) {
+    IndexHolder<Node, AllocatorType<Node>> holder(nodes, 0);
+    uint32_t node = unlink(top);
+    if (node == 0)
+        return false;
+    // Not reused before it's on the free list
+    value = nodes.data()[node - 1].value;
+    element_count.fetch_sub(1, MEMORY_ORDER);
+    link(free_list, node);
+    return true;
+}
+
+} // namespace mmapped_vector
+
+#endif // MMAPPED_VECTOR_CONCURRENT_STACK_H
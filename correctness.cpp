@@ -1,8 +1,29 @@
 #include "mmapped_vector.h"
+#include "async.h"
+#include "parallel.h"
+#include "catalog.h"
+#include "handoff.h"
+#include "arrow.h"
+#include "jagged_array.h"
+#include "dictionary_column.h"
+#include "bloom_filter.h"
+#include "timeseries.h"
+#include "projection.h"
+#include "matrix.h"
+#include "sharded_vector.h"
+#include "concurrent_stack.h"
+#include "loader.h"
+#include "priority_queue.h"
 
 #include <iostream>
 #include <vector>
 #include <cassert>
+#include <thread>
+#include <fstream>
+#include <cmath>
+#include <random>
+#include <poll.h>
+#include <sys/wait.h>
 
 
 // Write correctness tests for MmappedVector, just correctness, single-threaded, no performance tests
@@ -32,6 +53,8 @@ VectorType empty() {
         return mmapped_vector::MmappedVector<typename VectorType::value_type, mmapped_vector::MallocAllocator<typename VectorType::value_type>>();
     } else if constexpr (std::is_same<VectorType, mmapped_vector::MmappedVector<typename VectorType::value_type, mmapped_vector::MmapAllocator<typename VectorType::value_type>>>::value) {
         return mmapped_vector::MmappedVector<typename VectorType::value_type, mmapped_vector::MmapAllocator<typename VectorType::value_type>>();
+    } else if constexpr (std::is_same<VectorType, mmapped_vector::MmappedVector<typename VectorType::value_type, mmapped_vector::MmapMemfdAllocator<typename VectorType::value_type>>>::value) {
+        return mmapped_vector::MmappedVector<typename VectorType::value_type, mmapped_vector::MmapMemfdAllocator<typename VectorType::value_type>>();
     } else if constexpr (std::is_same<VectorType, mmapped_vector::MmappedVector<typename VectorType::value_type, mmapped_vector::MmapFileAllocator<typename VectorType::value_type>>>::value) {
         std::string file_name = "test" + std::to_string(test_file_no++) + ".dat";
         return mmapped_vector::MmappedVector<typename VectorType::value_type, mmapped_vector::MmapFileAllocator<typename VectorType::value_type>>(file_name, MAP_SHARED, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
@@ -156,6 +179,1438 @@ void run_tests()
 }
 
 
+template <typename VectorType>
+void test_append_from_fd()
+{
+    const char* input_name = "test_ingest.bin";
+    std::vector<int> expected(1000);
+    for (size_t i = 0; i < expected.size(); i++)
+        expected[i] = i * 7;
+    {
+        RAIIFileDescriptor fd(open(input_name, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR));
+        assert(write(fd.get(), expected.data(), expected.size() * sizeof(int)) == ssize_t(expected.size() * sizeof(int)));
+    }
+
+    // Chunks that are not a multiple of sizeof(int) leave partial elements at the boundaries
+    VectorType vec = empty<VectorType>();
+    RAIIFileDescriptor fd(open(input_name, O_RDONLY));
+    while (vec.append_from_fd(fd.get(), 7) > 0) {};
+    assert(vec.size() == expected.size());
+    assert(std::equal(vec.begin(), vec.end(), expected.begin()));
+
+    // Pipes can't be copy_file_range()'d and go through read()
+    int pipe_fds[2];
+    assert(pipe(pipe_fds) == 0);
+    RAIIFileDescriptor read_end(pipe_fds[0]), write_end(pipe_fds[1]);
+    assert(write(write_end.get(), expected.data(), 10 * sizeof(int)) == 10 * sizeof(int));
+    write_end.reset(-1);
+    assert(vec.append_from_fd(read_end.get(), 1 << 20) == 10 * sizeof(int));
+    assert(vec.size() == expected.size() + 10);
+    assert(vec[expected.size() + 9] == expected[9]);
+
+    // A partial element read before clear() doesn't carry over into the next read
+    assert(pipe(pipe_fds) == 0);
+    read_end.reset(pipe_fds[0]);
+    write_end.reset(pipe_fds[1]);
+    assert(write(write_end.get(), expected.data() + 1, 3) == 3);
+    vec.append_from_fd(read_end.get(), 3);
+    vec.clear();
+    assert(write(write_end.get(), expected.data() + 2, sizeof(int)) == sizeof(int));
+    write_end.reset(-1);
+    vec.append_from_fd(read_end.get(), 1 << 20);
+    assert(vec.size() == 1 && vec[0] == expected[2]);
+
+    remove(input_name);
+}
+
+
+void test_npy_layout()
+{
+    const char* file_name = "test_npy.npy";
+    unlink(file_name);
+    {
+        mmapped_vector::MmapFileVector<double> vec(file_name, mmapped_vector::FileLayout::npy);
+        for (int i = 0; i < 1000; i++)
+            vec.push_back(i * 0.5);
+    }
+
+    char preamble[10];
+    std::string header(mmapped_vector::page_size - sizeof(preamble), ' ');
+    std::ifstream file(file_name, std::ios::binary);
+    file.read(preamble, sizeof(preamble));
+    file.read(header.data(), header.size());
+    assert(std::memcmp(preamble, "\x93NUMPY\x01\x00", 8) == 0);
+    assert(header.find("'shape': (1000,)") != std::string::npos && header.find("'descr': '<f8'") != std::string::npos);
+    assert(header.back() == '\n');
+    double first;
+    file.read(reinterpret_cast<char*>(&first), sizeof(first));
+    file.seekg(0, std::ios::end);
+    assert(first == 0.0 && static_cast<size_t>(file.tellg()) == mmapped_vector::page_size + 1000 * sizeof(double));
+
+    // Reopened, the size comes from the header, and snapshots see through it
+    {
+        mmapped_vector::MmapFileVector<double> vec(file_name, mmapped_vector::FileLayout::npy);
+        assert(vec.size() == 1000 && vec[999] == 499.5);
+        auto snapshot = vec.snapshot();
+        vec.update(999, -1.0);
+        vec.push_back(1.0);
+        assert(snapshot[999] == 499.5 && snapshot[0] == 0.0);
+    }
+    mmapped_vector::MmapFileVector<double> vec(file_name, mmapped_vector::FileLayout::npy);
+    assert(vec.size() == 1001 && vec[999] == -1.0);
+
+    bool thrown = false;
+    try {
+        mmapped_vector::MmapFileVector<int> wrong_type(file_name, mmapped_vector::FileLayout::npy);
+    } catch (const std::runtime_error&) {
+        thrown = true;
+    }
+    assert(thrown);
+
+    // As numpy.save() writes them: the data starts right after a 128-byte header
+    const char* foreign_name = "test_npy_foreign.npy";
+    {
+        std::string foreign_header = "{'descr': '<f8', 'fortran_order': False, 'shape': (2,), }";
+        foreign_header.resize(128 - sizeof(preamble) - 1, ' ');
+        foreign_header += '\n';
+        std::ofstream foreign(foreign_name, std::ios::binary);
+        foreign.write("\x93NUMPY\x01\x00\x76\x00", sizeof(preamble));
+        foreign << foreign_header;
+        double values[2] = {1.0, 2.0};
+        foreign.write(reinterpret_cast<const char*>(values), sizeof(values));
+    }
+    thrown = false;
+    try {
+        mmapped_vector::MmapFileVector<double> foreign(foreign_name, mmapped_vector::FileLayout::npy);
+    } catch (const std::runtime_error& e) {
+        thrown = std::string(e.what()).find("not page aligned") != std::string::npos;
+    }
+    assert(thrown);
+    unlink(foreign_name);
+}
+
+
+void test_arrow()
+{
+    const char* file_name = "test_arrow.arrow";
+    mmapped_vector::MallocVector<int64_t> ids;
+    mmapped_vector::MallocVector<double> values;
+    mmapped_vector::MallocVector<char> characters;
+    mmapped_vector::MallocVector<int32_t> offsets;
+    offsets.push_back(0);
+    for (int i = 0; i < 1000; i++) {
+        ids.push_back(i);
+        values.push_back(i * 0.25);
+        for (char c : "row" + std::to_string(i))
+            characters.push_back(c);
+        offsets.push_back(characters.size());
+    }
+    std::vector<uint8_t> validity(125, 0xff);
+    validity[0] = 0xfe;
+    {
+        using mmapped_vector::ArrowField, mmapped_vector::ArrowColumnData;
+        mmapped_vector::ArrowFileWriter writer(file_name, {ArrowField::of<int64_t>("id"), ArrowField::of<double>("value", true), ArrowField::utf8("name")});
+        writer.write_batch(1000, {ArrowColumnData::of(ids), ArrowColumnData::of(values, validity.data()), ArrowColumnData{characters.data(), nullptr, offsets.data()}});
+        writer.write_batch(10, {ArrowColumnData::of(ids), ArrowColumnData::of(values), ArrowColumnData{characters.data(), nullptr, offsets.data()}});
+    }
+
+    mmapped_vector::ArrowFileReader reader(file_name);
+    assert(reader.batch_count() == 2 && reader.fields().size() == 3);
+    assert(reader.fields()[1].type == mmapped_vector::ArrowType::float64 && reader.fields()[1].nullable);
+    auto id_column = reader.column<int64_t>(0, "id");
+    assert(id_column.size() == 1000 && id_column[999] == 999);
+    assert(reinterpret_cast<uintptr_t>(id_column.data()) % 64 == 0);
+    assert(reader.column<double>(0, "value")[3] == 0.75);
+    assert(reader.num_rows(1) == 10 && reader.strings(1, "name")[9] == "row9");
+    assert(reader.strings(0, "name")[999] == "row999");
+    assert(reader.validity(0, "value")[0] == 0xfe && !reader.validity(1, "value"));
+
+    // Offsets that go backwards are refused, rather than read as a string of negative length
+    const char* broken_name = "test_arrow_broken.arrow";
+    {
+        int32_t broken_offsets[] = {0, 5, 2, 6};
+        mmapped_vector::ArrowFileWriter writer(broken_name, {mmapped_vector::ArrowField::utf8("name")});
+        writer.write_batch(3, {mmapped_vector::ArrowColumnData{"abcdef", nullptr, broken_offsets}});
+    }
+    mmapped_vector::ArrowFileReader broken(broken_name);
+    bool thrown = false;
+    try {
+        broken.strings(0, "name");
+    } catch (const std::runtime_error&) {
+        thrown = true;
+    }
+    assert(thrown);
+    unlink(broken_name);
+}
+
+
+// Runs f in a child process that then dies as in a crash, without running the destructors of what
+// f leaves on the heap
+template <typename F>
+void run_and_crash(F&& f)
+{
+    pid_t child = fork();
+    assert(child != -1);
+    if (child == 0) {
+        f();
+        _exit(0);
+    }
+    int status;
+    assert(waitpid(child, &status, 0) == child && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+
+void test_jagged_array()
+{
+    mmapped_vector::MmappedJaggedArray<int> lists;
+    assert(lists.empty() && lists.total_size() == 0);
+    std::vector<int> numbers = {1, 2, 3, 4, 5};
+    assert(lists.append(numbers) == 0);
+    lists.append(std::vector<int>());
+    lists.append(numbers.data() + 1, 2);
+    lists.extend_last(9);
+    assert(lists.size() == 3 && lists.total_size() == 8);
+    assert(lists[0].size() == 5 && lists[0][4] == 5);
+    assert(lists[1].empty());
+    assert(lists[2].size() == 3 && lists[2][0] == 2 && lists[2][2] == 9);
+    lists[2][0] = -2;
+    size_t seen = 0;
+    for (auto list : lists.lists())
+        seen += list.size();
+    assert(seen == 8 && lists.at(2)[0] == -2);
+    lists.pop_back();
+    assert(lists.size() == 2 && lists.total_size() == 5);
+
+    // Counting sort construction, with more pairs than one thread takes
+    std::vector<std::pair<int, int>> pairs;
+    for (int i = 0; i < 100000; i++)
+        pairs.emplace_back(i * 7 % 1000, i);
+    lists.build(std::span<const std::pair<int, int>>(pairs), 1001, 4);
+    assert(lists.size() == 1001 && lists.total_size() == 100000);
+    for (size_t key = 0; key < 1000; key++) {
+        assert(lists[key].size() == 100);
+        for (size_t j = 0; j < lists[key].size(); j++)
+            assert(static_cast<size_t>(lists[key][j] * 7 % 1000) == key && (j == 0 || lists[key][j - 1] < lists[key][j]));
+    }
+    assert(lists[1000].empty());
+    pairs.emplace_back(-1, 0);
+    bool thrown = false;
+    try {
+        lists.build(std::span<const std::pair<int, int>>(pairs), 1001);
+    } catch (const std::out_of_range&) {
+        thrown = true;
+    }
+    assert(thrown);
+
+    // File-backed, reopened; values past the last offset are dropped
+    {
+        mmapped_vector::MmappedJaggedArray<double, mmapped_vector::MmapFileAllocator> stored("test_jagged", MAP_SHARED, O_RDWR | O_CREAT | O_TRUNC);
+        stored.append(std::vector<double>{0.5, 1.5});
+        stored.append(std::vector<double>{2.5});
+    }
+    {
+        mmapped_vector::MmapFileVector<double> values("test_jagged.values");
+        values.push_back(3.5);
+    }
+    {
+        mmapped_vector::MmappedJaggedArray<double, mmapped_vector::MmapFileAllocator> stored("test_jagged");
+        assert(stored.size() == 2 && stored.total_size() == 3 && stored.get_values().size() == 3 && stored[1][0] == 2.5);
+    }
+
+    // A crash reopens as of the last flush(), not at the capacity of the files
+    run_and_crash([] {
+        auto crashing = new mmapped_vector::MmappedJaggedArray<double, mmapped_vector::MmapFileAllocator>("test_jagged", MAP_SHARED, O_RDWR | O_CREAT | O_TRUNC);
+        for (int i = 0; i < 100; i++)
+            crashing->append(std::vector<double>(i % 7, i));
+        crashing->flush();
+        crashing->append(std::vector<double>{-1.0});
+    });
+    size_t expected_values = 0;
+    for (int i = 0; i < 100; i++)
+        expected_values += i % 7;
+    {
+        mmapped_vector::MmappedJaggedArray<double, mmapped_vector::MmapFileAllocator> recovered("test_jagged");
+        assert(recovered.size() == 100 && recovered[99].size() == 99 % 7 && recovered[99][0] == 99);
+        assert(recovered.total_size() == expected_values && recovered.get_values().size() == expected_values);
+    }
+
+    // Lists changed in place after the flush: extended, or popped and replaced
+    run_and_crash([] {
+        auto crashing = new mmapped_vector::MmappedJaggedArray<double, mmapped_vector::MmapFileAllocator>("test_jagged");
+        crashing->extend_last(-1.0);
+        crashing->pop_back();
+        crashing->pop_back();
+        crashing->append(std::vector<double>{-2.0, -3.0, -4.0});
+        crashing->extend_last(-5.0);
+    });
+    {
+        mmapped_vector::MmappedJaggedArray<double, mmapped_vector::MmapFileAllocator> replaced("test_jagged");
+        assert(replaced.size() == 98 && replaced[97].size() == 97 % 7 && replaced[97][0] == 97);
+        assert(replaced.total_size() == expected_values - 99 % 7 - 98 % 7);
+    }
+    run_and_crash([] {
+        auto crashing = new mmapped_vector::MmappedJaggedArray<double, mmapped_vector::MmapFileAllocator>("test_jagged");
+        crashing->extend_last(-1.0);
+    });
+    mmapped_vector::MmappedJaggedArray<double, mmapped_vector::MmapFileAllocator> extended("test_jagged");
+    assert(extended.size() == 98 && extended[97].size() == 97 % 7 && extended.total_size() == extended.get_values().size());
+
+    // Many keys, few pairs
+    mmapped_vector::MmappedJaggedArray<int> sparse;
+    std::vector<std::pair<int, int>> few = {{999999, 1}, {3, 2}, {999999, 3}};
+    sparse.build(std::span<const std::pair<int, int>>(few), 1000000, 8);
+    assert(sparse.size() == 1000000 && sparse[999999].size() == 2 && sparse[999999][1] == 3 && sparse[3][0] == 2);
+}
+
+
+void test_dictionary_column()
+{
+    const char* colours[] = {"red", "green", "blue", "", "a rather longer value, past a single hash word"};
+    mmapped_vector::MmappedDictionaryColumn<> column;
+    for (int i = 0; i < 10000; i++)
+        column.append(colours[i * 7 % 5]);
+    assert(column.size() == 10000 && column.dictionary_size() == 5);
+    assert(column[0] == "red" && column[1] == colours[2] && column.decode(*column.find("")) == "");
+    assert(!column.find("purple") && column.count_equal("purple") == 0);
+    assert(column.count_equal("green") == 2000);
+    std::vector<uint64_t> rows = column.select_equal("blue");
+    assert(rows.size() == 2000 && rows[0] == 1 && rows[1] == 6);
+    assert(column.count_in({"red", "blue", "purple"}) == 4000);
+    std::vector<std::string_view> decoded(10);
+    column.decode(100, 110, decoded.data());
+    for (size_t i = 0; i < 10; i++)
+        assert(decoded[i] == column[100 + i]);
+
+    // Fixed-width keys, enough of them to grow the index several times
+    struct WideKey { uint64_t parts[4]; };
+    mmapped_vector::MmappedDictionaryColumn<> keys;
+    for (uint64_t i = 0; i < 3000; i++)
+        keys.append(WideKey{{i % 1000, i % 1000 * 3, 0, 7}});
+    assert(keys.dictionary_size() == 1000 && keys.code(1999) == 999);
+    assert(keys.decode_as<WideKey>(keys.code(1234)).parts[1] == 234 * 3);
+    assert(*keys.find(WideKey{{5, 15, 0, 7}}) == 5);
+
+    // File-backed; an index that doesn't cover the whole dictionary is rebuilt on open
+    {
+        mmapped_vector::MmappedDictionaryColumn<mmapped_vector::MmapFileAllocator> stored("test_dictionary", MAP_SHARED, O_RDWR | O_CREAT | O_TRUNC);
+        for (int i = 0; i < 100; i++)
+            stored.append("value " + std::to_string(i % 40));
+    }
+    {
+        mmapped_vector::MmapFileVector<uint64_t> index("test_dictionary.index");
+        index[0] = 3;
+    }
+    {
+        mmapped_vector::MmappedDictionaryColumn<mmapped_vector::MmapFileAllocator> stored("test_dictionary");
+        assert(stored.size() == 100 && stored.dictionary_size() == 40 && stored[99] == "value 19");
+        assert(stored.append("value 39") == 39 && stored.dictionary_size() == 40);
+    }
+
+    // A crash reopens as of the last flush(), with the index rebuilt for the dictionary it finds
+    run_and_crash([] {
+        auto crashing = new mmapped_vector::MmappedDictionaryColumn<mmapped_vector::MmapFileAllocator>("test_dictionary_crash", MAP_SHARED, O_RDWR | O_CREAT | O_TRUNC);
+        for (int i = 0; i < 1000; i++)
+            crashing->append("value " + std::to_string(i % 300));
+        crashing->flush();
+        for (int i = 0; i < 100; i++)
+            crashing->append("new value " + std::to_string(i));
+    });
+    mmapped_vector::MmappedDictionaryColumn<mmapped_vector::MmapFileAllocator> recovered("test_dictionary_crash");
+    assert(recovered.size() == 1000 && recovered.dictionary_size() == 300 && recovered[999] == "value 99");
+    assert(!recovered.find("new value 0") && recovered.count_equal("value 7") == 4);
+    assert(recovered.append("value 299") == 299 && recovered.append("new value 0") == 300);
+
+    // A slot that made it to disk without the dictionary entry it refers to, where a lookup of the
+    // value probes
+    {
+        mmapped_vector::MmapFileVector<uint64_t> index("test_dictionary.index");
+        std::string value = "value 40";
+        uint64_t hash = mmapped_vector::hash_bytes(value.data(), value.size());
+        size_t mask = index.size() - 2;
+        size_t slot = hash & mask;
+        while (index[slot + 1] != 0)
+            slot = (slot + 1) & mask;
+        index[slot + 1] = (hash >> 32 << 32) | 0x7fffffff;
+    }
+    mmapped_vector::MmappedDictionaryColumn<mmapped_vector::MmapFileAllocator> stray_slot("test_dictionary");
+    assert(stray_slot.dictionary_size() == 40 && *stray_slot.find("value 7") == 7 && !stray_slot.find("value 40"));
+}
+
+
+void test_bloom_filters()
+{
+    mmapped_vector::BlockedBloomFilter<> bloom(10000);
+    for (uint64_t i = 0; i < 10000; i++)
+        bloom.insert_key(i * 2);
+    size_t false_positives = 0;
+    for (uint64_t i = 0; i < 10000; i++) {
+        assert(bloom.contains_key(i * 2));
+        false_positives += bloom.contains_key(i * 2 + 1);
+    }
+    assert(bloom.inserted_count() == 10000 && false_positives < 300);
+    assert(bloom.contains_key(std::string("a")) == bloom.contains_key(std::string_view("a")));
+
+    std::vector<uint64_t> hashes;
+    for (uint64_t i = 0; i < 10000; i++)
+        hashes.push_back(mmapped_vector::hash_key(i * 2));
+    hashes.push_back(hashes[0]);
+    {
+        mmapped_vector::XorFilter<mmapped_vector::MmapFileAllocator> sealed("test_xor", MAP_SHARED, O_RDWR | O_CREAT | O_TRUNC);
+        assert(!sealed.contains_key(uint64_t(0)));
+        sealed.build(hashes);
+    }
+    mmapped_vector::XorFilter<mmapped_vector::MmapFileAllocator> sealed("test_xor");
+    false_positives = 0;
+    for (uint64_t i = 0; i < 10000; i++) {
+        assert(sealed.contains_key(i * 2));
+        false_positives += sealed.contains_key(i * 2 + 1);
+    }
+    assert(false_positives < 100);
+
+    // The filter catches up with records appended while it wasn't there
+    std::remove("test_bloom_vector");
+    std::remove("test_bloom_vector.bloom");
+    std::remove("test_bloom_vector.lengths");
+    {
+        mmapped_vector::MmapFileVector<uint64_t> records("test_bloom_vector");
+        for (uint64_t i = 0; i < 500; i++)
+            records.push_back(i * 3);
+    }
+    {
+        mmapped_vector::BloomIndexedVector<uint64_t> records("test_bloom_vector", 1000);
+        assert(records.get_filter().inserted_count() == 500);
+        for (uint64_t i = 500; i < 1000; i++)
+            records.push_back(i * 3);
+    }
+    mmapped_vector::BloomIndexedVector<uint64_t> records("test_bloom_vector", 1000);
+    assert(records.size() == 1000 && records.get_filter().inserted_count() == 1000);
+    for (uint64_t i = 0; i < 3000; i++)
+        assert(records.find_sorted(i) == (i % 3 == 0 ? std::optional<size_t>(i / 3) : std::nullopt));
+
+    // A crash leaves both files at their capacity; the vector is cut back to the last flush(), and
+    // the filter, which had taken the later keys too, is rebuilt
+    run_and_crash([] {
+        auto crashing = new mmapped_vector::BloomIndexedVector<uint64_t>("test_bloom_vector", 1000);
+        for (uint64_t i = 1000; i < 1500; i++)
+            crashing->push_back(i * 3);
+        crashing->flush();
+        for (uint64_t i = 1500; i < 1700; i++)
+            crashing->push_back(i * 3);
+    });
+    mmapped_vector::BloomIndexedVector<uint64_t> recovered("test_bloom_vector", 1000);
+    assert(recovered.size() == 1500 && recovered.get_filter().inserted_count() == 1500);
+    for (uint64_t i = 0; i < 1500; i++)
+        assert(recovered.find_sorted(i * 3) == i);
+    assert(!recovered.find_sorted(1600 * 3));
+
+    // The same for a sealed xor filter
+    run_and_crash([] {
+        auto crashing = new mmapped_vector::XorFilter<mmapped_vector::MmapFileAllocator>("test_xor_crash", MAP_SHARED, O_RDWR | O_CREAT | O_TRUNC);
+        std::vector<uint64_t> hashes = {1, 2, 3};
+        crashing->build(hashes);
+        crashing->flush();
+    });
+    mmapped_vector::XorFilter<mmapped_vector::MmapFileAllocator> reopened_xor("test_xor_crash");
+    assert(reopened_xor.contains(1) && reopened_xor.contains(3));
+}
+
+
+void test_timeseries()
+{
+    using Series = mmapped_vector::MmappedTimeSeries<mmapped_vector::MmapFileAllocator>;
+    const size_t count = 5000;
+    auto time_of = [](size_t i) { return int64_t(1700000000000) + int64_t(i) * 1000 + (i % 7 == 0 ? 3 : 0); };
+    auto value_of = [](size_t i) { return i == 10 ? -0.0 : i == 11 ? std::numeric_limits<double>::infinity() : 20.0 + (i / 10) * 0.25; };
+    {
+        Series series("test_series", MAP_SHARED, O_RDWR | O_CREAT | O_TRUNC);
+        for (size_t i = 0; i < count; i++)
+            series.append(time_of(i), value_of(i));
+        bool thrown = false;
+        try {
+            series.append(time_of(0), 1.0);
+        } catch (const std::invalid_argument&) {
+            thrown = true;
+        }
+        assert(thrown);
+        series.flush();
+    }
+    Series series("test_series");
+    assert(series.size() == count && series.block_count() == count / Series::block_points);
+    assert(series.compressed_bytes() < series.block_count() * Series::block_points * 16 / 8);
+
+    auto points = series.range(time_of(1000), time_of(4500));
+    assert(points.size() == 3500);
+    for (size_t i = 0; i < points.size(); i++)
+        assert(points[i].time == time_of(1000 + i) && points[i].value == value_of(1000 + i));
+    auto early = series.range(0, time_of(12));
+    assert(early.size() == 12 && std::signbit(early[10].value) && std::isinf(early[11].value));
+    assert(series.range(time_of(count - 1) + 1, INT64_MAX).empty());
+
+    // A crash reopens as of the last flush(). Sealing the head flushed at 1500 points has the
+    // next append flush again, before it overwrites them.
+    run_and_crash([&] {
+        auto crashing = new Series("test_series_crash", MAP_SHARED, O_RDWR | O_CREAT | O_TRUNC);
+        for (size_t i = 0; i < 1500; i++)
+            crashing->append(time_of(i), value_of(i));
+        crashing->flush();
+        for (size_t i = 1500; i < 2100; i++)
+            crashing->append(time_of(i), value_of(i));
+    });
+    {
+        Series recovered("test_series_crash");
+        assert(recovered.size() == 2 * Series::block_points && recovered.block_count() == 2);
+        auto recovered_points = recovered.range(INT64_MIN, INT64_MAX);
+        assert(recovered_points.size() == 2 * Series::block_points);
+        for (size_t i = 0; i < recovered_points.size(); i++)
+            assert(recovered_points[i].time == time_of(i) && recovered_points[i].value == value_of(i));
+        recovered.append(time_of(2 * Series::block_points), 1.0);
+        assert(recovered.size() == 2 * Series::block_points + 1);
+    }
+    run_and_crash([&] {
+        auto crashing = new Series("test_series_crash", MAP_SHARED, O_RDWR | O_CREAT | O_TRUNC);
+        for (size_t i = 0; i < 1500; i++)
+            crashing->append(time_of(i), value_of(i));
+        crashing->flush();
+        for (size_t i = 1500; i < 1600; i++)
+            crashing->append(time_of(i), value_of(i));
+    });
+    assert(Series("test_series_crash").size() == 1500);
+    // Reopened after a clean close, with an empty head
+    {
+        Series empty_head("test_series_crash", MAP_SHARED, O_RDWR | O_CREAT | O_TRUNC);
+        for (size_t i = 0; i < Series::block_points; i++)
+            empty_head.append(time_of(i), value_of(i));
+    }
+    assert(Series("test_series_crash").size() == Series::block_points);
+
+    // Irregular timestamps and noisy values take the wide encodings
+    mmapped_vector::MmappedTimeSeries<> irregular;
+    uint64_t state = 1;
+    int64_t time = -5;
+    std::vector<std::pair<int64_t, double>> expected;
+    for (size_t i = 0; i < 3000; i++) {
+        state = state * 6364136223846793005ull + 1442695040888963407ull;
+        time += (state >> 60) == 0 ? int64_t(1) << 40 : int64_t(state >> 52);
+        double value = std::bit_cast<double>(state >> 2);
+        irregular.append(time, value);
+        expected.emplace_back(time, value);
+    }
+    auto all = irregular.range(INT64_MIN, INT64_MAX);
+    assert(all.size() == expected.size());
+    for (size_t i = 0; i < all.size(); i++)
+        assert(all[i].time == expected[i].first && std::bit_cast<uint64_t>(all[i].value) == std::bit_cast<uint64_t>(expected[i].second));
+}
+
+
+void test_projection()
+{
+    struct Trade { int64_t time; float price; uint32_t quantity; char venue[13]; double fee; };
+    mmapped_vector::MallocVector<Trade> trades;
+    for (uint32_t i = 0; i < 100003; i++)
+        trades.push_back(Trade{int64_t(i) * 10, float(i % 1000) * 0.5f, i % 17, "x", i * 0.125});
+
+    auto prices = mmapped_vector::project<&Trade::price>(trades);
+    assert(prices.size() == trades.size() && prices[3] == 1.5f);
+    prices[3] = 2.0f;
+    assert(trades[3].price == 2.0f);
+    assert(std::ranges::distance(prices) == int64_t(trades.size()) && *(prices.begin() + 5) == 2.5f);
+    assert(prices.max() == 499.5f && prices.min() == 0.0f);
+
+    std::vector<float> price_copy = prices.to_vector();
+    std::vector<double> fees(10);
+    const auto& constant = trades;
+    auto fee_view = mmapped_vector::project<&Trade::fee>(constant);
+    fee_view.gather(17, 27, fees.data());
+    for (size_t i = 0; i < trades.size(); i++)
+        assert(price_copy[i] == trades[i].price);
+    for (size_t i = 0; i < fees.size(); i++)
+        assert(fees[i] == trades[17 + i].fee);
+
+    auto quantities = mmapped_vector::project<&Trade::quantity>(trades);
+    uint64_t expected = 0;
+    for (const Trade& trade : trades)
+        expected += trade.quantity;
+    assert(quantities.reduce(0u, std::plus<>(), 4) == expected && quantities.sum() == expected);
+    assert(quantities.count_if([](uint32_t q) { return q == 0; }) == (trades.size() + 16) / 17);
+
+    mmapped_vector::MallocVector<int64_t> times;
+    std::vector<double> fee_column;
+    mmapped_vector::transpose<&Trade::time, &Trade::fee>(std::span<const Trade>(trades.data(), trades.size()), std::tie(times, fee_column), 4);
+    assert(times.size() == trades.size() && fee_column.size() == trades.size());
+    for (size_t i = 0; i < trades.size(); i++)
+        assert(times[i] == trades[i].time && fee_column[i] == trades[i].fee);
+}
+
+
+void test_matrix()
+{
+    using mmapped_vector::MatrixLayout;
+    const size_t rows = 150, cols = 37;
+    auto value = [](size_t row, size_t col) { return float(row * 1000 + col); };
+    std::vector<float> row_values(cols);
+
+    mmapped_vector::MmappedMatrix<float> row_major;
+    mmapped_vector::MmappedMatrix<float, MatrixLayout::column_major> column_major(0, cols);
+    mmapped_vector::MmappedMatrix<float, MatrixLayout::tiled, mmapped_vector::MallocAllocator, 16> tiled(0, cols);
+    row_major.reset(0, cols);
+    for (size_t row = 0; row < rows; row++) {
+        for (size_t col = 0; col < cols; col++)
+            row_values[col] = value(row, col);
+        row_major.append_row(row_values);
+        column_major.append_row(row_values);
+        tiled.append_row(row_values);
+    }
+    bool thrown = false;
+    try {
+        row_major.append_row(std::vector<float>(3));
+    } catch (const std::invalid_argument&) {
+        thrown = true;
+    }
+    assert(thrown);
+    for (size_t row = 0; row < rows; row++)
+        for (size_t col = 0; col < cols; col++)
+            assert(row_major(row, col) == value(row, col) && column_major(row, col) == value(row, col) && tiled(row, col) == value(row, col));
+    assert(row_major.row(7)[3] == value(7, 3) && column_major.column(5)[140] == value(140, 5));
+    assert(tiled.get_data().size() == 10 * 3 * 16 * 16 && tiled.get_data()[tiled.index(149, 36) + 1] == 0);
+
+    size_t covered = 0;
+    tiled.for_each_tile([&](size_t row_begin, size_t row_end, size_t col_begin, size_t col_end) {
+        assert(row_end - row_begin <= 16 && col_end - col_begin <= 16);
+        covered += (row_end - row_begin) * (col_end - col_begin);
+    });
+    assert(covered == rows * cols);
+
+    // Strided views: std::mdspan, or StridedMatrixView before C++23
+#ifdef __cpp_lib_mdspan
+    auto element = [](const auto& view, size_t row, size_t col) -> auto& { return view[row, col]; };
+#else
+    auto element = [](const auto& view, size_t row, size_t col) -> auto& { return view(row, col); };
+#endif
+    auto row_view = row_major.view();
+    auto column_view = std::as_const(column_major).view();
+    assert(row_view.extent(0) == rows && row_view.extent(1) == cols && row_view.stride(0) == cols && row_view.stride(1) == 1);
+    assert(column_view.extent(0) == rows && column_view.stride(0) == 1 && column_view.stride(1) >= rows);
+    for (size_t row = 0; row < rows; row++)
+        for (size_t col = 0; col < cols; col++)
+            assert(element(row_view, row, col) == value(row, col) && element(column_view, row, col) == value(row, col));
+    // The last tile of a row of tiles is clipped to the matrix
+    auto edge = tiled.tile(9, 2);
+    assert(edge.extent(0) == 6 && edge.extent(1) == 5 && edge.stride(0) == 16 && edge.size() == 30);
+    assert(element(edge, 5, 4) == value(149, 36) && element(std::as_const(tiled).tile(1, 1), 2, 3) == value(18, 19));
+    element(edge, 0, 0) = -1;
+    assert(tiled(144, 32) == -1);
+    element(edge, 0, 0) = value(144, 32);
+
+    mmapped_vector::MmappedMatrix<float, MatrixLayout::row_major, mmapped_vector::MallocAllocator, 16> copy, transposed;
+    tiled.copy_into(copy, 4);
+    tiled.transpose_into(transposed, 4);
+    assert(copy.rows() == rows && transposed.rows() == cols && transposed.cols() == rows);
+    for (size_t row = 0; row < rows; row++)
+        for (size_t col = 0; col < cols; col++)
+            assert(copy(row, col) == value(row, col) && transposed(col, row) == value(row, col));
+
+    // File-backed; the shape is checked when reopened
+    {
+        mmapped_vector::MmappedMatrix<double, MatrixLayout::column_major, mmapped_vector::MmapFileAllocator> stored("test_matrix", 3, MAP_SHARED, O_RDWR | O_CREAT | O_TRUNC);
+        for (size_t row = 0; row < 100; row++)
+            stored.append_row(std::array<double, 3>{double(row), row * 2.0, row * 3.0});
+    }
+    mmapped_vector::MmappedMatrix<double, MatrixLayout::column_major, mmapped_vector::MmapFileAllocator> stored("test_matrix", 3);
+    assert(stored.rows() == 100 && stored(99, 2) == 297.0 && stored.column(1)[50] == 100.0);
+    thrown = false;
+    try {
+        mmapped_vector::MmappedMatrix<double, MatrixLayout::row_major, mmapped_vector::MmapFileAllocator> wrong("test_matrix", 3);
+    } catch (const std::runtime_error&) {
+        thrown = true;
+    }
+    assert(thrown);
+
+    // Reopened after a crash, with both files at their capacity
+    using Crashed = mmapped_vector::MmappedMatrix<int, MatrixLayout::tiled, mmapped_vector::MmapFileAllocator, 8>;
+    run_and_crash([] {
+        Crashed* crashed = new Crashed("test_matrix_crash", 5, MAP_SHARED, O_RDWR | O_CREAT | O_TRUNC);
+        for (int row = 0; row < 10; row++)
+            crashed->append_row(std::array<int, 5>{row, row + 1, row + 2, row + 3, row + 4});
+        crashed->flush();
+    });
+    Crashed recovered("test_matrix_crash", 5);
+    assert(recovered.rows() == 10 && recovered.get_data().size() == 2 * 8 * 8 && recovered(9, 4) == 13);
+    recovered.append_row(std::array<int, 5>{10, 11, 12, 13, 14});
+    assert(recovered.rows() == 11 && recovered(10, 2) == 12 && recovered(3, 3) == 6);
+}
+
+
+void test_parallel_generate()
+{
+    auto f = [](size_t i) { return i * 2654435761u % 1000003; };
+    mmapped_vector::MallocVector<uint64_t> vec;
+    vec.push_back(7);
+    vec.parallel_generate(1000003, f, 4);
+    assert(vec.size() == 1000003);
+    for (size_t i = 0; i < vec.size(); i++)
+        assert(vec[i] == f(i));
+    vec.parallel_append(123457, [](size_t i) { return uint64_t(i); }, 3);
+    assert(vec.size() == 1123460 && vec[1000003] == 0 && vec.back() == 123456);
+
+    // The same pool, several times over; a chunk's exception reaches the caller
+    mmapped_vector::ThreadPool pool(4);
+    mmapped_vector::MmappedVector<int32_t, mmapped_vector::MmapAllocator<int32_t>> mapped;
+    for (int round = 0; round < 3; round++) {
+        mapped.parallel_append(300001, [round](size_t i) { return int32_t(i) - round; }, pool);
+        assert(mapped.size() == 300001u * (round + 1) && mapped[300001u * round + 5] == 5 - round);
+    }
+    bool thrown = false;
+    try {
+        mmapped_vector::parallel_generate(mapped, 1 << 20, [](size_t i) { if (i == 777777) throw std::runtime_error("fail"); return int32_t(i); }, pool);
+    } catch (const std::runtime_error&) {
+        thrown = true;
+    }
+    assert(thrown && mapped.empty());
+    mmapped_vector::parallel_generate(mapped, 5, [](size_t i) { return int32_t(i); }, pool);
+    assert(mapped.size() == 5 && mapped[4] == 4);
+}
+
+
+void test_fixed_capacity()
+{
+    mmapped_vector::FixedCapacityVector<int, 1000> vec;
+    assert(vec.capacity() == 1000 && reinterpret_cast<uintptr_t>(vec.data()) % 4096 == 0);
+    const int* data = vec.data();
+    for (int i = 0; i < 1000; i++)
+        vec.push_back(i);
+    assert(vec.data() == data && vec[999] == 999);
+    bool thrown = false;
+    try {
+        vec.push_back(1000);
+    } catch (const std::length_error&) {
+        thrown = true;
+    }
+    assert(thrown);
+    thrown = false;
+    try {
+        vec.reserve(1001);
+    } catch (const std::length_error&) {
+        thrown = true;
+    }
+    assert(thrown);
+    vec.resize(10);
+    vec.append_range(std::vector<int>(990, 5));
+    assert(vec.size() == 1000 && vec.data() == data);
+
+    // A reservation far beyond what's used costs nothing; concurrent pushes skip the capacity check
+    mmapped_vector::MmappedVector<uint64_t, mmapped_vector::FixedCapacityAllocator<uint64_t, (size_t(1) << 36)>, true> shared;
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < 4; t++)
+        threads.emplace_back([&shared]() {
+            for (uint64_t i = 0; i < 100000; i++)
+                shared.push_back(i);
+        });
+    for (auto& thread : threads)
+        thread.join();
+    uint64_t sum = 0;
+    for (size_t i = 0; i < shared.size(); i++)
+        sum += shared[i];
+    assert(shared.size() == 400000 && sum == 4 * (100000ull * 99999 / 2));
+}
+
+
+void test_sharded_vector()
+{
+    mmapped_vector::ShardedVector<uint64_t> sharded;
+    assert(sharded.empty() && sharded.begin() == sharded.end());
+    std::vector<std::thread> threads;
+    for (uint64_t t = 0; t < 4; t++)
+        threads.emplace_back([&sharded, t]() {
+            for (uint64_t i = 0; i < 50000; i++)
+                sharded.push_back(t << 32 | i);
+        });
+    for (auto& thread : threads)
+        thread.join();
+    assert(sharded.shard_count() == 4 && sharded.size() == 200000);
+
+    // Every shard is one thread's appends, in order
+    for (size_t s = 0; s < 4; s++) {
+        const auto& shard = sharded.shard(s);
+        assert(shard.size() == 50000);
+        for (uint64_t i = 0; i < 50000; i++)
+            assert(shard[i] == ((shard[0] >> 32) << 32 | i));
+    }
+    size_t position = 0;
+    for (uint64_t value : sharded)
+        assert(value == sharded[position++]);
+    assert(position == 200000);
+
+    // Appends after a read show up in the next one
+    sharded.push_back(7);
+    sharded.append_range(std::vector<uint64_t>{8, 9}.data(), 2);
+    assert(sharded.size() == 200003 && sharded.shard_count() == 5 && sharded[200002] == 9 && sharded.at(200000) == 7);
+
+    mmapped_vector::MallocVector<uint64_t> merged;
+    merged.push_back(1);
+    sharded.consolidate(merged, 4);
+    assert(merged.size() == 200004);
+    size_t checked = 0;
+    sharded.for_each([&](uint64_t value) { assert(merged[++checked] == value); });
+    assert(checked == 200003);
+
+    // File-backed shards are found again when reopened
+    for (size_t s = 0; s < 3; s++)
+        std::remove(("test_sharded.shard" + std::to_string(s)).c_str());
+    {
+        mmapped_vector::ShardedVector<int, mmapped_vector::MmapFileAllocator> stored("test_sharded");
+        stored.push_back(1);
+        std::thread([&stored]() { stored.push_back(2); stored.push_back(3); }).join();
+    }
+    mmapped_vector::ShardedVector<int, mmapped_vector::MmapFileAllocator> stored("test_sharded");
+    assert(stored.shard_count() == 2 && stored.size() == 3 && stored[2] == 3);
+    stored.push_back(4);
+    assert(stored.shard_count() == 3 && stored[3] == 4);
+}
+
+
+void test_concurrent_reuse()
+{
+    mmapped_vector::MmappedVector<uint64_t, mmapped_vector::MmapAllocator<uint64_t>, true> vec;
+    for (uint64_t batch = 0; batch < 3; batch++) {
+        // Capacity changes while the pushes are running
+        std::atomic<bool> pushing = true;
+        std::thread resizer([&]() {
+            while (pushing) {
+                vec.reserve(vec.size() + 100000);
+                vec.shrink_to_fit();
+            }
+        });
+        std::vector<std::thread> threads;
+        for (uint64_t t = 0; t < 4; t++)
+            threads.emplace_back([&vec, batch, t]() {
+                for (uint64_t i = 0; i < 50000; i++)
+                    vec.push_back(batch << 48 | t << 32 | i);
+            });
+        for (auto& thread : threads)
+            thread.join();
+        pushing = false;
+        resizer.join();
+
+        // Every push of this batch landed, each thread's in order
+        assert(vec.size() == 200000);
+        std::vector<uint64_t> next(4, 0);
+        for (size_t i = 0; i < vec.size(); i++) {
+            uint64_t value = vec[i];
+            assert(value >> 48 == batch);
+            uint64_t t = (value >> 32) & 0xffff;
+            assert((value & 0xffffffff) == next[t]++);
+        }
+        vec.clear();
+        assert(vec.empty());
+    }
+
+    // A clear() in the middle of the pushes drops the ones that took their index before it
+    std::atomic<bool> cleared = false;
+    size_t pushed = 0;
+    std::thread pusher([&]() {
+        for (size_t after = 0; after < 1000; pushed++) {
+            bool after_clear = cleared;
+            vec.push_back(after_clear ? 1 : 0);
+            after += after_clear;
+        }
+    });
+    while (vec.size() < 1000)
+        std::this_thread::yield();
+    vec.clear();
+    cleared = true;
+    pusher.join();
+    assert(vec.size() >= 1000 && vec.size() <= pushed - 1000 && vec[vec.size() - 1] == 1);
+}
+
+void test_concurrent_stack()
+{
+    mmapped_vector::ConcurrentStack<uint64_t> stack;
+    uint64_t value;
+    assert(stack.empty() && !stack.try_pop(value));
+    stack.push_back(1);
+    stack.push_back(2);
+    assert(stack.size() == 2 && stack.try_pop(value) && value == 2 && stack.try_pop(value) && value == 1);
+    assert(!stack.try_pop(value));
+
+    // Work-pool use: every thread pushes and pops, and every element comes out exactly once
+    const uint64_t per_thread = 100000;
+    std::vector<std::atomic<uint8_t>> seen(4 * per_thread);
+    std::vector<std::thread> threads;
+    for (uint64_t t = 0; t < 4; t++)
+        threads.emplace_back([&, t]() {
+            uint64_t popped;
+            for (uint64_t i = 0; i < per_thread; i++) {
+                stack.push_back(t * per_thread + i);
+                if (i % 2 == 1 && stack.try_pop(popped))
+                    seen[popped]++;
+            }
+            while (stack.try_pop(popped))
+                seen[popped]++;
+        });
+    for (auto& thread : threads)
+        thread.join();
+    assert(stack.empty());
+    for (auto& count : seen)
+        assert(count == 1);
+    // Popped nodes were reused rather than the mapping growing for every push
+    assert(stack.node_count() < 4 * per_thread);
+}
+
+void test_concurrent_view()
+{
+    using Vector = mmapped_vector::MmappedVector<uint64_t, mmapped_vector::MmapAllocator<uint64_t>, true>;
+    static_assert(std::ranges::input_range<mmapped_vector::ConcurrentView<uint64_t, mmapped_vector::MmapAllocator<uint64_t>>>);
+    Vector vec;
+    assert(vec.concurrent_view().empty() && vec.concurrent_view().begin() == std::default_sentinel);
+
+    // Scans while the writers append and the mapping moves: every element seen is written, and each
+    // writer's elements show up in order
+    std::atomic<bool> writing = true;
+    std::vector<std::thread> writers;
+    for (uint64_t t = 0; t < 8; t++)
+        writers.emplace_back([&vec, t]() {
+            for (uint64_t i = 1; i <= 50000; i++)
+                vec.push_back(t << 32 | i);
+        });
+    std::thread reader([&]() {
+        size_t scans = 0, last_size = 0;
+        while (writing || scans == 0) {
+            auto view = vec.concurrent_view(1000);
+            assert(view.size() >= last_size);
+            last_size = view.size();
+            std::vector<uint64_t> next(8, 1);
+            size_t seen = 0;
+            for (uint64_t value : view) {
+                uint64_t t = value >> 32;
+                assert(t < 8 && (value & 0xffffffff) == next[t]++);
+                seen++;
+            }
+            assert(seen == view.size());
+            scans++;
+        }
+    });
+    for (auto& writer : writers)
+        writer.join();
+    writing = false;
+    reader.join();
+
+    auto view = vec.concurrent_view(3000);
+    assert(view.size() == 400000);
+    size_t sum = 0, chunks = 0;
+    view.for_each_chunk([&](const uint64_t* elements, size_t count) {
+        assert(count <= 3000);
+        for (size_t i = 0; i < count; i++)
+            sum += elements[i] & 0xffffffff;
+        chunks++;
+    });
+    assert(chunks == 134 && sum == size_t(8) * 50000 * 50001 / 2);
+
+    // A clear() ends a view at its next chunk
+    auto stale = vec.concurrent_view(1000);
+    auto it = stale.begin();
+    vec.clear();
+    size_t left = 0;
+    for (; it != std::default_sentinel; ++it)
+        left++;
+    assert(left == 1000);
+
+    // Snapshots taken while the writers append cover only written elements, and updates made while
+    // the mapping moves land in it
+    using Shared = mmapped_vector::MmappedVector<uint64_t, mmapped_vector::MmapMemfdAllocator<uint64_t>, true>;
+    Shared shared;
+    shared.push_back(0);
+    writing = true;
+    writers.clear();
+    for (uint64_t t = 0; t < 8; t++)
+        writers.emplace_back([&shared, t]() {
+            for (uint64_t i = 1; i <= 50000; i++)
+                shared.push_back(t << 32 | i);
+        });
+    std::thread snapshotter([&]() {
+        uint64_t updates = 0;
+        while (writing || updates == 0) {
+            shared.update(0, ++updates);
+            auto snapshot = shared.snapshot();
+            assert(snapshot[0] == updates);
+            std::vector<uint64_t> next(8, 1);
+            for (size_t i = 1; i < snapshot.size(); i++) {
+                uint64_t t = snapshot[i] >> 32;
+                assert(t < 8 && (snapshot[i] & 0xffffffff) >= next[t]);
+                next[t] = (snapshot[i] & 0xffffffff) + 1;
+            }
+        }
+        assert(shared[0] == updates);
+    });
+    for (auto& writer : writers)
+        writer.join();
+    writing = false;
+    snapshotter.join();
+    assert(shared.size() == 400001);
+}
+
+void test_loader()
+{
+    // Several parts of over 1 MiB each, split at line starts
+    {
+        std::ofstream csv("test_load.csv", std::ios::binary);
+        csv << "time,price,volume\r\n";
+        for (int64_t i = 0; i < 200000; i++)
+            csv << i << "," << i * 0.5 << "," << (i % 1000) << (i % 2 ? "\r\n" : "\n");
+    }
+    mmapped_vector::MallocVector<int64_t> times;
+    mmapped_vector::MallocVector<double> prices;
+    std::remove("test_load_volumes.dat");
+    mmapped_vector::MmapFileVector<uint32_t> volumes("test_load_volumes.dat");
+    times.push_back(-1);
+    size_t rows = mmapped_vector::load_csv("test_load.csv", std::tie(times, prices, volumes), {.header = true}, 4);
+    assert(rows == 200000 && times.size() == 200001 && prices.size() == 200000 && volumes.size() == 200000);
+    for (int64_t i = 0; i < 200000; i++)
+        assert(times[i + 1] == i && prices[i] == i * 0.5 && volumes[i] == i % 1000);
+
+    // A bad line leaves the columns as they were
+    {
+        std::ofstream csv("test_load.csv", std::ios::binary);
+        csv << "1;2\n3;x\n";
+    }
+    mmapped_vector::MallocVector<int> a, b;
+    bool thrown = false;
+    try {
+        mmapped_vector::load_csv("test_load.csv", std::tie(a, b), {.delimiter = ';'});
+    } catch (const std::runtime_error& e) {
+        thrown = std::string(e.what()).find("line 2") != std::string::npos;
+    }
+    assert(thrown && a.empty() && b.empty());
+    {
+        std::ofstream csv("test_load.csv", std::ios::binary);
+        csv << "1;2\n3;4";
+    }
+    assert(mmapped_vector::load_csv("test_load.csv", std::tie(a, b), {.delimiter = ';'}) == 2 && a[1] == 3 && b[1] == 4);
+
+    // Blank lines are skipped, a trailing one too, but still count for the line numbers
+    {
+        std::ofstream csv("test_load.csv", std::ios::binary);
+        csv << "\n1;2\n\n\r\n3;4\r\n\n";
+    }
+    a.clear();
+    b.clear();
+    assert(mmapped_vector::load_csv("test_load.csv", std::tie(a, b), {.delimiter = ';'}) == 2 && a.size() == 2);
+    assert(a[0] == 1 && b[0] == 2 && a[1] == 3 && b[1] == 4);
+    {
+        std::ofstream csv("test_load.csv", std::ios::binary);
+        csv << "1;2\n\n\n3;x\n\r";
+    }
+    thrown = false;
+    try {
+        mmapped_vector::load_csv("test_load.csv", std::tie(a, b), {.delimiter = ';'});
+    } catch (const std::runtime_error& e) {
+        thrown = std::string(e.what()).find("line 4") != std::string::npos;
+    }
+    assert(thrown && a.size() == 2);
+    {
+        std::ofstream csv("test_load.csv", std::ios::binary);
+        for (int i = 0; i < 300000; i++)
+            csv << (i % 3 == 0 ? "\n" : i % 3 == 1 ? "\r\n" : "") << i << ";" << -i << "\n";
+        csv << "\n";
+    }
+    a.clear();
+    b.clear();
+    assert(mmapped_vector::load_csv("test_load.csv", std::tie(a, b), {.delimiter = ';'}, 4) == 300000);
+    for (int i = 0; i < 300000; i++)
+        assert(a[i] == i && b[i] == -i);
+
+    // Binary records, as the file vectors store them
+    struct Record { uint32_t id; float value; };
+    {
+        std::remove("test_load_records.dat");
+        mmapped_vector::MmapFileVector<Record> stored("test_load_records.dat");
+        for (uint32_t i = 0; i < 100000; i++)
+            stored.push_back({i, i * 0.5f});
+    }
+    mmapped_vector::MallocVector<Record> records;
+    assert(mmapped_vector::load_binary<Record>("test_load_records.dat", records, 4) == 100000);
+    for (uint32_t i = 0; i < 100000; i++)
+        assert(records[i].id == i && records[i].value == i * 0.5f);
+}
+
+void test_priority_queue()
+{
+    std::mt19937_64 random(7);
+    std::vector<uint64_t> values(100000);
+    for (auto& value : values)
+        value = random() % 1000000;
+    std::vector<uint64_t> sorted = values;
+    std::sort(sorted.begin(), sorted.end(), std::greater<>());
+
+    // One by one, and in bulk, both into an empty queue (rebuilding) and a fuller one (sifting up)
+    mmapped_vector::MmappedPriorityQueue<uint64_t> queue;
+    for (size_t i = 0; i < 1000; i++)
+        queue.push(values[i]);
+    queue.push_range(values.data() + 1000, 500);
+    queue.push_range(values.data() + 1500, values.size() - 1500);
+    assert(queue.size() == values.size() && queue.top() == sorted[0]);
+    std::vector<uint64_t> best = queue.top_k(1000);
+    assert(std::equal(best.begin(), best.end(), sorted.begin()) && queue.size() == values.size());
+    assert(queue.pop_k(10) == std::vector<uint64_t>(sorted.begin(), sorted.begin() + 10));
+    for (size_t i = 10; i < sorted.size(); i++) {
+        assert(queue.top() == sorted[i]);
+        queue.pop();
+    }
+    assert(queue.empty() && queue.top_k(5).empty());
+
+    // A min-queue of 8 children per node, kept in a file and reopened
+    std::remove("test_priority_queue");
+    std::remove("test_priority_queue.lengths");
+    {
+        mmapped_vector::MmappedPriorityQueue<uint64_t, std::greater<uint64_t>, mmapped_vector::MmapFileAllocator, 8> stored("test_priority_queue");
+        stored.push_range(values.data(), values.size());
+        stored.pop();
+        stored.flush();
+    }
+    mmapped_vector::MmappedPriorityQueue<uint64_t, std::greater<uint64_t>, mmapped_vector::MmapFileAllocator, 8> reopened("test_priority_queue");
+    assert(reopened.size() == values.size() - 1);
+    for (size_t i = 1; i < 100; i++) {
+        assert(reopened.top() == sorted[sorted.size() - 1 - i]);
+        reopened.pop();
+    }
+
+    // After a crash, the queue has the size of the last flush, and is rebuilt into a heap on opening
+    struct Ordered
+    {
+        bool smallest_first;
+        // If set and positive, the process ends at the comparison that brings it to zero
+        int* comparisons_left = nullptr;
+        bool operator()(uint64_t a, uint64_t b) const {
+            if (comparisons_left != nullptr && *comparisons_left > 0 && --*comparisons_left == 0)
+                _exit(0);
+            return smallest_first ? a > b : a < b;
+        };
+    };
+    using CrashedQueue = mmapped_vector::MmappedPriorityQueue<uint64_t, Ordered, mmapped_vector::MmapFileAllocator>;
+    std::remove("test_priority_queue_crash");
+    std::remove("test_priority_queue_crash.lengths");
+    run_and_crash([&] {
+        // Dies in the middle of the last pop, with the last element moved to the top
+        int comparisons_left = 0;
+        CrashedQueue* crashed = new CrashedQueue("test_priority_queue_crash", Ordered{true, &comparisons_left});
+        crashed->push_range(values.data(), 50000);
+        crashed->flush();
+        for (size_t i = 0; i < 1000; i++)
+            crashed->push(i);
+        crashed->pop();
+        comparisons_left = 1;
+        crashed->pop();
+    });
+    {
+        CrashedQueue recovered("test_priority_queue_crash", Ordered{true});
+        assert(recovered.size() == 50000);
+        for (uint64_t previous = 0; recovered.size() > 100; recovered.pop()) {
+            assert(recovered.top() >= previous);
+            previous = recovered.top();
+        }
+    }
+    // A clean close leaves a heap, which is opened as it is
+    CrashedQueue closed("test_priority_queue_crash", Ordered{true});
+    assert(closed.size() == 100);
+    for (uint64_t previous = 0; !closed.empty(); closed.pop()) {
+        assert(closed.top() >= previous);
+        previous = closed.top();
+    }
+}
+
+void test_catalog()
+{
+    const std::string directory = "test_catalog";
+    {
+        mmapped_vector::Catalog catalog(directory);
+        auto& ids = catalog.get<int>("ids");
+        auto& prices = catalog.get<double>("prices");
+        catalog.get<int>("empty");
+        for (int i = 0; i < 100; i++) {
+            ids.push_back(i);
+            prices.push_back(i * 0.5);
+        }
+        catalog.commit();
+        assert(catalog.generation() == 1);
+        assert(catalog.committed_size("ids") == 100);
+
+        // Appended but never committed
+        ids.push_back(100);
+        prices.push_back(50.0);
+    }
+    {
+        mmapped_vector::Catalog catalog(directory);
+        assert(catalog.names() == std::vector<std::string>({"empty", "ids", "prices"}));
+        auto& ids = catalog.get<int>("ids");
+        assert(ids.size() == 100);
+        assert(ids[99] == 99);
+        assert(catalog.get<int>("empty").empty());
+        try {
+            catalog.get<float>("prices");
+            assert(false);
+        } catch (std::runtime_error& e) {
+            assert(true);
+        }
+        ids.push_back(100);
+        catalog.commit();
+    }
+    {
+        mmapped_vector::Catalog catalog(directory);
+        assert(catalog.generation() == 2);
+        assert(catalog.get<int>("ids").size() == 101);
+        assert(catalog.get<double>("prices").size() == 100);
+        assert(catalog.get<double>("prices")[99] == 49.5);
+
+        // Shrinks that aren't committed leave the committed elements in the file
+        catalog.get<int>("ids").clear();
+        catalog.get<double>("prices").resize(3);
+        catalog.get<double>("prices").shrink_to_fit();
+    }
+    {
+        mmapped_vector::Catalog catalog(directory);
+        auto& ids = catalog.get<int>("ids");
+        auto& prices = catalog.get<double>("prices");
+        assert(ids.size() == 101 && ids[0] == 0 && ids[100] == 100);
+        assert(prices.size() == 100 && prices[99] == 49.5);
+
+        // Committed, they're cut as usual
+        ids.resize(10);
+        catalog.commit();
+    }
+    {
+        mmapped_vector::Catalog catalog(directory);
+        assert(catalog.get<int>("ids").size() == 10 && catalog.get<int>("ids")[9] == 9);
+    }
+    for (const char* file : {"/MANIFEST", "/ids.col", "/prices.col", "/empty.col"})
+        remove((directory + file).c_str());
+    rmdir(directory.c_str());
+}
+
+
+template <typename VectorType>
+void test_snapshots()
+{
+    VectorType vec = empty<VectorType>();
+    for (int i = 0; i < 5000; i++)
+        vec.push_back(i);
+
+    auto snapshot = vec.snapshot();
+    vec.update(0, -1);
+    vec.update(4999, -1);
+    vec.update(1024, -1);   // Straddles nothing, but shares a page with untouched elements
+    for (int i = 0; i < 100000; i++)   // Forces the vector to move
+        vec.push_back(i);
+    auto later = vec.snapshot();
+    vec.update(1, -1);
+
+    assert(snapshot.size() == 5000);
+    for (int i = 0; i < 5000; i++)
+        assert(snapshot[i] == i);
+    assert(later.size() == 105000);
+    assert(later[0] == -1 && later[1] == 1 && later[1024] == -1 && later[1025] == 1025);
+    assert(vec[0] == -1 && vec[1] == -1);
+
+    // Shrinking the vector below a snapshot leaves the snapshot whole
+    vec.resize(100);
+    vec.shrink_to_fit();
+    for (int i = 0; i < 5000; i++)
+        assert(snapshot[i] == i);
+    assert(later[1] == 1 && later[104999] == 99999);
+    vec.resize(0);
+    assert(later[1024] == -1 && later[50000] == 45000);
+
+    // Nor does destroying a vector that was cleared or popped, which cuts its file to the new size
+    for (bool popped : {false, true}) {
+        VectorType* doomed = new VectorType(empty<VectorType>());
+        for (int i = 0; i < 100000; i++)
+            doomed->push_back(i);
+        auto kept = doomed->snapshot();
+        if (popped) {
+            while (doomed->size() > 10)
+                doomed->pop_back();
+        } else {
+            doomed->clear();
+        }
+        delete doomed;
+        for (int i = 0; i < 100000; i++)
+            assert(kept[i] == i);
+    }
+}
+
+
+void test_group_commit()
+{
+    const char* file_name = "test_durable.dat";
+    const int thread_count = 8, records_per_thread = 200;
+    {
+        mmapped_vector::MmappedVector<int, mmapped_vector::MmapFileAllocator<int>, true> vec(file_name, MAP_SHARED, O_RDWR | O_CREAT | O_TRUNC);
+        std::vector<std::thread> threads;
+        for (int t = 0; t < thread_count; t++)
+            threads.emplace_back([&vec, t]() {
+                for (int i = 0; i < records_per_thread; i++)
+                    vec.wait_durable(vec.append(t * records_per_thread + i));
+            });
+        for (auto& thread : threads)
+            thread.join();
+        assert(vec.size() == thread_count * records_per_thread);
+    }
+    mmapped_vector::MmapFileVector<int> reopened(file_name);
+    std::vector<int> values(reopened.begin(), reopened.end());
+    std::sort(values.begin(), values.end());
+    for (int i = 0; i < thread_count * records_per_thread; i++)
+        assert(values[i] == i);
+    remove(file_name);
+}
+
+
+// Starts running when called and frees itself when done
+struct DetachedTask {
+    struct promise_type {
+        DetachedTask get_return_object() { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+DetachedTask async_ingest(mmapped_vector::MmapFileVector<int>& vec, mmapped_vector::AsyncExecutor& executor, bool& done)
+{
+    co_await mmapped_vector::reserve_async(vec, 100000, executor);
+    assert(vec.capacity() >= 100000);
+    for (int i = 0; i < 100000; i++)
+        vec.push_back(i);
+    co_await mmapped_vector::flush_async(vec, executor);
+    co_await mmapped_vector::wait_committed(vec, 99999, executor);
+    int answer = co_await executor.run([]() { return 42; });
+    assert(answer == 42);
+    done = true;
+}
+
+void test_async()
+{
+    const char* file_name = "test_async.dat";
+    {
+        mmapped_vector::AsyncExecutor executor;
+        mmapped_vector::MmapFileVector<int> vec(file_name, MAP_SHARED, O_RDWR | O_CREAT | O_TRUNC);
+        bool done = false;
+        async_ingest(vec, executor, done);
+        // A minimal reactor
+        while (!done) {
+            pollfd event = {executor.fd(), POLLIN, 0};
+            assert(poll(&event, 1, 1000) == 1);
+            executor.run_completions();
+        }
+        assert(vec.size() == 100000);
+    }
+    remove(file_name);
+}
+
+
+void test_handoff()
+{
+    mmapped_vector::MemfdVector<int> original;
+    for (int i = 0; i < 5000; i++)
+        original.push_back(i);
+
+    // Over a socket, as to a freshly started process
+    int sockets[2];
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) == 0);
+    RAIIFileDescriptor sender(sockets[0]), receiver(sockets[1]);
+    mmapped_vector::send_handoffs(sender.get(), {mmapped_vector::make_handoff("values", original)});
+    auto handoffs = mmapped_vector::receive_handoffs(receiver.get());
+    assert(handoffs.size() == 1 && handoffs[0].name == "values");
+    auto received = mmapped_vector::adopt_handoff<int>(handoffs[0]);
+    assert(received.size() == 5000);
+    assert(received[4999] == 4999);
+    original[0] = -1;   // Same memory, no copy
+    assert(received[0] == -1);
+
+    // Across execve, simulated within this process
+    mmapped_vector::export_for_exec("values", original);
+    auto inherited = mmapped_vector::adopt_inherited<int>("values");
+    assert(inherited && inherited->size() == 5000 && (*inherited)[0] == -1);
+    assert(!mmapped_vector::adopt_inherited<int>("missing"));
+    // Adopted once only, and gone from the environment with the last entry
+    assert(!mmapped_vector::adopt_inherited<int>("values"));
+    assert(getenv(mmapped_vector::handoff_environment_variable) == nullptr);
+
+    // Other entries stay
+    mmapped_vector::export_for_exec("first", original);
+    mmapped_vector::export_for_exec("second", original);
+    assert(mmapped_vector::adopt_inherited<int>("first"));
+    assert(std::string(getenv(mmapped_vector::handoff_environment_variable)).find("first=") == std::string::npos);
+    assert(mmapped_vector::adopt_inherited<int>("second"));
+
+    // A descriptor that isn't open is refused
+    setenv(mmapped_vector::handoff_environment_variable, "stale=1000000:10:4", 1);
+    bool threw = false;
+    try {
+        mmapped_vector::adopt_inherited<int>("stale");
+    } catch (const std::runtime_error&) {
+        threw = true;
+    }
+    assert(threw);
+    unsetenv(mmapped_vector::handoff_environment_variable);
+}
+
+
+template <typename V>
+void test_alignment_and_padding()
+{
+    V vec;
+    for (size_t i = 0; i < 100000; i++) {
+        vec.push_back(i);
+        if (i % 997 == 0) {
+            assert(reinterpret_cast<uintptr_t>(vec.data()) % V::alignment == 0);
+            // A full register's worth of bytes past the last element is still ours
+            assert(vec.capacity() + V::padding >= vec.size() + mmapped_vector::simd_padding_bytes / sizeof(typename V::value_type));
+        }
+    }
+    vec.shrink_to_fit();
+    assert(vec.capacity() >= vec.size());
+    std::memset(vec.data() + vec.size(), 0, mmapped_vector::simd_padding_bytes);
+    vec.resize(3);
+    std::memset(vec.data() + 3, 0, mmapped_vector::simd_padding_bytes);
+    assert(vec[2] == 2);
+}
+
+
+void test_adopt_and_release()
+{
+    // malloc()ed memory in and out of a MallocVector
+    int* buffer = static_cast<int*>(malloc(100 * sizeof(int)));
+    for (int i = 0; i < 10; i++)
+        buffer[i] = i;
+    auto vec = mmapped_vector::MallocVector<int>::adopt(buffer, 10, 100);
+    assert(vec.size() == 10 && vec.capacity() == 100 - vec.padding && vec.data() == buffer);
+    vec.push_back(10);
+    auto released = vec.release();
+    assert(released.ptr == buffer && released.size == 11 && released.capacity == 100);
+    assert(vec.empty());
+    std::unique_ptr<int[], decltype(&free)> owner(released.ptr, &free);
+    assert(owner[10] == 10);
+
+    // A mapping moved from one vector into another
+    mmapped_vector::MmapVector<int> source;
+    for (int i = 0; i < 5000; i++)
+        source.push_back(i);
+    auto mapping = source.release();
+    auto target = mmapped_vector::MmapVector<int>::adopt(mapping.ptr, mapping.size, mapping.capacity);
+    assert(target.size() == 5000 && target[4999] == 4999);
+
+    // An open file descriptor
+    const char* file_name = "test_adopt.dat";
+    {
+        mmapped_vector::MmapFileVector<int> file(file_name, MAP_SHARED, O_RDWR | O_CREAT | O_TRUNC);
+        file.push_back(7);
+    }
+    auto file = mmapped_vector::MmapFileVector<int>::adopt(open(file_name, O_RDWR));
+    assert(file.size() == 1 && file[0] == 7);
+    file.release().dispose();
+    remove(file_name);
+}
+
+
 int main()
 {
     std::cerr << "Running tests for std::vector" << std::endl;
@@ -170,6 +1625,105 @@ int main()
     std::cerr << "Running tests for MmappedVector (MmapFileAllocator)" << std::endl;
     run_tests<mmapped_vector::MmappedVector<int, mmapped_vector::MmapFileAllocator<int>>>();
     std::cerr << "done" << std::endl;
+    std::cerr << "Running tests for append_from_fd" << std::endl;
+    test_append_from_fd<mmapped_vector::MmappedVector<int, mmapped_vector::MallocAllocator<int>>>();
+    test_append_from_fd<mmapped_vector::MmappedVector<int, mmapped_vector::MmapFileAllocator<int>>>();
+    std::cerr << "done" << std::endl;
+    std::cerr << "Running tests for MmappedVector (MmapMemfdAllocator)" << std::endl;
+    run_tests<mmapped_vector::MemfdVector<int>>();
+    std::cerr << "done" << std::endl;
+    std::cerr << "Running tests for snapshots" << std::endl;
+    test_snapshots<mmapped_vector::MallocVector<int>>();
+    test_snapshots<mmapped_vector::MemfdVector<int>>();
+    test_snapshots<mmapped_vector::MmapFileVector<int>>();
+    std::cerr << "done" << std::endl;
+    std::cerr << "Running tests for group commit" << std::endl;
+    test_group_commit();
+    std::cerr << "done" << std::endl;
+    std::cerr << "Running tests for async operations" << std::endl;
+    test_async();
+    std::cerr << "done" << std::endl;
+    std::cerr << "Running tests for memfd handoff" << std::endl;
+    test_handoff();
+    std::cerr << "done" << std::endl;
+    std::cerr << "Running tests for adopt and release" << std::endl;
+    test_adopt_and_release();
+    std::cerr << "done" << std::endl;
+
+    std::cerr << "Running tests for alignment and padding" << std::endl;
+    test_alignment_and_padding<mmapped_vector::MallocVector<uint64_t>>();
+    test_alignment_and_padding<mmapped_vector::MallocVector<uint64_t, 64>>();
+    test_alignment_and_padding<mmapped_vector::MallocVector<char, 4096>>();
+    test_alignment_and_padding<mmapped_vector::MmapVector<uint32_t>>();
+    std::cerr << "done" << std::endl;
+
+    std::cerr << "Running tests for .npy layout" << std::endl;
+    test_npy_layout();
+    std::cerr << "done" << std::endl;
+
+    std::cerr << "Running tests for Arrow files" << std::endl;
+    test_arrow();
+    std::cerr << "done" << std::endl;
+
+    std::cerr << "Running tests for jagged arrays" << std::endl;
+    test_jagged_array();
+    std::cerr << "done" << std::endl;
+
+    std::cerr << "Running tests for dictionary columns" << std::endl;
+    test_dictionary_column();
+    std::cerr << "done" << std::endl;
+
+    std::cerr << "Running tests for Bloom and xor filters" << std::endl;
+    test_bloom_filters();
+    std::cerr << "done" << std::endl;
+
+    std::cerr << "Running tests for time series" << std::endl;
+    test_timeseries();
+    std::cerr << "done" << std::endl;
+
+    std::cerr << "Running tests for field projections" << std::endl;
+    test_projection();
+    std::cerr << "done" << std::endl;
+
+    std::cerr << "Running tests for matrices" << std::endl;
+    test_matrix();
+    std::cerr << "done" << std::endl;
+
+    std::cerr << "Running tests for parallel generate and append" << std::endl;
+    test_parallel_generate();
+    std::cerr << "done" << std::endl;
+
+    std::cerr << "Running tests for fixed-capacity vectors" << std::endl;
+    test_fixed_capacity();
+    std::cerr << "done" << std::endl;
+
+    std::cerr << "Running tests for sharded vectors" << std::endl;
+    test_sharded_vector();
+    std::cerr << "done" << std::endl;
+
+    std::cerr << "Running tests for concurrent clear, reserve and shrink" << std::endl;
+    test_concurrent_reuse();
+    std::cerr << "done" << std::endl;
+
+    std::cerr << "Running tests for concurrent stacks" << std::endl;
+    test_concurrent_stack();
+    std::cerr << "done" << std::endl;
+
+    std::cerr << "Running tests for concurrent views" << std::endl;
+    test_concurrent_view();
+    std::cerr << "done" << std::endl;
+
+    std::cerr << "Running tests for bulk loading" << std::endl;
+    test_loader();
+    std::cerr << "done" << std::endl;
+
+    std::cerr << "Running tests for priority queues" << std::endl;
+    test_priority_queue();
+    std::cerr << "done" << std::endl;
+
+    std::cerr << "Running tests for Catalog" << std::endl;
+    test_catalog();
+    std::cerr << "done" << std::endl;
 
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,286 @@
+/**
+ * @file dictionary_column.h
+ * @brief A dictionary-encoded column: uint32 codes, plus a persistent deduplicated dictionary.
+ * @author Michał Startek
+ * @version 0.1
+ * @copyright Copyright (c) Michał Startek 2024
+ */
+
+#ifndef MMAPPED_VECTOR_DICTIONARY_COLUMN_H
+#define MMAPPED_VECTOR_DICTIONARY_COLUMN_H
+
+#include <algorithm>
+#include <bit>
+#include <cstdint>
+#include <limits>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+#include "mmapped_vector.h"
+#include "committed_lengths.h"
+#include "jagged_array.h"
+#include "hash.h"
+
+
+namespace mmapped_vector {
+
+/*
+ * Every row is a uint32 code into the dictionary, which holds each distinct value once, as bytes.
+ * Values are strings, or any trivially copyable key type, stored as its object representation.
+ *
+ * The dictionary is a jagged array of chars, and an open-addressing hash table (linear probing,
+ * at most half full) maps values to codes. A slot holds the code + 1 in its low 32 bits (0 = empty)
+ * and the top half of the value's hash in the high 32 bits, so most mismatches are rejected without
+ * touching the dictionary. index[0] records how many dictionary entries the table covers; if that's
+ * not all of them (e.g. a crash between flushing the dictionary and the index), the table is rebuilt
+ * on open.
+ *
+ * A file-backed column keeps the lengths of the codes and the index in base_name + ".lengths", and
+ * the dictionary keeps its own (see CommittedLengths). Reopened after a crash, the column holds the
+ * rows it held at the last flush().
+ *
+ * Filters look the value up once and then compare codes only.
+ */
+template <template <typename> class AllocatorType = MallocAllocator>
+class MmappedDictionaryColumn
+{
+public:
+    using CodeVector = MmappedVector<uint32_t, AllocatorType<uint32_t>>;
+
+    MmappedDictionaryColumn();
+    // Keeps the column in base_name + ".codes", base_name + ".dictionary.{offsets,values}" and
+    // base_name + ".index"; the remaining arguments go to all allocators
+    template <typename... Args>
+        requires std::is_constructible_v<AllocatorType<uint32_t>, std::string, Args...>
+    explicit MmappedDictionaryColumn(const std::string& base_name, Args&&... args);
+    MmappedDictionaryColumn(MmappedDictionaryColumn&&) = default;
+    ~MmappedDictionaryColumn() { committed.record_on_close(codes, index); };
+
+    // Appends a row, adding the value to the dictionary if it's new; returns the row's code
+    uint32_t append(std::string_view value);
+    template <typename K>
+        requires (std::is_trivially_copyable_v<K> && !std::is_convertible_v<const K&, std::string_view>)
+    uint32_t append(const K& key) { return append(as_bytes(key)); };
+
+    // Code of a value, if it's in the dictionary
+    std::optional<uint32_t> find(std::string_view value) const;
+    template <typename K>
+        requires (std::is_trivially_copyable_v<K> && !std::is_convertible_v<const K&, std::string_view>)
+    std::optional<uint32_t> find(const K& key) const { return find(as_bytes(key)); };
+
+    size_t size() const { return codes.size(); };
+    bool empty() const { return codes.empty(); };
+    size_t dictionary_size() const { return dictionary.size(); };
+
+    uint32_t code(size_t row) const { return codes[row]; };
+    std::string_view decode(uint32_t code) const;
+    template <typename K>
+    K decode_as(uint32_t code) const;
+    std::string_view operator[](size_t row) const { return decode(codes[row]); };
+
+    // Decodes rows [begin, end) into out
+    void decode(size_t begin, size_t end, std::string_view* out) const;
+
+    // Number of rows equal to value, and their indices
+    size_t count_equal(std::string_view value) const;
+    std::vector<uint64_t> select_equal(std::string_view value) const;
+    // Number of rows equal to any of the values
+    size_t count_in(const std::vector<std::string_view>& values) const;
+
+    const CodeVector& get_codes() const { return codes; };
+
+    // Dictionary first, then the index, then the codes referring to them, then the lengths
+    void flush();
+
+private:
+    template <typename K>
+    static std::string_view as_bytes(const K& key) { return std::string_view(reinterpret_cast<const char*>(&key), sizeof(K)); };
+
+    size_t slot_count() const { return index.size() - 1; };
+    // Position of the value's slot, or of the empty slot where it belongs
+    size_t probe(std::string_view value, uint64_t hash) const;
+    void rebuild_index(size_t slots);
+
+    CodeVector codes;
+    MmappedJaggedArray<char, AllocatorType> dictionary;
+    MmappedVector<uint64_t, AllocatorType<uint64_t>> index;
+    CommittedLengths committed;
+};
+
+template <template <typename> class AllocatorType>
+MmappedDictionaryColumn<AllocatorType>::MmappedDictionaryColumn() {
+    rebuild_index(16);
+}
+
+template <template <typename> class AllocatorType>
+template <typename... Args>
+    requires std::is_constructible_v<AllocatorType<uint32_t>, std::string, Args...>
+MmappedDictionaryColumn<AllocatorType>::MmappedDictionaryColumn(const std::string& base_name, Args&&... args)
+    : codes(base_name + ".codes", args...), dictionary(base_name + ".dictionary", args...), index(base_name + ".index", args...),
+      committed(base_name + ".lengths") {
+    committed.restore(codes, index);
+    size_t slots = index.size() > 1 ? index.size() - 1 : 16;
+    // Slots are written in place, so after a crash some may hold codes of values added after the
+    // last flush, which the dictionary no longer has
+    auto beyond_dictionary = [this](uint64_t entry) { return static_cast<uint32_t>(entry) > dictionary.size(); };
+    if (index.empty() || index[0] != dictionary.size() || (slots & (slots - 1)) != 0 || slots < 2 * dictionary.size()
+            || std::any_of(index.begin() + 1, index.end(), beyond_dictionary))
+        rebuild_index(std::max<size_t>(std::bit_ceil(2 * dictionary.size()), 16));
+}
+
+template <template <typename> class AllocatorType>
+void MmappedDictionaryColumn<AllocatorType>::rebuild_index(size_t slots) {
+    index.resize(slots + 1);
+    std::fill(index.data(), index.data() + slots + 1, 0);
+    for (size_t code = 0; code < dictionary.size(); code++) {
+        auto entry = dictionary[code];
+        std::string_view value(entry.data(), entry.size());
+        uint64_t hash = hash_bytes(value.data(), value.size());
+        index[probe(value, hash)] = (hash >> 32 << 32) | (code + 1);
+    }
+    index[0] = dictionary.size();
+}
+
+template <template <typename> class AllocatorType>
+size_t MmappedDictionaryColumn<AllocatorType>::probe(std::string_view value, uint64_t hash) const {
+    size_t mask = slot_count() - 1;
+    for (size_t slot = hash & mask;; slot = (slot + 1) & mask) {
+        uint64_t entry = index[slot + 1];
+        if (entry == 0)
+            return slot + 1;
+        if (entry >> 32 == hash >> 32) {
+            auto stored = dictionary[static_cast<uint32_t>(entry) - 1];
+            if (std::string_view(stored.data(), stored.size()) == value)
+                return slot + 1;
+        }
+    }
+}
+
+template <template <typename> class AllocatorType>
+std::optional<uint32_t> MmappedDictionaryColumn<AllocatorType>::find(std::string_view value) const {
+    uint64_t entry = index[probe(value, hash_bytes(value.data(), value.size()))];
+    if (entry == 0)
+        return std::nullopt;
+    return static_cast<uint32_t>(entry) - 1;
+}
+
+template <template <typename> class AllocatorType>
+uint32_t MmappedDictionaryColumn<AllocatorType>::append(std::string_view value) {
+    uint64_t hash = hash_bytes(value.data(), value.size());
+    size_t slot = probe(value, hash);
+    uint32_t result;
+    if (index[slot] != 0) {
+        result = static_cast<uint32_t>(index[slot]) - 1;
+    } else {
+        if (dictionary.size() >= std::numeric_limits<uint32_t>::max() - 1)
+            throw std::length_error("MmappedDictionaryColumn::append: too many distinct values");
+        result = dictionary.append(value.data(), value.size());
+        if (2 * dictionary.size() > slot_count()) {
+            rebuild_index(2 * slot_count());
+        } else {
+            index[slot] = (hash >> 32 << 32) | (result + 1);
+            index[0] = dictionary.size();
+        }
+    }
+    codes.push_back(result);
+    return result;
+}
+
+template <template <typename> class AllocatorType> inline
+std::string_view MmappedDictionaryColumn<AllocatorType>::decode(uint32_t code) const {
+    auto entry = dictionary[code];
+    return std::string_view(entry.data(), entry.size());
+}
+
+template <template <typename> class AllocatorType>
+template <typename K>
+K MmappedDictionaryColumn<AllocatorType>::decode_as(uint32_t code) const {
+    static_assert(std::is_trivially_copyable_v<K>, "K must be trivially copyable");
+    auto entry = dictionary[code];
+    if (entry.size() != sizeof(K))
+        throw std::runtime_error("MmappedDictionaryColumn::decode_as: entry size mismatch");
+    K key;
+    std::memcpy(&key, entry.data(), sizeof(K));
+    return key;
+}
+
+template <template <typename> class AllocatorType>
+void MmappedDictionaryColumn<AllocatorType>::decode(size_t begin, size_t end, std::string_view* out) const {
+    const uint32_t* row_codes = codes.data();
+    const uint64_t* offsets = dictionary.get_offsets().data();
+    const char* characters = dictionary.get_values().data();
+    for (size_t row = begin; row < end; row++) {
+        uint32_t code = row_codes[row];
+        out[row - begin] = std::string_view(characters + offsets[code], offsets[code + 1] - offsets[code]);
+    }
+}
+
+// Branch-free, so the compiler vectorizes it into packed compares and adds
+template <template <typename> class AllocatorType>
+size_t MmappedDictionaryColumn<AllocatorType>::count_equal(std::string_view value) const {
+    std::optional<uint32_t> target = find(value);
+    if (!target)
+        return 0;
+    const uint32_t* row_codes = codes.data();
+    const uint32_t code = *target;
+    size_t count = 0;
+    for (size_t row = 0; row < codes.size(); row++)
+        count += row_codes[row] == code;
+    return count;
+}
+
+template <template <typename> class AllocatorType>
+std::vector<uint64_t> MmappedDictionaryColumn<AllocatorType>::select_equal(std::string_view value) const {
+    std::vector<uint64_t> rows;
+    std::optional<uint32_t> target = find(value);
+    if (!target)
+        return rows;
+    const uint32_t* row_codes = codes.data();
+    const uint32_t code = *target;
+    // Each row index is written unconditionally and kept only on a match
+    static constexpr size_t block = 4096;
+    for (size_t begin = 0; begin < codes.size(); begin += block) {
+        size_t end = std::min(begin + block, codes.size());
+        size_t used = rows.size();
+        rows.resize(used + (end - begin));
+        for (size_t row = begin; row < end; row++) {
+            rows[used] = row;
+            used += row_codes[row] == code;
+        }
+        rows.resize(used);
+    }
+    return rows;
+}
+
+template <template <typename> class AllocatorType>
+size_t MmappedDictionaryColumn<AllocatorType>::count_in(const std::vector<std::string_view>& values) const {
+    std::vector<uint8_t> member(dictionary.size(), 0);
+    bool any = false;
+    for (std::string_view value : values)
+        if (std::optional<uint32_t> code = find(value)) {
+            member[*code] = 1;
+            any = true;
+        }
+    if (!any)
+        return 0;
+    const uint32_t* row_codes = codes.data();
+    size_t count = 0;
+    for (size_t row = 0; row < codes.size(); row++)
+        count += member[row_codes[row]];
+    return count;
+}
+
+template <template <typename> class AllocatorType>
+void MmappedDictionaryColumn<AllocatorType>::flush() {
+    dictionary.flush();
+    index.flush();
+    codes.flush();
+    committed.record(true, codes, index);
+}
+
+} // namespace mmapped_vector
+
+#endif // MMAPPED_VECTOR_DICTIONARY_COLUMN_H
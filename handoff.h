@@ -0,0 +1,256 @@
+/**
+ * @file handoff.h
+ * @brief Passing memfd-backed vectors to a new process (across execve, or over a Unix socket)
+ * without copying their contents.
+ * @author Michał Startek
+ * @version 0.1
+ * @copyright Copyright (c) Michał Startek 2024
+ */
+
+#ifndef MMAPPED_VECTOR_HANDOFF_H
+#define MMAPPED_VECTOR_HANDOFF_H
+
+#ifdef __linux__
+
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <optional>
+#include <cstdlib>
+#include <cstdio>
+#include <cstdint>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "mmapped_vector.h"
+
+
+namespace mmapped_vector {
+
+// A named vector in transit: the memfd holding it, and how many elements of what size are in use
+struct VectorHandoff {
+    std::string name;
+    int fd;
+    size_t size;
+    size_t element_size;
+};
+
+// Environment variable carrying the vectors across execve, as "name=fd:size:element_size;..."
+static const char* const handoff_environment_variable = "MMAPPED_VECTOR_HANDOFF";
+
+template <typename T, bool thread_safe>
+VectorHandoff make_handoff(const std::string& name, const MmappedVector<T, MmapMemfdAllocator<T>, thread_safe>& vec) {
+    return VectorHandoff{name, vec.get_allocator().get_fd(), vec.size(), sizeof(T)};
+}
+
+// Takes ownership of the handoff's descriptor. The vector shares its memory with any other process
+// that still has it mapped.
+template <typename T>
+MemfdVector<T> adopt_handoff(const VectorHandoff& handoff) {
+    if (handoff.element_size != sizeof(T)) {
+        close(handoff.fd);
+        throw std::runtime_error("adopt_handoff: " + handoff.name + ": element size mismatch (sent: " +
+                                 std::to_string(handoff.element_size) + ", expected: " + std::to_string(sizeof(T)) + ")");
+    }
+    return MemfdVector<T>(adopt_tag, handoff.fd, handoff.size);
+}
+
+/*
+ * =================================================================================================
+ * Across execve
+ */
+
+namespace detail {
+
+// One entry of the environment variable: name=fd:size:element_size
+inline std::string handoff_entry(const std::string& name, int fd, size_t size, size_t element_size) {
+    return name + "=" + std::to_string(fd) + ":" + std::to_string(size) + ":" + std::to_string(element_size);
+}
+
+} // namespace detail
+
+// Makes the vector's memory survive the next execve(): a duplicate of its memfd is left open without
+// FD_CLOEXEC and recorded in the environment. Call it right before exec; later appends aren't recorded.
+template <typename T, bool thread_safe>
+void export_for_exec(const std::string& name, const MmappedVector<T, MmapMemfdAllocator<T>, thread_safe>& vec) {
+    if (name.find_first_of("=:;") != std::string::npos)
+        throw std::invalid_argument("export_for_exec: invalid vector name: " + name);
+    int fd = dup(vec.get_allocator().get_fd());
+    if (fd == -1)
+        throw std::runtime_error("export_for_exec: " + name + ": " + mmapped_vector::get_error_message("dup"));
+
+    std::string entries;
+    if (const char* existing = getenv(handoff_environment_variable))
+        entries = std::string(existing) + ";";
+    entries += detail::handoff_entry(name, fd, vec.size(), sizeof(T));
+    if (setenv(handoff_environment_variable, entries.c_str(), 1) == -1) {
+        close(fd);
+        throw std::runtime_error("export_for_exec: " + mmapped_vector::get_error_message("setenv"));
+    }
+}
+
+// The vectors the previous process image exported
+inline std::vector<VectorHandoff> inherited_handoffs() {
+    std::vector<VectorHandoff> handoffs;
+    const char* entries = getenv(handoff_environment_variable);
+    if (!entries)
+        return handoffs;
+
+    std::string remaining(entries);
+    while (!remaining.empty()) {
+        size_t end = remaining.find(';');
+        std::string entry = remaining.substr(0, end);
+        remaining = end == std::string::npos ? "" : remaining.substr(end + 1);
+
+        VectorHandoff handoff;
+        size_t equals = entry.find('=');
+        if (equals == std::string::npos ||
+            sscanf(entry.c_str() + equals + 1, "%d:%zu:%zu", &handoff.fd, &handoff.size, &handoff.element_size) != 3)
+            throw std::runtime_error(std::string("inherited_handoffs: malformed ") + handoff_environment_variable + " entry: " + entry);
+        handoff.name = entry.substr(0, equals);
+        handoffs.push_back(handoff);
+    }
+    return handoffs;
+}
+
+// Re-adopts a vector exported before execve, if there is one under that name. Its entry is removed
+// from the environment, so it's adopted once only and not passed on by a later exec, and the
+// descriptor gets FD_CLOEXEC again.
+template <typename T>
+std::optional<MemfdVector<T>> adopt_inherited(const std::string& name) {
+    std::vector<VectorHandoff> handoffs = inherited_handoffs();
+    auto found = std::find_if(handoffs.begin(), handoffs.end(), [&](const VectorHandoff& h) { return h.name == name; });
+    if (found == handoffs.end())
+        return std::nullopt;
+    VectorHandoff handoff = *found;
+    handoffs.erase(found);
+
+    std::string entries;
+    for (const VectorHandoff& other : handoffs)
+        entries += (entries.empty() ? "" : ";") + detail::handoff_entry(other.name, other.fd, other.size, other.element_size);
+    if ((entries.empty() ? unsetenv(handoff_environment_variable) : setenv(handoff_environment_variable, entries.c_str(), 1)) == -1)
+        throw std::runtime_error("adopt_inherited: " + mmapped_vector::get_error_message("setenv"));
+
+    // The number may be stale, e.g. closed, or reused by something else, if the environment was copied
+    int flags = fcntl(handoff.fd, F_GETFD);
+    if (flags == -1)
+        throw std::runtime_error("adopt_inherited: " + name + ": descriptor " + std::to_string(handoff.fd) + ": " + mmapped_vector::get_error_message("fcntl"));
+    fcntl(handoff.fd, F_SETFD, flags | FD_CLOEXEC);
+    return adopt_handoff<T>(handoff);
+}
+
+/*
+ * =================================================================================================
+ * Over a Unix domain socket
+ */
+
+namespace detail {
+
+struct HandoffHeader {
+    uint64_t size;
+    uint64_t element_size;
+    uint64_t name_length;
+};
+
+inline void send_fully(int socket_fd, const void* data, size_t length) {
+    const char* bytes = static_cast<const char*>(data);
+    while (length > 0) {
+        ssize_t sent = send(socket_fd, bytes, length, MSG_NOSIGNAL);
+        if (sent == -1) {
+            if (errno == EINTR)
+                continue;
+            throw std::runtime_error("send_handoffs: " + mmapped_vector::get_error_message("send"));
+        }
+        bytes += sent;
+        length -= sent;
+    }
+}
+
+inline void receive_fully(int socket_fd, void* data, size_t length) {
+    char* bytes = static_cast<char*>(data);
+    while (length > 0) {
+        ssize_t received = recv(socket_fd, bytes, length, 0);
+        if (received == -1 && errno == EINTR)
+            continue;
+        if (received <= 0)
+            throw std::runtime_error("receive_handoffs: " + (received == 0 ? std::string("connection closed") : mmapped_vector::get_error_message("recv")));
+        bytes += received;
+        length -= received;
+    }
+}
+
+} // namespace detail
+
+// Sends the vectors' descriptors (SCM_RIGHTS) together with their names and sizes. The caller
+// keeps its own descriptors, and the receiver gets new ones to the same memory.
+inline void send_handoffs(int socket_fd, const std::vector<VectorHandoff>& handoffs) {
+    uint64_t count = handoffs.size();
+    detail::send_fully(socket_fd, &count, sizeof(count));
+    for (const VectorHandoff& handoff : handoffs) {
+        detail::HandoffHeader header{handoff.size, handoff.element_size, handoff.name.size()};
+        iovec io{&header, sizeof(header)};
+        char control[CMSG_SPACE(sizeof(int))] = {};
+        msghdr message = {};
+        message.msg_iov = &io;
+        message.msg_iovlen = 1;
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+        cmsghdr* cmsg = CMSG_FIRSTHDR(&message);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        std::memcpy(CMSG_DATA(cmsg), &handoff.fd, sizeof(int));
+
+        ssize_t sent;
+        while ((sent = sendmsg(socket_fd, &message, MSG_NOSIGNAL)) == -1 && errno == EINTR) {};
+        if (sent == -1)
+            throw std::runtime_error("send_handoffs: " + handoff.name + ": " + mmapped_vector::get_error_message("sendmsg"));
+        // The descriptor travels with the first byte; whatever didn't fit goes out as plain data
+        detail::send_fully(socket_fd, reinterpret_cast<char*>(&header) + sent, sizeof(header) - sent);
+        detail::send_fully(socket_fd, handoff.name.data(), handoff.name.size());
+    }
+}
+
+// The received descriptors are owned by the caller until passed to adopt_handoff()
+inline std::vector<VectorHandoff> receive_handoffs(int socket_fd) {
+    uint64_t count;
+    detail::receive_fully(socket_fd, &count, sizeof(count));
+    std::vector<VectorHandoff> handoffs;
+    for (uint64_t i = 0; i < count; i++) {
+        detail::HandoffHeader header;
+        iovec io{&header, sizeof(header)};
+        char control[CMSG_SPACE(sizeof(int))] = {};
+        msghdr message = {};
+        message.msg_iov = &io;
+        message.msg_iovlen = 1;
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+
+        ssize_t received;
+        while ((received = recvmsg(socket_fd, &message, MSG_CMSG_CLOEXEC)) == -1 && errno == EINTR) {};
+        if (received <= 0)
+            throw std::runtime_error("receive_handoffs: " + (received == 0 ? std::string("connection closed") : mmapped_vector::get_error_message("recvmsg")));
+        cmsghdr* cmsg = CMSG_FIRSTHDR(&message);
+        if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            throw std::runtime_error("receive_handoffs: message carries no file descriptor");
+
+        VectorHandoff handoff;
+        std::memcpy(&handoff.fd, CMSG_DATA(cmsg), sizeof(int));
+        RAIIFileDescriptor owned_fd(handoff.fd);
+        detail::receive_fully(socket_fd, reinterpret_cast<char*>(&header) + received, sizeof(header) - received);
+        handoff.name.resize(header.name_length);
+        detail::receive_fully(socket_fd, handoff.name.data(), header.name_length);
+        handoff.size = header.size;
+        handoff.element_size = header.element_size;
+        owned_fd.release();
+        handoffs.push_back(handoff);
+    }
+    return handoffs;
+}
+
+} // namespace mmapped_vector
+
+#endif // __linux__
+
+#endif // MMAPPED_VECTOR_HANDOFF_H
@@ -0,0 +1,54 @@
+/**
+ * @file hash.h
+ * @brief Hashing of keys for the on-disk indices and filters.
+ * @author Michał Startek
+ * @version 0.1
+ * @copyright Copyright (c) Michał Startek 2024
+ */
+
+#ifndef MMAPPED_VECTOR_HASH_H
+#define MMAPPED_VECTOR_HASH_H
+
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+#include <type_traits>
+
+
+namespace mmapped_vector {
+
+// 64-bit hash of a byte string. Stable across runs and platforms, as it's stored in the index.
+inline uint64_t hash_bytes(const char* data, size_t length) {
+    uint64_t hash = 0x9E3779B97F4A7C15ull ^ length;
+    size_t i = 0;
+    for (; i + 8 <= length; i += 8) {
+        uint64_t word;
+        std::memcpy(&word, data + i, 8);
+        hash = (hash ^ word) * 0xBF58476D1CE4E5B9ull;
+        hash ^= hash >> 31;
+    }
+    uint64_t tail = 0;
+    if (length > i)
+        std::memcpy(&tail, data + i, length - i);
+    hash = (hash ^ tail) * 0x94D049BB133111EBull;
+    hash ^= hash >> 29;
+    hash *= 0xBF58476D1CE4E5B9ull;
+    return hash ^ (hash >> 32);
+}
+
+// Strings are hashed by their characters, anything else by its object representation, so keys
+// with padding bytes must have them zeroed
+template <typename K>
+uint64_t hash_key(const K& key) {
+    if constexpr(std::is_convertible_v<const K&, std::string_view>) {
+        std::string_view bytes = key;
+        return hash_bytes(bytes.data(), bytes.size());
+    } else {
+        static_assert(std::is_trivially_copyable_v<K>, "keys must be strings or trivially copyable");
+        return hash_bytes(reinterpret_cast<const char*>(&key), sizeof(K));
+    }
+}
+
+} // namespace mmapped_vector
+
+#endif // MMAPPED_VECTOR_HASH_H
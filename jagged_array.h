@@ -0,0 +1,261 @@
+/**
+ * @file jagged_array.h
+ * @brief A vector of variable-length lists, stored as two MmappedVectors (CSR layout).
+ * @author Michał Startek
+ * @version 0.1
+ * @copyright Copyright (c) Michał Startek 2024
+ */
+
+#ifndef MMAPPED_VECTOR_JAGGED_ARRAY_H
+#define MMAPPED_VECTOR_JAGGED_ARRAY_H
+
+#include <cstdint>
+#include <span>
+#include <ranges>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "mmapped_vector.h"
+#include "committed_lengths.h"
+#include "parallel.h"
+
+
+namespace mmapped_vector {
+
+/*
+ * List i is values[offsets[i] .. offsets[i + 1]). offsets always starts with a 0, so it holds
+ * size() + 1 entries. Appends write the values before the offset that makes them visible.
+ *
+ * A file-backed array also keeps the lengths of both vectors in base_name + ".lengths" (see
+ * CommittedLengths), recorded by flush() and on close. Reopened after a crash, it holds what it
+ * held at the last flush(). Appends after pop_back(), and build(), overwrite flushed elements, so
+ * they flush first.
+ */
+template <typename T, template <typename> class AllocatorType = MallocAllocator>
+class MmappedJaggedArray
+{
+public:
+    using value_type = std::span<T>;
+    using size_type = size_t;
+    using OffsetVector = MmappedVector<uint64_t, AllocatorType<uint64_t>>;
+    using ValueVector = MmappedVector<T, AllocatorType<T>>;
+
+    MmappedJaggedArray();
+    // Keeps the array in base_name + ".offsets" and base_name + ".values"; the remaining arguments
+    // go to both allocators (e.g. mmap and open flags)
+    template <typename... Args>
+        requires std::is_constructible_v<AllocatorType<T>, std::string, Args...>
+    explicit MmappedJaggedArray(const std::string& base_name, Args&&... args);
+    MmappedJaggedArray(MmappedJaggedArray&&) = default;
+    ~MmappedJaggedArray() { committed.record_on_close(offsets, values); };
+
+    // Number of lists
+    size_t size() const { return offsets.size() - 1; };
+    bool empty() const { return size() == 0; };
+    // Number of values in all lists together
+    size_t total_size() const { return offsets.back(); };
+
+    std::span<T> operator[](size_t index);
+    std::span<const T> operator[](size_t index) const;
+    std::span<T> at(size_t index);
+    std::span<const T> at(size_t index) const;
+
+    // All lists, in order, as spans
+    auto lists() const { return std::views::iota(size_t(0), size()) | std::views::transform([this](size_t i) { return (*this)[i]; }); };
+
+    // Appends a whole list, and returns its index
+    size_t append(const T* first, size_t count);
+    template <std::ranges::contiguous_range R>
+    size_t append(R&& list) { return append(std::ranges::data(list), std::ranges::size(list)); };
+    // Adds a value to the end of the last list
+    void extend_last(const T& value);
+
+    void pop_back();
+    void clear();
+    void reserve(size_t lists, size_t values);
+    void flush();
+
+    // Replaces the contents with key_count lists, list k holding the values of all pairs with key k,
+    // in their original order. A parallel counting sort: every thread counts the keys in its share
+    // of the pairs, then copies its values straight to their final positions.
+    template <typename Key>
+    void build(std::span<const std::pair<Key, T>> pairs, size_t key_count, size_t thread_count = default_thread_count());
+
+    const OffsetVector& get_offsets() const { return offsets; };
+    const ValueVector& get_values() const { return values; };
+
+private:
+    void check_consistency();
+    // Flushes if writing lists from offsets[offset_position] and values[value_position] on would
+    // overwrite elements covered by the recorded lengths
+    void protect_recorded(size_t offset_position, size_t value_position);
+
+    OffsetVector offsets;
+    ValueVector values;
+    CommittedLengths committed;
+};
+
+template <typename T, template <typename> class AllocatorType>
+MmappedJaggedArray<T, AllocatorType>::MmappedJaggedArray() {
+    offsets.push_back(0);
+}
+
+template <typename T, template <typename> class AllocatorType>
+template <typename... Args>
+    requires std::is_constructible_v<AllocatorType<T>, std::string, Args...>
+MmappedJaggedArray<T, AllocatorType>::MmappedJaggedArray(const std::string& base_name, Args&&... args)
+    : offsets(base_name + ".offsets", args...), values(base_name + ".values", args...), committed(base_name + ".lengths") {
+    committed.restore(offsets, values);
+    check_consistency();
+}
+
+template <typename T, template <typename> class AllocatorType>
+void MmappedJaggedArray<T, AllocatorType>::check_consistency() {
+    if (offsets.empty())
+        offsets.push_back(0);
+    if (offsets[0] != 0)
+        throw std::runtime_error("MmappedJaggedArray::ctor: offsets don't start at 0. The file is probably corrupted.");
+    // extend_last() moves the last offset past the recorded values
+    if (offsets.size() > 1 && offsets.back() > values.size() && offsets[offsets.size() - 2] <= values.size())
+        offsets.back() = values.size();
+    if (values.size() < offsets.back())
+        throw std::runtime_error("MmappedJaggedArray::ctor: fewer values than the offsets refer to. The file is probably corrupted.");
+    // Values of a list whose offset never got written
+    if (values.size() > offsets.back())
+        values.resize(offsets.back());
+}
+
+template <typename T, template <typename> class AllocatorType> inline
+std::span<T> MmappedJaggedArray<T, AllocatorType>::operator[](size_t index) {
+    return std::span<T>(values.data() + offsets[index], offsets[index + 1] - offsets[index]);
+}
+
+template <typename T, template <typename> class AllocatorType> inline
+std::span<const T> MmappedJaggedArray<T, AllocatorType>::operator[](size_t index) const {
+    return std::span<const T>(values.data() + offsets[index], offsets[index + 1] - offsets[index]);
+}
+
+template <typename T, template <typename> class AllocatorType>
+std::span<T> MmappedJaggedArray<T, AllocatorType>::at(size_t index) {
+    if (index >= size())
+        throw std::out_of_range("MmappedJaggedArray::at: index out of range");
+    return (*this)[index];
+}
+
+template <typename T, template <typename> class AllocatorType>
+std::span<const T> MmappedJaggedArray<T, AllocatorType>::at(size_t index) const {
+    if (index >= size())
+        throw std::out_of_range("MmappedJaggedArray::at: index out of range");
+    return (*this)[index];
+}
+
+template <typename T, template <typename> class AllocatorType> inline
+void MmappedJaggedArray<T, AllocatorType>::protect_recorded(size_t offset_position, size_t value_position) {
+    if (offset_position < committed.recorded_length(0) || value_position < committed.recorded_length(1))
+        flush();
+}
+
+template <typename T, template <typename> class AllocatorType>
+size_t MmappedJaggedArray<T, AllocatorType>::append(const T* first, size_t count) {
+    protect_recorded(offsets.size(), values.size());
+    values.append_range(first, count);
+    offsets.push_back(values.size());
+    return size() - 1;
+}
+
+template <typename T, template <typename> class AllocatorType>
+void MmappedJaggedArray<T, AllocatorType>::extend_last(const T& value) {
+    if (empty())
+        throw std::out_of_range("MmappedJaggedArray::extend_last: the array is empty");
+    // The last offset itself may be a recorded one; check_consistency() puts it right on reopening
+    protect_recorded(offsets.size(), values.size());
+    values.push_back(value);
+    offsets.back() = values.size();
+}
+
+template <typename T, template <typename> class AllocatorType>
+void MmappedJaggedArray<T, AllocatorType>::pop_back() {
+    offsets.pop_back();
+    values.resize(offsets.back());
+}
+
+template <typename T, template <typename> class AllocatorType>
+void MmappedJaggedArray<T, AllocatorType>::clear() {
+    offsets.resize(1);
+    values.clear();
+}
+
+template <typename T, template <typename> class AllocatorType>
+void MmappedJaggedArray<T, AllocatorType>::reserve(size_t lists, size_t value_count) {
+    offsets.reserve(lists + 1);
+    values.reserve(value_count);
+}
+
+// Values first, so the offsets on disk never refer to values that aren't there, and the lengths
+// last, once everything they cover is on disk
+template <typename T, template <typename> class AllocatorType>
+void MmappedJaggedArray<T, AllocatorType>::flush() {
+    values.flush();
+    offsets.flush();
+    committed.record(true, offsets, values);
+}
+
+template <typename T, template <typename> class AllocatorType>
+template <typename Key>
+void MmappedJaggedArray<T, AllocatorType>::build(std::span<const std::pair<Key, T>> pairs, size_t key_count, size_t thread_count) {
+    static_assert(std::is_integral_v<Key>, "keys must be integers");
+    size_t chunks = std::clamp<size_t>(pairs.size() / (1 << 14), 1, std::max<size_t>(thread_count, 1));
+    // Every chunk counts all keys, so with many keys and few pairs, fewer chunks keep the counters
+    // within the size of the pairs
+    chunks = std::clamp<size_t>(pairs.size() / std::max<size_t>(key_count, 1), 1, chunks);
+
+    // counts[chunk * key_count + key]: first how many pairs of the chunk have the key, then where
+    // the chunk's first value for the key goes, relative to the start of list `key`
+    std::vector<uint64_t> counts(chunks * key_count, 0);
+    parallel_chunks(pairs.size(), chunks, [&](size_t chunk, size_t begin, size_t end) {
+        uint64_t* local = counts.data() + chunk * key_count;
+        for (size_t i = begin; i < end; i++) {
+            // Negative keys wrap around to values above key_count
+            if (static_cast<std::make_unsigned_t<Key>>(pairs[i].first) >= key_count)
+                throw std::out_of_range("MmappedJaggedArray::build: key out of range");
+            local[pairs[i].first]++;
+        }
+    });
+
+    // Everything is rewritten, so a crash while building leaves an empty array rather than a mix
+    if (committed.recorded_length(0) > 1 || committed.recorded_length(1) > 0) {
+        clear();
+        flush();
+    }
+    offsets.resize(key_count + 1);
+    values.resize(pairs.size());
+    uint64_t* list_begin = offsets.data();
+    parallel_for(key_count, [&](size_t begin, size_t end) {
+        for (size_t key = begin; key < end; key++) {
+            uint64_t position = 0;
+            for (size_t chunk = 0; chunk < chunks; chunk++) {
+                uint64_t count = counts[chunk * key_count + key];
+                counts[chunk * key_count + key] = position;
+                position += count;
+            }
+            list_begin[key + 1] = position;
+        }
+    }, thread_count);
+    list_begin[0] = 0;
+    for (size_t key = 0; key < key_count; key++)
+        list_begin[key + 1] += list_begin[key];
+
+    T* out = values.data();
+    parallel_chunks(pairs.size(), chunks, [&](size_t chunk, size_t begin, size_t end) {
+        uint64_t* local = counts.data() + chunk * key_count;
+        for (size_t i = begin; i < end; i++) {
+            size_t key = pairs[i].first;
+            out[list_begin[key] + local[key]++] = pairs[i].second;
+        }
+    });
+}
+
+} // namespace mmapped_vector
+
+#endif // MMAPPED_VECTOR_JAGGED_ARRAY_H
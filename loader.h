@@ -0,0 +1,293 @@
+/**
+ * @file loader.h
+ * @brief Parallel loading of binary record files and delimited text into vectors.
+ * @author Michał Startek
+ * @version 0.1
+ * @copyright Copyright (c) Michał Startek 2024
+ */
+
+#ifndef MMAPPED_VECTOR_LOADER_H
+#define MMAPPED_VECTOR_LOADER_H
+
+#include <algorithm>
+#include <array>
+#include <charconv>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+#include "mmapped_vector.h"
+#include "parallel.h"
+
+
+namespace mmapped_vector {
+
+// A whole file mapped read-only, for the loaders
+class MappedInput
+{
+public:
+    explicit MappedInput(const std::string& file_name);
+    MappedInput(const MappedInput&) = delete;
+    MappedInput& operator=(const MappedInput&) = delete;
+    ~MappedInput();
+
+    const char* data() const { return mapping; };
+    size_t size() const { return mapped_bytes; };
+
+private:
+    const char* mapping = nullptr;
+    size_t mapped_bytes = 0;
+};
+
+inline MappedInput::MappedInput(const std::string& file_name) {
+    RAIIFileDescriptor fd(open(file_name.c_str(), O_RDONLY));
+    if (fd.get() == -1)
+        throw std::runtime_error("MappedInput::ctor: " + file_name + ": " + mmapped_vector::get_error_message("open"));
+    struct stat st;
+    if (fstat(fd.get(), &st) == -1)
+        throw std::runtime_error("MappedInput::ctor: " + file_name + ": " + mmapped_vector::get_error_message("fstat"));
+    mapped_bytes = st.st_size;
+    if (mapped_bytes == 0)
+        return;
+    void* mapped = mmap(nullptr, mapped_bytes, PROT_READ, MAP_SHARED, fd.get(), 0);
+    if (mapped == MAP_FAILED)
+        throw std::runtime_error("MappedInput::ctor: " + file_name + ": " + mmapped_vector::get_error_message("mmap"));
+    mapping = static_cast<const char*>(mapped);
+    // Every thread reads its part front to back; this only doubles the kernel's readahead
+    madvise(mapped, mapped_bytes, MADV_SEQUENTIAL);
+}
+
+inline MappedInput::~MappedInput() {
+    if (mapping != nullptr)
+        munmap(const_cast<char*>(mapping), mapped_bytes);
+}
+
+/*
+ * =================================================================================================
+ */
+
+// Appends the records of a file of back-to-back Record structs, as written by fwrite() of an array
+// (or by MmapFileAllocator), to out. The file is mapped, and the new elements are copied out of it by
+// parallel_append(), one page-aligned part of the output per thread. Returns the number appended.
+template <typename Record, typename Vector>
+size_t load_binary(const std::string& file_name, Vector& out, size_t thread_count = default_thread_count()) {
+    static_assert(std::is_trivially_copyable_v<Record>, "records are copied from the file as bytes");
+    static_assert(std::is_same_v<typename Vector::value_type, Record>, "the vector must hold the file's records");
+    MappedInput input(file_name);
+    if (input.size() % sizeof(Record) != 0)
+        throw std::runtime_error("load_binary: " + file_name + ": size is not a multiple of the record size");
+    size_t count = input.size() / sizeof(Record);
+    const char* records = input.data();
+    out.parallel_append(count, [records](size_t i) {
+        Record record;
+        std::memcpy(&record, records + i * sizeof(Record), sizeof(Record));
+        return record;
+    }, thread_count);
+    return count;
+}
+
+/*
+ * =================================================================================================
+ */
+
+struct CsvOptions
+{
+    char delimiter = ',';
+    // Skip the first line
+    bool header = false;
+};
+
+namespace detail {
+
+// A line with nothing on it but a '\r' (or nothing at all) is blank; p is a line start
+inline bool is_blank_line(const char* p, const char* end) {
+    if (p != end && *p == '\r')
+        p++;
+    return p == end || *p == '\n';
+}
+
+// Number of lines in [begin, end) that aren't blank, counting an unterminated last line; begin is a
+// line start. A newline ends a blank line if it's the first character of the line, or the second after
+// a '\r'.
+inline size_t count_rows(const char* begin, const char* end) {
+    size_t count = 0;
+    const char* p = begin;
+    auto blank_end = [begin](const char* newline) {
+        return newline == begin || newline[-1] == '\n' || (newline[-1] == '\r' && (newline - 1 == begin || newline[-2] == '\n'));
+    };
+    for (; p < std::min(begin + 2, end); p++)
+        count += *p == '\n' && !blank_end(p);
+#ifdef __AVX2__
+    const __m256i newline = _mm256_set1_epi8('\n');
+    const __m256i carriage_return = _mm256_set1_epi8('\r');
+    for (; p + 32 <= end; p += 32) {
+        __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+        __m256i previous = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p - 1));
+        __m256i before_previous = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p - 2));
+        __m256i blank = _mm256_or_si256(_mm256_cmpeq_epi8(previous, newline),
+            _mm256_and_si256(_mm256_cmpeq_epi8(previous, carriage_return), _mm256_cmpeq_epi8(before_previous, newline)));
+        count += __builtin_popcount(static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_andnot_si256(blank, _mm256_cmpeq_epi8(block, newline)))));
+    }
+#endif
+    for (; p < end; p++)
+        count += *p == '\n' && !blank_end(p);
+    if (begin != end && end[-1] != '\n') {
+        const char* last_line = end;
+        while (last_line != begin && last_line[-1] != '\n')
+            last_line--;
+        count += !is_blank_line(last_line, end);
+    }
+    return count;
+}
+
+// First delimiter or newline in [p, end), or end
+inline const char* find_field_end(const char* p, const char* end, char delimiter) {
+#ifdef __AVX2__
+    const __m256i newline = _mm256_set1_epi8('\n');
+    const __m256i separator = _mm256_set1_epi8(delimiter);
+    for (; p + 32 <= end; p += 32) {
+        __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+        uint32_t mask = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_or_si256(
+            _mm256_cmpeq_epi8(block, newline), _mm256_cmpeq_epi8(block, separator))));
+        if (mask != 0)
+            return p + __builtin_ctz(mask);
+    }
+#endif
+    for (; p < end; p++)
+        if (*p == delimiter || *p == '\n')
+            return p;
+    return end;
+}
+
+// The first line start at or after position: position itself if a line starts there, otherwise just
+// past the next newline
+inline const char* next_line_start(const char* begin, const char* position, const char* end) {
+    if (position == begin || position == end || position[-1] == '\n')
+        return position;
+    const char* newline = static_cast<const char*>(std::memchr(position, '\n', end - position));
+    return newline == nullptr ? end : newline + 1;
+}
+
+} // namespace detail
+
+// Parses delimited text into one vector per column, appending a row to all of them per line, e.g.
+//     load_csv("trades.csv", std::tie(times, prices, volumes));
+// Fields are numbers, read with std::from_chars as the column's element type. Quoted fields are not
+// supported, so newlines always end records; a '\r' before a newline is ignored, and blank lines
+// (including a trailing one) are skipped.
+//
+// The file is mapped and split into one part per thread, each starting at a line start. The threads
+// count their lines (comparing 32 bytes at a time with AVX2), the columns are resized once to hold all
+// of them, and every thread then parses its part into its own contiguous rows of every column,
+// finding delimiters 32 bytes at a time. With file-backed columns (MmapFileVector), the text goes
+// straight into the column files. Returns the number of rows appended; if a line doesn't parse, the
+// columns are restored to their sizes before the call and std::runtime_error says which line.
+template <typename... Columns>
+size_t load_csv(const std::string& file_name, std::tuple<Columns&...> columns, const CsvOptions& options = CsvOptions(),
+                size_t thread_count = default_thread_count()) {
+    constexpr size_t column_count = sizeof...(Columns);
+    static_assert(column_count > 0, "at least one column");
+    static_assert((std::is_arithmetic_v<typename Columns::value_type> && ...), "columns must hold numbers");
+
+    MappedInput input(file_name);
+    const char* begin = input.data();
+    const char* end = begin + input.size();
+    if (options.header && begin != end) {
+        const char* newline = static_cast<const char*>(std::memchr(begin, '\n', end - begin));
+        begin = newline == nullptr ? end : newline + 1;
+    }
+    size_t first_line = options.header ? 2 : 1;
+
+    // Parts of at least 1 MiB, moved forward to line starts
+    size_t bytes = end - begin;
+    size_t parts = std::clamp<size_t>(bytes / (size_t(1) << 20), 1, std::max<size_t>(thread_count, 1));
+    std::vector<const char*> bounds(parts + 1);
+    for (size_t part = 0; part <= parts; part++)
+        bounds[part] = detail::next_line_start(begin, begin + chunk_begin(bytes, parts, part), end);
+
+    // Rows of every part: its lines that aren't blank
+    std::vector<size_t> rows(parts + 1, 0);
+    parallel_chunks(parts, parts, [&](size_t part, size_t, size_t) {
+        rows[part + 1] = detail::count_rows(bounds[part], bounds[part + 1]);
+    });
+    for (size_t part = 0; part < parts; part++)
+        rows[part + 1] += rows[part];
+    size_t total = rows[parts];
+
+    std::array<size_t, column_count> old_sizes;
+    std::apply([&](auto&... column) {
+        size_t c = 0;
+        ((old_sizes[c++] = column.size()), ...);
+    }, columns);
+    std::apply([&](auto&... column) {
+        size_t c = 0;
+        (column.resize(old_sizes[c++] + total), ...);
+    }, columns);
+
+    try {
+        auto destinations = [&]<size_t... c>(std::index_sequence<c...>) {
+            return std::make_tuple((std::get<c>(columns).data() + old_sizes[c])...);
+        }(std::make_index_sequence<column_count>());
+        parallel_chunks(parts, parts, [&](size_t part, size_t, size_t) {
+            const char* p = bounds[part];
+            const char* part_end = bounds[part + 1];
+            for (size_t row = rows[part]; row < rows[part + 1]; row++) {
+                while (detail::is_blank_line(p, part_end))
+                    p = static_cast<const char*>(std::memchr(p, '\n', part_end - p)) + 1;
+                const char* line_start = p;
+                auto fail = [&](const char* what) {
+                    // Blank lines don't make rows, so the line number is counted here, when it's needed
+                    size_t line = first_line + std::count(begin, line_start, '\n');
+                    throw std::runtime_error("load_csv: " + file_name + ": line " + std::to_string(line) + ": " + what);
+                };
+                size_t field = 0;
+                std::apply([&](auto*... destination) {
+                    auto parse = [&](auto* out) {
+                        if (field++ > 0) {
+                            if (p == part_end || *p != options.delimiter)
+                                fail("too few fields");
+                            p++;
+                        }
+                        const char* field_end = detail::find_field_end(p, part_end, options.delimiter);
+                        const char* value_end = field_end;
+                        if (value_end > p && value_end[-1] == '\r')
+                            value_end--;
+                        auto [parsed_end, error] = std::from_chars(p, value_end, out[row]);
+                        if (error != std::errc() || parsed_end != value_end)
+                            fail("not a number");
+                        p = field_end;
+                    };
+                    (parse(destination), ...);
+                }, destinations);
+                if (p != part_end && *p != '\n')
+                    fail("too many fields");
+                if (p != part_end)
+                    p++;
+            }
+        });
+    } catch (...) {
+        std::apply([&](auto&... column) {
+            size_t c = 0;
+            (column.resize(old_sizes[c++]), ...);
+        }, columns);
+        throw;
+    }
+    return total;
+}
+
+} // namespace mmapped_vector
+
+#endif // MMAPPED_VECTOR_LOADER_H
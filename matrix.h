@@ -0,0 +1,385 @@
+/**
+ * @file matrix.h
+ * @brief A two-dimensional matrix in an MmappedVector, in row-major, column-major or tiled layout.
+ * @author Michał Startek
+ * @version 0.1
+ * @copyright Copyright (c) Michał Startek 2024
+ */
+
+#ifndef MMAPPED_VECTOR_MATRIX_H
+#define MMAPPED_VECTOR_MATRIX_H
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <ranges>
+#include <span>
+#include <stdexcept>
+#include <string>
+
+#if __has_include(<mdspan>)
+#include <mdspan>
+#endif
+
+#include "mmapped_vector.h"
+#include "parallel.h"
+
+
+namespace mmapped_vector {
+
+enum class MatrixLayout : uint64_t
+{
+    row_major,
+    column_major,
+    // Tile x Tile blocks, each row-major, stored row of tiles by row of tiles. Any
+    // Tile x Tile square is at most 4 contiguous runs, whichever way it is walked.
+    tiled
+};
+
+#ifndef __cpp_lib_mdspan
+// Stands in for std::mdspan<T, std::dextents<size_t, 2>, std::layout_stride> where there's no
+// <mdspan> (before C++23). It has the same extent(), stride(), size(), empty() and data_handle(), but
+// element (row, col) is view(row, col), as there's no view[row, col] yet.
+template <typename T>
+class StridedMatrixView
+{
+public:
+    StridedMatrixView(T* data, std::array<size_t, 2> extents, std::array<size_t, 2> strides)
+        : data(data), extents(extents), strides(strides) {};
+    // Read-only view of the same elements
+    operator StridedMatrixView<const T>() const { return StridedMatrixView<const T>(data, extents, strides); };
+
+    size_t extent(size_t rank) const { return extents[rank]; };
+    size_t stride(size_t rank) const { return strides[rank]; };
+    size_t size() const { return extents[0] * extents[1]; };
+    bool empty() const { return size() == 0; };
+    T* data_handle() const { return data; };
+    T& operator()(size_t row, size_t col) const { return data[row * strides[0] + col * strides[1]]; };
+
+private:
+    T* data;
+    std::array<size_t, 2> extents;
+    std::array<size_t, 2> strides;
+};
+#endif
+
+/*
+ * A rows x cols matrix of T, stored in one MmappedVector, with a small shape vector next to it
+ * (layout, tile size, rows, cols, and the column stride of a column-major matrix).
+ *
+ * Rows are appended at the bottom. In row-major layout that's an append to the vector. In tiled
+ * layout, a new row of tiles is added every Tile rows. A column-major matrix keeps room for more
+ * rows at the end of each column, and when it runs out, doubles it and moves the columns apart.
+ *
+ * The unused parts of tiles on the right and bottom edge are kept zeroed.
+ */
+template <typename T, MatrixLayout Layout = MatrixLayout::row_major, template <typename> class AllocatorType = MallocAllocator, size_t Tile = 64>
+class MmappedMatrix
+{
+public:
+    static constexpr MatrixLayout layout = Layout;
+    static constexpr size_t tile_size = Tile;
+    using DataVector = MmappedVector<T, AllocatorType<T>>;
+
+    MmappedMatrix(size_t rows = 0, size_t cols = 0);
+    // Keeps the matrix in base_name + ".data" and its shape in base_name + ".shape". A new matrix
+    // starts with no rows; an existing one must have the given layout, tile size and column count.
+    // The remaining arguments go to both allocators.
+    template <typename... Args>
+        requires std::is_constructible_v<AllocatorType<T>, std::string, Args...>
+    MmappedMatrix(const std::string& base_name, size_t cols, Args&&... args);
+
+    size_t rows() const { return row_count; };
+    size_t cols() const { return col_count; };
+
+    // Position of element (row, col) in get_data()
+    size_t index(size_t row, size_t col) const;
+    T& operator()(size_t row, size_t col) { return data[index(row, col)]; };
+    const T& operator()(size_t row, size_t col) const { return data[index(row, col)]; };
+    T& at(size_t row, size_t col);
+    const T& at(size_t row, size_t col) const;
+
+    // Contiguous rows and columns, where the layout has them
+    std::span<T> row(size_t row) requires (Layout == MatrixLayout::row_major) { return std::span<T>(data.data() + row * col_count, col_count); };
+    std::span<T> column(size_t col) requires (Layout == MatrixLayout::column_major) { return std::span<T>(data.data() + col * row_stride, row_count); };
+
+    // Appends a row of cols() values
+    void append_row(const T* values);
+    template <std::ranges::contiguous_range R>
+    void append_row(R&& values);
+    void reserve_rows(size_t rows);
+    // Discards the contents and makes the matrix rows x cols, zero-filled
+    void reset(size_t rows, size_t cols);
+
+    // Calls f(row_begin, row_end, col_begin, col_end) for every Tile x Tile block, clipped to the
+    // matrix, in the order that walks the storage front to back
+    template <typename F>
+    void for_each_tile(F&& f) const;
+
+    // Writes the matrix, or its transpose, to out, which may have another layout; blocks of
+    // Tile x Tile are copied in parallel, so neither side is read or written with a large stride
+    template <MatrixLayout OutLayout, template <typename> class OutAllocator>
+    void copy_into(MmappedMatrix<T, OutLayout, OutAllocator, Tile>& out, size_t thread_count = default_thread_count()) const;
+    template <MatrixLayout OutLayout, template <typename> class OutAllocator>
+    void transpose_into(MmappedMatrix<T, OutLayout, OutAllocator, Tile>& out, size_t thread_count = default_thread_count()) const;
+
+    // Views of the elements with a stride per dimension: std::mdspan where the standard library has
+    // it, StridedMatrixView otherwise
+#ifdef __cpp_lib_mdspan
+    using View = std::mdspan<T, std::dextents<size_t, 2>, std::layout_stride>;
+    using ConstView = std::mdspan<const T, std::dextents<size_t, 2>, std::layout_stride>;
+#else
+    using View = StridedMatrixView<T>;
+    using ConstView = StridedMatrixView<const T>;
+#endif
+    // The whole matrix, for row- and column-major layouts
+    View view() requires (Layout != MatrixLayout::tiled) { return make_view<View>(data.data(), {row_count, col_count}, view_strides()); };
+    ConstView view() const requires (Layout != MatrixLayout::tiled) { return make_view<ConstView>(data.data(), {row_count, col_count}, view_strides()); };
+    // One tile, clipped to the matrix, for the tiled layout
+    View tile(size_t tile_row, size_t tile_col) requires (Layout == MatrixLayout::tiled) {
+        return make_view<View>(data.data() + tile_begin(tile_row, tile_col), tile_extents(tile_row, tile_col), {Tile, 1});
+    };
+    ConstView tile(size_t tile_row, size_t tile_col) const requires (Layout == MatrixLayout::tiled) {
+        return make_view<ConstView>(data.data() + tile_begin(tile_row, tile_col), tile_extents(tile_row, tile_col), {Tile, 1});
+    };
+
+    const DataVector& get_data() const { return data; };
+    void flush();
+
+private:
+    static constexpr uint64_t shape_entries = 5;
+
+    size_t tile_columns() const { return (col_count + Tile - 1) / Tile; };
+    size_t tile_begin(size_t tile_row, size_t tile_col) const { return (tile_row * tile_columns() + tile_col) * Tile * Tile; };
+    // Number of elements the storage needs for the current shape
+    size_t storage_size() const;
+    // Grows the data to size elements, zero-filling the new ones, with geometric growth of the capacity
+    void grow_data(size_t size);
+    void store_shape();
+
+    std::array<size_t, 2> view_strides() const {
+        // Strides must be positive, even for an empty matrix
+        if constexpr(Layout == MatrixLayout::row_major)
+            return {std::max<size_t>(col_count, 1), 1};
+        else
+            return {1, std::max<size_t>(row_stride, 1)};
+    };
+    std::array<size_t, 2> tile_extents(size_t tile_row, size_t tile_col) const {
+        return {std::min(Tile, row_count - tile_row * Tile), std::min(Tile, col_count - tile_col * Tile)};
+    };
+    template <typename V, typename P>
+    static V make_view(P* pointer, std::array<size_t, 2> extents, std::array<size_t, 2> strides) {
+#ifdef __cpp_lib_mdspan
+        using Extents = std::dextents<size_t, 2>;
+        return V(pointer, std::layout_stride::mapping<Extents>(Extents(extents[0], extents[1]), strides));
+#else
+        return V(pointer, extents, strides);
+#endif
+    };
+
+    DataVector data;
+    MmappedVector<uint64_t, AllocatorType<uint64_t>> shape;
+    size_t row_count = 0;
+    size_t col_count = 0;
+    // Distance between the columns of a column-major matrix, in elements
+    size_t row_stride = 0;
+};
+
+template <typename T, MatrixLayout Layout, template <typename> class AllocatorType, size_t Tile>
+MmappedMatrix<T, Layout, AllocatorType, Tile>::MmappedMatrix(size_t rows, size_t cols) {
+    reset(rows, cols);
+}
+
+template <typename T, MatrixLayout Layout, template <typename> class AllocatorType, size_t Tile>
+template <typename... Args>
+    requires std::is_constructible_v<AllocatorType<T>, std::string, Args...>
+MmappedMatrix<T, Layout, AllocatorType, Tile>::MmappedMatrix(const std::string& base_name, size_t cols, Args&&... args)
+    : data(base_name + ".data", args...), shape(base_name + ".shape", args...) {
+    if (shape.empty()) {
+        reset(0, cols);
+        return;
+    }
+    if (shape.size() < shape_entries || shape[0] != static_cast<uint64_t>(Layout) || shape[1] != Tile)
+        throw std::runtime_error("MmappedMatrix::ctor: " + base_name + " has another layout or tile size");
+    if (shape[3] != cols)
+        throw std::runtime_error("MmappedMatrix::ctor: " + base_name + " has " + std::to_string(shape[3]) + " columns, not " + std::to_string(cols));
+    // Without a clean close, both files are at their capacity: the shape file ends in entries that were
+    // never written, and the data in elements past the shape
+    shape.resize(shape_entries);
+    row_count = shape[2];
+    col_count = shape[3];
+    row_stride = shape[4];
+    if (data.size() < storage_size())
+        throw std::runtime_error("MmappedMatrix::ctor: " + base_name + ": data shorter than the shape says. The file is probably corrupted.");
+    // A row appended to the data whose row count never got written
+    data.resize(storage_size());
+}
+
+template <typename T, MatrixLayout Layout, template <typename> class AllocatorType, size_t Tile>
+size_t MmappedMatrix<T, Layout, AllocatorType, Tile>::storage_size() const {
+    if constexpr(Layout == MatrixLayout::row_major)
+        return row_count * col_count;
+    else if constexpr(Layout == MatrixLayout::column_major)
+        return row_stride * col_count;
+    else
+        return (row_count + Tile - 1) / Tile * tile_columns() * Tile * Tile;
+}
+
+template <typename T, MatrixLayout Layout, template <typename> class AllocatorType, size_t Tile> inline
+size_t MmappedMatrix<T, Layout, AllocatorType, Tile>::index(size_t row, size_t col) const {
+    if constexpr(Layout == MatrixLayout::row_major)
+        return row * col_count + col;
+    else if constexpr(Layout == MatrixLayout::column_major)
+        return col * row_stride + row;
+    else
+        return tile_begin(row / Tile, col / Tile) + row % Tile * Tile + col % Tile;
+}
+
+template <typename T, MatrixLayout Layout, template <typename> class AllocatorType, size_t Tile>
+T& MmappedMatrix<T, Layout, AllocatorType, Tile>::at(size_t row, size_t col) {
+    if (row >= row_count || col >= col_count)
+        throw std::out_of_range("MmappedMatrix::at: index out of range");
+    return (*this)(row, col);
+}
+
+template <typename T, MatrixLayout Layout, template <typename> class AllocatorType, size_t Tile>
+const T& MmappedMatrix<T, Layout, AllocatorType, Tile>::at(size_t row, size_t col) const {
+    if (row >= row_count || col >= col_count)
+        throw std::out_of_range("MmappedMatrix::at: index out of range");
+    return (*this)(row, col);
+}
+
+template <typename T, MatrixLayout Layout, template <typename> class AllocatorType, size_t Tile>
+void MmappedMatrix<T, Layout, AllocatorType, Tile>::grow_data(size_t size) {
+    size_t old_size = data.size();
+    if (size > data.capacity())
+        data.reserve(std::max(size, 2 * data.capacity()));
+    data.resize(size);
+    std::fill(data.data() + old_size, data.data() + size, T());
+}
+
+template <typename T, MatrixLayout Layout, template <typename> class AllocatorType, size_t Tile>
+void MmappedMatrix<T, Layout, AllocatorType, Tile>::store_shape() {
+    shape.resize(shape_entries);
+    shape[0] = static_cast<uint64_t>(Layout);
+    shape[1] = Tile;
+    shape[2] = row_count;
+    shape[3] = col_count;
+    shape[4] = row_stride;
+}
+
+template <typename T, MatrixLayout Layout, template <typename> class AllocatorType, size_t Tile>
+void MmappedMatrix<T, Layout, AllocatorType, Tile>::reset(size_t rows, size_t cols) {
+    row_count = rows;
+    col_count = cols;
+    row_stride = Layout == MatrixLayout::column_major ? rows : 0;
+    data.clear();
+    grow_data(storage_size());
+    store_shape();
+}
+
+template <typename T, MatrixLayout Layout, template <typename> class AllocatorType, size_t Tile>
+void MmappedMatrix<T, Layout, AllocatorType, Tile>::reserve_rows(size_t rows) {
+    if constexpr(Layout == MatrixLayout::row_major) {
+        data.reserve(rows * col_count);
+    } else if constexpr(Layout == MatrixLayout::column_major) {
+        if (rows <= row_stride)
+            return;
+        size_t old_stride = row_stride;
+        data.resize(rows * col_count);
+        // Last column first, as every column moves to a higher address than it was
+        for (size_t col = col_count; col-- > 1;) {
+            std::memmove(data.data() + col * rows, data.data() + col * old_stride, row_count * sizeof(T));
+            std::fill(data.data() + col * rows + row_count, data.data() + (col + 1) * rows, T());
+        }
+        if (col_count > 0)
+            std::fill(data.data() + row_count, data.data() + rows, T());
+        row_stride = rows;
+        store_shape();
+    } else {
+        data.reserve((rows + Tile - 1) / Tile * tile_columns() * Tile * Tile);
+    }
+}
+
+template <typename T, MatrixLayout Layout, template <typename> class AllocatorType, size_t Tile>
+void MmappedMatrix<T, Layout, AllocatorType, Tile>::append_row(const T* values) {
+    if constexpr(Layout == MatrixLayout::row_major) {
+        data.append_range(values, col_count);
+    } else if constexpr(Layout == MatrixLayout::column_major) {
+        if (row_count == row_stride)
+            reserve_rows(std::max<size_t>(2 * row_stride, 16));
+        for (size_t col = 0; col < col_count; col++)
+            data[col * row_stride + row_count] = values[col];
+    } else {
+        if (row_count % Tile == 0)
+            grow_data(data.size() + tile_columns() * Tile * Tile);
+        for (size_t col = 0; col < col_count; col++)
+            data[index(row_count, col)] = values[col];
+    }
+    row_count++;
+    shape[2] = row_count;
+}
+
+template <typename T, MatrixLayout Layout, template <typename> class AllocatorType, size_t Tile>
+template <std::ranges::contiguous_range R>
+void MmappedMatrix<T, Layout, AllocatorType, Tile>::append_row(R&& values) {
+    if (std::ranges::size(values) != col_count)
+        throw std::invalid_argument("MmappedMatrix::append_row: the row has " + std::to_string(std::ranges::size(values)) + " values, not " + std::to_string(col_count));
+    append_row(std::ranges::data(values));
+}
+
+template <typename T, MatrixLayout Layout, template <typename> class AllocatorType, size_t Tile>
+template <typename F>
+void MmappedMatrix<T, Layout, AllocatorType, Tile>::for_each_tile(F&& f) const {
+    size_t tile_rows = (row_count + Tile - 1) / Tile;
+    auto call = [&](size_t tile_row, size_t tile_col) {
+        f(tile_row * Tile, std::min((tile_row + 1) * Tile, row_count), tile_col * Tile, std::min((tile_col + 1) * Tile, col_count));
+    };
+    if constexpr(Layout == MatrixLayout::column_major) {
+        for (size_t tile_col = 0; tile_col < tile_columns(); tile_col++)
+            for (size_t tile_row = 0; tile_row < tile_rows; tile_row++)
+                call(tile_row, tile_col);
+    } else {
+        for (size_t tile_row = 0; tile_row < tile_rows; tile_row++)
+            for (size_t tile_col = 0; tile_col < tile_columns(); tile_col++)
+                call(tile_row, tile_col);
+    }
+}
+
+template <typename T, MatrixLayout Layout, template <typename> class AllocatorType, size_t Tile>
+template <MatrixLayout OutLayout, template <typename> class OutAllocator>
+void MmappedMatrix<T, Layout, AllocatorType, Tile>::copy_into(MmappedMatrix<T, OutLayout, OutAllocator, Tile>& out, size_t thread_count) const {
+    out.reset(row_count, col_count);
+    parallel_for((row_count + Tile - 1) / Tile, [&](size_t begin, size_t end) {
+        for (size_t row_begin = begin * Tile; row_begin < std::min(end * Tile, row_count); row_begin += Tile)
+            for (size_t col_begin = 0; col_begin < col_count; col_begin += Tile)
+                for (size_t row = row_begin; row < std::min(row_begin + Tile, row_count); row++)
+                    for (size_t col = col_begin; col < std::min(col_begin + Tile, col_count); col++)
+                        out(row, col) = (*this)(row, col);
+    }, thread_count, 1);
+}
+
+template <typename T, MatrixLayout Layout, template <typename> class AllocatorType, size_t Tile>
+template <MatrixLayout OutLayout, template <typename> class OutAllocator>
+void MmappedMatrix<T, Layout, AllocatorType, Tile>::transpose_into(MmappedMatrix<T, OutLayout, OutAllocator, Tile>& out, size_t thread_count) const {
+    out.reset(col_count, row_count);
+    parallel_for((row_count + Tile - 1) / Tile, [&](size_t begin, size_t end) {
+        for (size_t row_begin = begin * Tile; row_begin < std::min(end * Tile, row_count); row_begin += Tile)
+            for (size_t col_begin = 0; col_begin < col_count; col_begin += Tile)
+                for (size_t row = row_begin; row < std::min(row_begin + Tile, row_count); row++)
+                    for (size_t col = col_begin; col < std::min(col_begin + Tile, col_count); col++)
+                        out(col, row) = (*this)(row, col);
+    }, thread_count, 1);
+}
+
+// Data first, so the shape on disk never covers rows that aren't there
+template <typename T, MatrixLayout Layout, template <typename> class AllocatorType, size_t Tile>
+void MmappedMatrix<T, Layout, AllocatorType, Tile>::flush() {
+    data.flush();
+    shape.flush();
+}
+
+} // namespace mmapped_vector
+
+#endif // MMAPPED_VECTOR_MATRIX_H
@@ -1,3 +1,6 @@
+#ifndef MMAPPED_VECTOR_H
+#define MMAPPED_VECTOR_H
+
 #include <sys/mman.h>
 #include <string>
 #include <stdexcept>
@@ -8,12 +11,22 @@
 #include <mutex>
 #include <atomic>
 #include <algorithm>
+#include <condition_variable>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <iterator>
+#include <optional>
+#include <ranges>
+#include <thread>
+#include <variant>
+#include <vector>
 
 
 #include "allocators.h"
+#include "snapshot.h"
 
 
-#define USE_INELEGANT_IMPLEMENTATION 0
 #define MEMORY_ORDER std::memory_order_seq_cst
 //#define MEMORY_ORDER std::memory_order_relaxed
 //#define MEMORY_ORDER std::memory_order_acq_rel
@@ -41,6 +54,26 @@ namespace mmapped_vector {
 template <typename T, typename AllocatorType>
 class IndexHolder;
 
+template <typename T, typename AllocatorType>
+class ConcurrentView;
+
+// In parallel.h, which the parallel_generate() and parallel_append() members need
+class ThreadPool;
+inline size_t default_thread_count();
+template <typename Vector>
+struct ParallelWrites;
+
+// Group commit state of a thread-safe vector: threads waiting in wait_durable() elect one of them to
+// flush on behalf of everyone who arrived before the flush started.
+struct DurabilityTracker {
+    std::mutex mutex;
+    std::condition_variable flushed;
+    size_t flushes_started = 0;
+    size_t flushes_completed = 0;
+    bool flush_in_progress = false;
+    size_t lowest_waiting_index = std::numeric_limits<size_t>::max();
+};
+
 template <typename T, typename AllocatorType, bool thread_safe = false>
 class MmappedVector {
     static_assert(std::is_trivially_copyable<T>::value, "T must be trivially copyable for safe memory movement");
@@ -49,10 +82,39 @@ class MmappedVector {
 private:
     AllocatorType allocator;
     std::conditional_t<thread_safe, std::atomic<size_t>, size_t> element_count;
-    std::conditional_t<thread_safe, std::atomic<size_t>, std::monostate> capacity_atomic;
+    // A fixed capacity never changes, so there's nothing for concurrent pushes to coordinate
+    std::conditional_t<thread_safe && AllocatorType::fixed_capacity == 0, std::atomic<size_t>, std::monostate> capacity_atomic;
+    // Thread-safe mode: the number of threads between enter() and exit(), plus exclusive_flag while
+    // a thread runs exclusive()
     std::conditional_t<thread_safe, std::atomic<size_t>, std::monostate> operations_in_progress;
-    std::conditional_t<thread_safe, std::atomic<size_t>, std::monostate> needed_capacity;
+    // Thread-safe mode: pushes that took an index past the capacity, and left to grow the vector
+    // before writing it
+    std::conditional_t<thread_safe && AllocatorType::fixed_capacity == 0, std::atomic<size_t>, std::monostate> growth_waiters;
+    // Thread-safe mode: counts the clear()s and resize()s, which give element indices new meaning
+    std::conditional_t<thread_safe, size_t, std::monostate> epoch;
     std::conditional_t<thread_safe, std::mutex, std::monostate> mutex;
+    std::conditional_t<thread_safe, DurabilityTracker, std::monostate> durability;
+    // Trailing bytes of an element that append_from_fd() has read only partially; allocated on the
+    // first partial read, so vectors that don't read from fds don't carry an extra element
+    std::unique_ptr<unsigned char[]> partial_element;
+    size_t partial_bytes = 0;
+    SnapshotRegistry<T> snapshots;
+
+    // Usable capacity of the allocator, after the tail padding
+    size_t usable_capacity() const;
+    // With a fixed capacity, throws if index is past it; in debug builds only (without NDEBUG)
+    void check_fixed_capacity(size_t index) const;
+
+    // Thread-safe mode. Element stores run between enter() and exit(), and operations that move the
+    // storage or change the element count run in exclusive(), which keeps new threads from entering
+    // and waits for those inside to leave. A thread must exit() before it calls exclusive().
+    static constexpr size_t exclusive_flag = size_t(1) << (sizeof(size_t) * 8 - 1);
+    void enter();
+    void exit();
+    template <typename F>
+    void exclusive(F&& operation);
+    // Grows the storage to at least `count` elements, and to every index handed out so far
+    void grow_to(size_t count);
 
 public:
     // Data type
@@ -65,11 +127,23 @@ public:
     using pointer = T*;
     using const_pointer = const T*;
 
+    // Alignment of data(), and number of elements kept allocated past capacity(). Loads of up to
+    // simd_padding_bytes that start at any element are in bounds, so vectorised loops may process
+    // the tail in full-width steps.
+    static constexpr size_t alignment = AllocatorType::alignment;
+    static constexpr size_t padding = (simd_padding_bytes + sizeof(T) - 1) / sizeof(T);
+    // Capacity of an allocator that never grows (e.g. FixedCapacityAllocator), 0 otherwise
+    static constexpr size_t fixed_capacity = AllocatorType::fixed_capacity;
 
     // Default constructor: Creates an empty vector with initial capacity
     template <typename... Args>
     MmappedVector(Args&&... args);
 
+    // Creates a vector that takes over existing storage; the arguments go to the allocator's
+    // adopting constructor, e.g. MallocVector<T>::adopt(ptr, size, capacity)
+    template <typename... Args>
+    static MmappedVector adopt(Args&&... args);
+
     // Destructor: Cleans up resources
     ~MmappedVector();
 
@@ -86,11 +160,43 @@ public:
     // Adds an element to the end of the vector
     void push_back(const T& value);
 
+    // Adds an element to the end of the vector and returns its index
+    size_t append(const T& value);
+
     // Constructs an element in-place at the end of the vector
     template<typename... Args>
     void emplace_back(Args&&... args);
 
-    // Removes the last element from the vector
+    // Appends count elements copied from first, which must not point into this vector
+    void append_range(const T* first, size_t count);
+    template <std::ranges::contiguous_range R>
+    void append_range(R&& range) { append_range(std::ranges::data(range), std::ranges::size(range)); };
+
+    // Reads up to max_bytes from fd directly into the vector's tail, without an intermediate buffer.
+    // Bytes of a trailing partial element are held back and completed by the next call.
+    // Returns the number of bytes read; 0 means end of file (or no data on a non-blocking fd).
+    size_t append_from_fd(int fd, size_t max_bytes);
+
+    // Grows the vector by n elements and returns a pointer to the first of them, for the caller to
+    // write. The storage grows once, and the new elements' pages aren't touched, so bulk writers
+    // (parallel_append() in parallel.h) decide which thread faults each of them in.
+    T* append_uninitialized(size_t n);
+
+    // vec.parallel_generate(n, f) is parallel_generate(vec, n, f) and vec.parallel_append(n, f) is
+    // parallel_append(vec, n, f), from parallel.h, which must be included to call them: n elements,
+    // element i being f(i), written by one thread per page-aligned chunk, in the order a sequential
+    // loop would leave them. If f throws, the new elements are dropped.
+    template <typename F>
+    void parallel_generate(size_t n, F&& f, size_t thread_count = default_thread_count()) { ParallelWrites<MmappedVector>::generate(*this, n, std::forward<F>(f), thread_count); };
+    template <typename F>
+    void parallel_generate(size_t n, F&& f, ThreadPool& pool) { ParallelWrites<MmappedVector>::generate(*this, n, std::forward<F>(f), pool); };
+    template <typename F>
+    void parallel_append(size_t n, F&& f, size_t thread_count = default_thread_count()) { ParallelWrites<MmappedVector>::append(*this, n, std::forward<F>(f), thread_count); };
+    template <typename F>
+    void parallel_append(size_t n, F&& f, ThreadPool& pool) { ParallelWrites<MmappedVector>::append(*this, n, std::forward<F>(f), pool); };
+
+    // Removes the last element from the vector. Not thread-safe, even in thread-safe mode; a stack
+    // popped by many threads at once is ConcurrentStack, in concurrent_stack.h
     void pop_back();
 
     // Access element at specified index (no bounds checking)
@@ -126,6 +232,22 @@ public:
     // Reduces memory usage by freeing unused memory
     void shrink_to_fit();
 
+    // Writes the elements back to the backing storage (if any) and waits until they're durable
+    void flush();
+
+    // Waits until element `index`, already written by the calling thread, is durable. In thread-safe
+    // mode concurrent callers share flushes: one of them writes back everything the others wait for.
+    void wait_durable(size_t index);
+
+    const AllocatorType& get_allocator() const;
+    // For the allocator's own settings (e.g. MmapFileAllocator::keep_file_size()); the storage must
+    // not be changed through it
+    AllocatorType& get_allocator();
+
+    // Hands the storage over to the caller, without copying. The vector is left empty and without
+    // storage: it can only be destroyed or assigned to afterwards.
+    ReleasedBuffer<T> release();
+
     // Returns pointer to the underlying array
     T* data();
     const T* data() const;
@@ -148,7 +270,23 @@ public:
 
     void store_at_index(const T& value, size_t index);
 
+    // Returns a read-only view of the current elements that later appends and update()s don't change.
+    // See snapshot.h for what it costs with each allocator. In thread-safe mode, it waits for the
+    // pushes in progress, as concurrent_view() does, so every element it covers is written.
+    Snapshot<T> snapshot();
+
+    // Overwrites an element without changing what existing snapshots see
+    void update(size_t index, const T& value);
+
+    // Thread-safe mode: a range over the elements whose pushes had finished when it was made, which
+    // other threads may go on pushing to (and growing the vector) while it's read. It copies
+    // `chunk_size` elements at a time, keeping the storage in place only while it copies; see
+    // ConcurrentView. Not for fixed-capacity vectors, whose pushes can't be waited for.
+    ConcurrentView<T, AllocatorType> concurrent_view(size_t chunk_size = 4096)
+        requires(thread_safe && fixed_capacity == 0);
+
     friend class IndexHolder<T, AllocatorType>;
+    friend class ConcurrentView<T, AllocatorType>;
 private:
 };
 
@@ -158,21 +296,28 @@ template <typename T, typename AllocatorType, bool thread_safe>
 template <typename... Args>
 MmappedVector<T, AllocatorType, thread_safe>::MmappedVector(Args&&... args)
     : allocator(std::forward<Args>(args)...), element_count(allocator.get_backing_size()) {
+        if (allocator.get_capacity() < element_count + padding)
+            allocator.resize(element_count + padding);
         if constexpr(thread_safe) {
-            capacity_atomic.store(allocator.get_capacity(), MEMORY_ORDER);
-            needed_capacity.store(allocator.get_capacity(), MEMORY_ORDER);
+            if constexpr(fixed_capacity == 0) {
+                capacity_atomic.store(usable_capacity(), MEMORY_ORDER);
+                growth_waiters.store(0, MEMORY_ORDER);
+            }
             operations_in_progress.store(0, MEMORY_ORDER);
+            epoch = 0;
         }
     };
 
 
 template <typename T, typename AllocatorType, bool thread_safe>
 MmappedVector<T, AllocatorType, thread_safe>::MmappedVector(MmappedVector&& other) noexcept
-    : allocator(std::move(other.allocator)), element_count(other.element_count) {
+    : allocator(std::move(other.allocator)), element_count(other.element_count), partial_element(std::move(other.partial_element)),
+      partial_bytes(other.partial_bytes), snapshots(std::move(other.snapshots)) {
     if constexpr(thread_safe) {
         throw std::runtime_error("Not implemented");
     }
     other.element_count = 0;
+    other.partial_bytes = 0;
 };
 
 template <typename T, typename AllocatorType, bool thread_safe>
@@ -183,14 +328,26 @@ MmappedVector<T, AllocatorType, thread_safe>& MmappedVector<T, AllocatorType, th
     if (this != &other) {
         allocator = std::move(other.allocator);
         element_count = other.element_count;
+        partial_element = std::move(other.partial_element);
+        partial_bytes = other.partial_bytes;
+        snapshots = std::move(other.snapshots);
 
         other.element_count = 0;
+        other.partial_bytes = 0;
     }
     return *this;
 };
 
 template <typename T, typename AllocatorType, bool thread_safe>
-MmappedVector<T, AllocatorType, thread_safe>::~MmappedVector() { allocator.sync(this->element_count); };
+MmappedVector<T, AllocatorType, thread_safe>::~MmappedVector() {
+    // Closing cuts the file to the elements in use, under snapshots taken before a clear() or pop_back()
+    try {
+        snapshots.detach_beyond(allocator.get_fd_offset() + element_count * sizeof(T));
+    } catch (const std::exception& e) {
+        std::cerr << "MmappedVector::dtor: " << e.what() << std::endl;
+    }
+    allocator.sync(this->element_count);
+};
 
 template <typename T, typename AllocatorType, bool thread_safe> inline
 const T& MmappedVector<T, AllocatorType, thread_safe>::operator[](size_t index) const {
@@ -203,53 +360,142 @@ T& MmappedVector<T, AllocatorType, thread_safe>::operator[](size_t index) {
 };
 
 
-#if USE_INELEGANT_IMPLEMENTATION
+
 template <typename T, typename AllocatorType, bool thread_safe>
-void MmappedVector<T, AllocatorType, thread_safe>::store_at_index(const T& value, size_t index) {
+inline void MmappedVector<T, AllocatorType, thread_safe>::store_at_index(const T& value, size_t index) {
     if constexpr(!thread_safe) {
         throw std::runtime_error("This function should only be called in thread-safe mode");
-    }
-    operations_in_progress.fetch_add(1, MEMORY_ORDER);
-    size_t current_capacity = capacity_atomic.load(MEMORY_ORDER);
-    if (index < current_capacity) {
+    } else if constexpr(fixed_capacity > 0) {
+        check_fixed_capacity(index);
         allocator.ptr[index] = value;
-        operations_in_progress.fetch_sub(1, MEMORY_ORDER);
     } else {
-        size_t active_workers = operations_in_progress.fetch_sub(1, MEMORY_ORDER);
-        if (active_workers > 1) {
-            atomic_store_max<MEMORY_ORDER>(needed_capacity, index + 1);
-            while (capacity_atomic.load(MEMORY_ORDER) <= index) {};
-        } else {
-            std::lock_guard<std::mutex> lock(mutex);
-            allocator.increase_capacity(std::max(needed_capacity.load(MEMORY_ORDER), index + 1));
-            capacity_atomic.store(allocator.get_capacity(), MEMORY_ORDER);
-            store_at_index(value, index);
-        }
+        IndexHolder<T, AllocatorType> holder(*this, index);
+        allocator.ptr[index] = value;
     }
 };
 
-#else
+template <typename T, typename AllocatorType, bool thread_safe> inline
+void MmappedVector<T, AllocatorType, thread_safe>::enter() {
+    while (operations_in_progress.fetch_add(1, MEMORY_ORDER) & exclusive_flag) {
+        operations_in_progress.fetch_sub(1, MEMORY_ORDER);
+        while (operations_in_progress.load(MEMORY_ORDER) & exclusive_flag)
+            std::this_thread::yield();
+    }
+};
+
+template <typename T, typename AllocatorType, bool thread_safe> inline
+void MmappedVector<T, AllocatorType, thread_safe>::exit() {
+    operations_in_progress.fetch_sub(1, MEMORY_ORDER);
+};
 
 template <typename T, typename AllocatorType, bool thread_safe>
-inline void MmappedVector<T, AllocatorType, thread_safe>::store_at_index(const T& value, size_t index) {
-    if constexpr(!thread_safe) {
-        throw std::runtime_error("This function should only be called in thread-safe mode");
+template <typename F>
+void MmappedVector<T, AllocatorType, thread_safe>::exclusive(F&& operation) {
+    std::lock_guard<std::mutex> lock(mutex);
+    operations_in_progress.fetch_or(exclusive_flag, MEMORY_ORDER);
+    while ((operations_in_progress.load(MEMORY_ORDER) & ~exclusive_flag) != 0)
+        std::this_thread::yield();
+    try {
+        operation();
+    } catch (...) {
+        operations_in_progress.fetch_and(~exclusive_flag, MEMORY_ORDER);
+        throw;
     }
-    IndexHolder<T, AllocatorType> holder(*this, index);
-    allocator.ptr[index] = value;
+    operations_in_progress.fetch_and(~exclusive_flag, MEMORY_ORDER);
 };
 
-#endif
+template <typename T, typename AllocatorType, bool thread_safe>
+void MmappedVector<T, AllocatorType, thread_safe>::grow_to(size_t count) {
+    exclusive([&]() {
+        if (capacity_atomic.load(MEMORY_ORDER) >= count)
+            return;
+        allocator.increase_capacity(std::max(count, element_count.load(MEMORY_ORDER)) + padding);
+        capacity_atomic.store(usable_capacity(), MEMORY_ORDER);
+    });
+};
+
+template <typename T, typename AllocatorType, bool thread_safe>
+Snapshot<T> MmappedVector<T, AllocatorType, thread_safe>::snapshot() {
+    if constexpr(thread_safe && fixed_capacity == 0) {
+        // Taken when no push is waiting to grow the vector with an index it hasn't written yet
+        std::optional<Snapshot<T>> taken;
+        while (!taken) {
+            exclusive([&]() {
+                if (growth_waiters.load(MEMORY_ORDER) == 0)
+                    taken.emplace(snapshots.create(allocator.ptr, element_count.load(MEMORY_ORDER), allocator.get_fd(), allocator.get_fd_offset()));
+            });
+            if (!taken)
+                std::this_thread::yield();
+        }
+        return std::move(*taken);
+    } else {
+        return snapshots.create(allocator.ptr, element_count, allocator.get_fd(), allocator.get_fd_offset());
+    }
+};
+
+template <typename T, typename AllocatorType, bool thread_safe>
+ConcurrentView<T, AllocatorType> MmappedVector<T, AllocatorType, thread_safe>::concurrent_view(size_t chunk_size)
+    requires(thread_safe && fixed_capacity == 0) {
+    return ConcurrentView<T, AllocatorType>(*this, chunk_size);
+};
+
+template <typename T, typename AllocatorType, bool thread_safe> inline
+void MmappedVector<T, AllocatorType, thread_safe>::update(size_t index, const T& value) {
+    if constexpr(thread_safe && fixed_capacity == 0) {
+        // Keeps the storage from moving between the preserving and the write
+        IndexHolder<T, AllocatorType> holder(*this, index);
+        snapshots.preserve(index, allocator.ptr);
+        allocator.ptr[index] = value;
+    } else {
+        snapshots.preserve(index, allocator.ptr);
+        allocator.ptr[index] = value;
+    }
+};
 
 template <typename T, typename AllocatorType, bool thread_safe> inline
 void MmappedVector<T, AllocatorType, thread_safe>::push_back(const T& value) {
     if constexpr(thread_safe) {
+        append(value);
+    } else if constexpr(fixed_capacity > 0) {
+        check_fixed_capacity(element_count);
+        allocator.ptr[element_count++] = value;
+    } else {
+        if (element_count + padding >= allocator.get_capacity())
+            allocator.increase_capacity(element_count + 1 + padding);
+        allocator.ptr[element_count++] = value;
+    }
+};
+
+
+template <typename T, typename AllocatorType, bool thread_safe> inline
+size_t MmappedVector<T, AllocatorType, thread_safe>::append(const T& value) {
+    if constexpr(thread_safe && fixed_capacity > 0) {
         size_t index = element_count.fetch_add(1, MEMORY_ORDER);
         store_at_index(value, index);
+        return index;
+    } else if constexpr(thread_safe) {
+        // The index is taken inside, so a clear() either sees it taken or hands it out again
+        enter();
+        size_t index_epoch = epoch;
+        size_t index = element_count.fetch_add(1, MEMORY_ORDER);
+        while (index >= capacity_atomic.load(MEMORY_ORDER_ACQ)) {
+            growth_waiters.fetch_add(1, MEMORY_ORDER);
+            exit();
+            grow_to(index + 1);
+            enter();
+            growth_waiters.fetch_sub(1, MEMORY_ORDER);
+            // A clear() or resize() came in between: the element went with the others before it
+            if (epoch != index_epoch) {
+                exit();
+                return index;
+            }
+        }
+        allocator.ptr[index] = value;
+        exit();
+        return index;
     } else {
-        if (element_count >= allocator.get_capacity())
-            allocator.increase_capacity(element_count + 1);
-        allocator.ptr[element_count++] = value;
+        push_back(value);
+        return element_count - 1;
     }
 };
 
@@ -268,7 +514,21 @@ size_t MmappedVector<T, AllocatorType, thread_safe>::size() const {
 
 template <typename T, typename AllocatorType, bool thread_safe> inline
 size_t MmappedVector<T, AllocatorType, thread_safe>::capacity() const {
-    return allocator.get_capacity();
+    return usable_capacity();
+};
+
+template <typename T, typename AllocatorType, bool thread_safe> inline
+size_t MmappedVector<T, AllocatorType, thread_safe>::usable_capacity() const {
+    size_t allocated = allocator.get_capacity();
+    return allocated > padding ? allocated - padding : 0;
+};
+
+template <typename T, typename AllocatorType, bool thread_safe> inline
+void MmappedVector<T, AllocatorType, thread_safe>::check_fixed_capacity([[maybe_unused]] size_t index) const {
+#ifndef NDEBUG
+    if (index >= fixed_capacity)
+        throw std::length_error("MmappedVector: fixed capacity of " + std::to_string(fixed_capacity) + " elements exceeded");
+#endif
 };
 
 template <typename T, typename AllocatorType, bool thread_safe> inline
@@ -297,26 +557,135 @@ const T& MmappedVector<T, AllocatorType, thread_safe>::back() const {
 };
 
 // TODO shrink if needed
+// In thread-safe mode, clear(), resize(), reserve() and shrink_to_fit() wait for the pushes in
+// progress, and keep new ones waiting until they're done. Pushes that took their index before a
+// clear() or resize() are dropped with the elements they removed. With a fixed capacity, pushes
+// don't take part in this, so these must not run concurrently with them.
 template <typename T, typename AllocatorType, bool thread_safe> inline
 void MmappedVector<T, AllocatorType, thread_safe>::clear() {
-    element_count = 0;
+    if constexpr(thread_safe && fixed_capacity == 0) {
+        exclusive([&]() {
+            element_count = 0;
+            epoch++;
+        });
+    } else {
+        element_count = 0;
+        // A partially read element belongs to the old contents
+        partial_bytes = 0;
+    }
 };
 
-// TODO probably needs to be deleted
 template <typename T, typename AllocatorType, bool thread_safe> inline
 void MmappedVector<T, AllocatorType, thread_safe>::resize(size_t new_size) {
-    allocator.resize(new_size);
-    element_count = new_size;
+    if constexpr(thread_safe && fixed_capacity == 0) {
+        exclusive([&]() {
+            snapshots.detach_beyond(allocator.get_fd_offset() + (new_size + padding) * sizeof(T));
+            allocator.resize(new_size + padding);
+            element_count = new_size;
+            capacity_atomic.store(usable_capacity(), MEMORY_ORDER);
+            epoch++;
+        });
+    } else {
+        snapshots.detach_beyond(allocator.get_fd_offset() + (new_size + padding) * sizeof(T));
+        allocator.resize(new_size + padding);
+        element_count = new_size;
+        partial_bytes = 0;
+    }
 };
 
 template <typename T, typename AllocatorType, bool thread_safe> inline
 void MmappedVector<T, AllocatorType, thread_safe>::reserve(size_t new_capacity) {
-    allocator.increase_capacity(new_capacity);
+    if constexpr(thread_safe && fixed_capacity == 0) {
+        exclusive([&]() {
+            allocator.increase_capacity(new_capacity + padding);
+            capacity_atomic.store(usable_capacity(), MEMORY_ORDER);
+        });
+    } else {
+        allocator.increase_capacity(new_capacity + padding);
+    }
 };
 
+// The indices handed out to pushes still in progress stay within the capacity
 template <typename T, typename AllocatorType, bool thread_safe> inline
 void MmappedVector<T, AllocatorType, thread_safe>::shrink_to_fit() {
-    allocator.resize(element_count);
+    if constexpr(thread_safe && fixed_capacity == 0) {
+        exclusive([&]() {
+            snapshots.detach_beyond(allocator.get_fd_offset() + (element_count + padding) * sizeof(T));
+            allocator.resize(element_count + padding);
+            capacity_atomic.store(usable_capacity(), MEMORY_ORDER);
+        });
+    } else {
+        snapshots.detach_beyond(allocator.get_fd_offset() + (element_count + padding) * sizeof(T));
+        allocator.resize(element_count + padding);
+    }
+};
+
+template <typename T, typename AllocatorType, bool thread_safe> inline
+void MmappedVector<T, AllocatorType, thread_safe>::flush() {
+    allocator.flush(element_count);
+};
+
+template <typename T, typename AllocatorType, bool thread_safe>
+void MmappedVector<T, AllocatorType, thread_safe>::wait_durable(size_t index) {
+    if constexpr(!thread_safe) {
+        allocator.flush_range(index, index + 1);
+    } else {
+        std::unique_lock<std::mutex> lock(durability.mutex);
+        // Only a flush that starts after this call is guaranteed to see our write
+        size_t generation_needed = durability.flushes_started + 1;
+        durability.lowest_waiting_index = std::min(durability.lowest_waiting_index, index);
+        while (durability.flushes_completed < generation_needed) {
+            if (durability.flush_in_progress) {
+                durability.flushed.wait(lock);
+                continue;
+            }
+            durability.flush_in_progress = true;
+            size_t generation = ++durability.flushes_started;
+            size_t begin = durability.lowest_waiting_index;
+            durability.lowest_waiting_index = std::numeric_limits<size_t>::max();
+            lock.unlock();
+            try {
+                // Holding the growth mutex keeps the mapping from moving under msync()
+                std::lock_guard<std::mutex> growth_lock(mutex);
+                allocator.flush_range(begin, std::min(element_count.load(MEMORY_ORDER), allocator.get_capacity()));
+            } catch (...) {
+                lock.lock();
+                durability.lowest_waiting_index = std::min(durability.lowest_waiting_index, begin);
+                durability.flush_in_progress = false;
+                durability.flushed.notify_all();
+                throw;
+            }
+            lock.lock();
+            durability.flushes_completed = generation;
+            durability.flush_in_progress = false;
+            durability.flushed.notify_all();
+        }
+    }
+};
+
+template <typename T, typename AllocatorType, bool thread_safe> inline
+const AllocatorType& MmappedVector<T, AllocatorType, thread_safe>::get_allocator() const {
+    return allocator;
+};
+
+template <typename T, typename AllocatorType, bool thread_safe> inline
+AllocatorType& MmappedVector<T, AllocatorType, thread_safe>::get_allocator() {
+    return allocator;
+};
+
+template <typename T, typename AllocatorType, bool thread_safe>
+template <typename... Args>
+MmappedVector<T, AllocatorType, thread_safe> MmappedVector<T, AllocatorType, thread_safe>::adopt(Args&&... args) {
+    return MmappedVector(adopt_tag, std::forward<Args>(args)...);
+};
+
+template <typename T, typename AllocatorType, bool thread_safe>
+ReleasedBuffer<T> MmappedVector<T, AllocatorType, thread_safe>::release() {
+    ReleasedBuffer<T> buffer = allocator.release();
+    buffer.size = element_count;
+    element_count = 0;
+    partial_bytes = 0;
+    return buffer;
 };
 
 template <typename T, typename AllocatorType, bool thread_safe> inline
@@ -395,16 +764,64 @@ void MmappedVector<T, AllocatorType, thread_safe>::emplace_back(Args&&... args)
     if constexpr(thread_safe) {
         throw std::runtime_error("Not implemented");
     } else {
-        if (element_count >= allocator.get_capacity())
-            allocator.increase_capacity(element_count + 1);
+        if (element_count + padding >= allocator.get_capacity())
+            allocator.increase_capacity(element_count + 1 + padding);
         new(&allocator.ptr[element_count++]) T(std::forward<Args>(args)...);
     }
 };
 
 
+template <typename T, typename AllocatorType, bool thread_safe>
+void MmappedVector<T, AllocatorType, thread_safe>::append_range(const T* first, size_t count) {
+    if constexpr(thread_safe) {
+        throw std::runtime_error("Not implemented");
+    } else {
+        allocator.increase_capacity(element_count + count + padding);
+        if (count > 0)
+            std::memcpy(allocator.ptr + element_count, first, count * sizeof(T));
+        element_count += count;
+    }
+};
 
-template <typename T>
-using MallocVector = MmappedVector<T, MallocAllocator<T>>;
+
+template <typename T, typename AllocatorType, bool thread_safe>
+T* MmappedVector<T, AllocatorType, thread_safe>::append_uninitialized(size_t n) {
+    if constexpr(thread_safe) {
+        throw std::runtime_error("Not implemented");
+    } else {
+        allocator.increase_capacity(element_count + n + padding);
+        T* first = allocator.ptr + element_count;
+        element_count += n;
+        return first;
+    }
+}
+
+template <typename T, typename AllocatorType, bool thread_safe>
+size_t MmappedVector<T, AllocatorType, thread_safe>::append_from_fd(int fd, size_t max_bytes) {
+    if constexpr(thread_safe) {
+        throw std::runtime_error("Not implemented");
+    } else {
+        size_t tail_offset = element_count * sizeof(T);
+        allocator.increase_capacity(element_count + (partial_bytes + max_bytes + sizeof(T) - 1) / sizeof(T) + padding);
+        char* tail = reinterpret_cast<char*>(allocator.ptr) + tail_offset;
+        if (partial_bytes > 0)
+            std::memcpy(tail, partial_element.get(), partial_bytes);
+
+        size_t bytes_read = allocator.read_from_fd(fd, tail_offset + partial_bytes, max_bytes);
+        size_t bytes_available = partial_bytes + bytes_read;
+        element_count += bytes_available / sizeof(T);
+        partial_bytes = bytes_available % sizeof(T);
+        if (partial_bytes > 0 && !partial_element)
+            partial_element = std::make_unique<unsigned char[]>(sizeof(T));
+        if (partial_bytes > 0)
+            std::memcpy(partial_element.get(), tail + bytes_available - partial_bytes, partial_bytes);
+        return bytes_read;
+    }
+};
+
+
+template <typename T, size_t Alignment = alignof(std::max_align_t)>
+using MallocVector = MmappedVector<T, MallocAllocator<T, Alignment>>;
 
 template <typename T>
 using MmapVector = MmappedVector<T, MmapAllocator<T>>;
@@ -412,37 +829,149 @@ using MmapVector = MmappedVector<T, MmapAllocator<T>>;
 template <typename T>
 using MmapFileVector = MmappedVector<T, MmapFileAllocator<T>>;
 
+template <typename T, size_t N>
+using FixedCapacityVector = MmappedVector<T, FixedCapacityAllocator<T, N>>;
+
+#ifdef __linux__
+template <typename T>
+using MemfdVector = MmappedVector<T, MmapMemfdAllocator<T>>;
+#endif
 
 
+
+// Keeps a thread-safe vector's storage in place, with room for element `index`, while it exists
 template<typename T, typename AllocatorType>
 class IndexHolder {
     MmappedVector<T, AllocatorType, true>& vec;
 public:
     inline IndexHolder(MmappedVector<T, AllocatorType, true>& vec, size_t index) : vec(vec) {
+        vec.enter();
+        while (index >= vec.capacity_atomic.load(MEMORY_ORDER_ACQ)) {
+            vec.exit();
+            vec.grow_to(index + 1);
+            vec.enter();
+        }
+    }
 
-        //vec.operations_in_progress.fetch_add(1, MEMORY_ORDER);
-        size_t current_capacity = vec.capacity_atomic.load(MEMORY_ORDER_ACQ);
-        if (index >= current_capacity)
-            slow_path(index);
+    inline ~IndexHolder() {
+        vec.exit();
     }
+};
 
-    inline void slow_path(size_t index) {
-        // size_t active_workers = vec.operations_in_progress.fetch_sub(1, MEMORY_ORDER);
-        if (false) {//(active_workers > 1) {
-            atomic_store_max<MEMORY_ORDER>(vec.needed_capacity, index + 1);
-            while (vec.capacity_atomic.load(MEMORY_ORDER_ACQ) <= index) {};
-        } else {
-            std::lock_guard<std::mutex> lock(vec.mutex);
-            vec.allocator.increase_capacity(std::max(vec.needed_capacity.load(MEMORY_ORDER), index + 1));
-            vec.capacity_atomic.store(vec.allocator.get_capacity(), MEMORY_ORDER_REL);
+/*
+ * Reads a thread-safe vector while other threads push to it. Made, it waits for the pushes in
+ * progress (as clear() does) and takes the element count, so every element it covers is written.
+ * Iterating copies a chunk of elements at a time into a buffer, between enter() and exit(), so the
+ * storage can't be moved by a push growing the vector while it copies, but pushes only wait for it
+ * while it copies a chunk, not while the elements are looked at. Nothing is held per element.
+ *
+ * If the vector is cleared or resized meanwhile, the elements it covered are gone, and iteration
+ * ends at the next chunk.
+ *
+ * The iterators are single-pass, and share the view's buffer: only the latest one may be read.
+ */
+template<typename T, typename AllocatorType>
+class ConcurrentView {
+    using Vector = MmappedVector<T, AllocatorType, true>;
+public:
+    ConcurrentView(Vector& vec, size_t chunk_size) : vec(vec), chunk_size(std::max<size_t>(chunk_size, 1)) {
+        // Pushes waiting to grow the vector have taken indices they haven't written yet, and the
+        // count is only taken when there are none (they're gone right after the growth)
+        bool taken = false;
+        while (!taken) {
+            vec.exclusive([&]() {
+                if (vec.growth_waiters.load(MEMORY_ORDER) != 0)
+                    return;
+                count = vec.element_count.load(MEMORY_ORDER);
+                epoch = vec.epoch;
+                taken = true;
+            });
+            if (!taken)
+                std::this_thread::yield();
         }
-        vec.operations_in_progress.fetch_add(1, MEMORY_ORDER);
-    }
+        buffer.reserve(std::min(count, this->chunk_size));
+    };
 
-    inline ~IndexHolder() {
-        vec.operations_in_progress.fetch_sub(1, MEMORY_ORDER);
+    // Number of elements covered
+    size_t size() const { return count; };
+    bool empty() const { return count == 0; };
+
+    class iterator {
+    public:
+        using iterator_category = std::input_iterator_tag;
+        using value_type = T;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const T*;
+        using reference = const T&;
+
+        iterator() = default;
+        iterator(ConcurrentView* view, size_t index) : view(view), index(index) {};
+
+        reference operator*() const { return view->buffer[index - view->buffer_begin]; };
+        pointer operator->() const { return &**this; };
+        iterator& operator++() {
+            if (++index == view->buffer_begin + view->buffer.size())
+                index = view->load(index);
+            return *this;
+        };
+        void operator++(int) { ++*this; };
+        // Compared to end(), which is where the view ends at the time of comparing
+        bool operator==(std::default_sentinel_t) const { return index >= view->count; };
+
+    private:
+        ConcurrentView* view = nullptr;
+        size_t index = 0;
+    };
+
+    iterator begin() { return iterator(this, load(0)); };
+    std::default_sentinel_t end() { return std::default_sentinel; };
+
+    // Calls f(elements, n) for every chunk of up to chunk_size elements, in order, with the storage
+    // held in place: no copy, but pushes that need to grow the vector wait until f returns
+    template <typename F>
+    void for_each_chunk(F&& f);
+
+private:
+    // Copies the chunk starting at `index` into the buffer; returns `index`, or count if the vector
+    // was cleared or resized since the view was made
+    size_t load(size_t index);
+
+    Vector& vec;
+    size_t chunk_size;
+    size_t count;
+    size_t epoch;
+    std::vector<T> buffer;
+    size_t buffer_begin = 0;
+};
+
+template<typename T, typename AllocatorType>
+size_t ConcurrentView<T, AllocatorType>::load(size_t index) {
+    if (index >= count)
+        return count;
+    vec.enter();
+    if (vec.epoch != epoch) {
+        vec.exit();
+        count = index;
+        return count;
     }
+    const T* first = vec.data() + index;
+    buffer.assign(first, first + std::min(chunk_size, count - index));
+    vec.exit();
+    buffer_begin = index;
+    return index;
+};
 
+template<typename T, typename AllocatorType>
+template <typename F>
+void ConcurrentView<T, AllocatorType>::for_each_chunk(F&& f) {
+    for (size_t index = 0; index < count; index += chunk_size) {
+        IndexHolder<T, AllocatorType> holder(vec, 0);
+        if (vec.epoch != epoch)
+            return;
+        f(static_cast<const T*>(vec.data() + index), std::min(chunk_size, count - index));
+    }
 };
 
-} // namespace mmapped_vector
\ No newline at end of file
+} // namespace mmapped_vector
+
+#endif // MMAPPED_VECTOR_H
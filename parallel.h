@@ -0,0 +1,273 @@
+/**
+ * @file parallel.h
+ * @brief Minimal fork-join helpers on std::thread, used by the bulk operations of the containers.
+ * @author Michał Startek
+ * @version 0.1
+ * @copyright Copyright (c) Michał Startek 2024
+ */
+
+#ifndef MMAPPED_VECTOR_PARALLEL_H
+#define MMAPPED_VECTOR_PARALLEL_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <unistd.h>
+
+
+namespace mmapped_vector {
+
+inline size_t default_thread_count() {
+    return std::max<size_t>(std::thread::hardware_concurrency(), 1);
+}
+
+// Start of chunk `chunk` when [0, count) is split into `chunks` ranges of nearly equal size
+inline size_t chunk_begin(size_t count, size_t chunks, size_t chunk) {
+    return count / chunks * chunk + std::min(chunk, count % chunks);
+}
+
+// Splits [0, count) into `chunks` contiguous ranges of nearly equal size, and calls
+// body(chunk, begin, end) for each one on its own thread; the calling thread takes chunk 0.
+// The first exception thrown by any chunk is rethrown once all of them have finished.
+template <typename F>
+void parallel_chunks(size_t count, size_t chunks, F&& body) {
+    chunks = std::max<size_t>(chunks, 1);
+    auto bounds = [&](size_t chunk) { return chunk_begin(count, chunks, chunk); };
+
+    std::exception_ptr error;
+    std::mutex error_mutex;
+    auto run = [&](size_t chunk) {
+        try {
+            body(chunk, bounds(chunk), bounds(chunk + 1));
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(error_mutex);
+            if (!error)
+                error = std::current_exception();
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (size_t chunk = 1; chunk < chunks; chunk++)
+        threads.emplace_back(run, chunk);
+    run(0);
+    for (auto& thread : threads)
+        thread.join();
+    if (error)
+        std::rethrow_exception(error);
+}
+
+// Calls body(begin, end) on ranges covering [0, count), using up to thread_count threads.
+// Ranges are never smaller than min_grain elements, so small inputs stay on the calling thread.
+template <typename F>
+void parallel_for(size_t count, F&& body, size_t thread_count = default_thread_count(), size_t min_grain = 1 << 14) {
+    size_t chunks = std::clamp<size_t>(count / std::max<size_t>(min_grain, 1), 1, std::max<size_t>(thread_count, 1));
+    parallel_chunks(count, chunks, [&](size_t, size_t begin, size_t end) { body(begin, end); });
+}
+
+/*
+ * =================================================================================================
+ */
+
+/*
+ * Worker threads kept for repeated parallel operations, so they don't pay for starting threads
+ * every time. run_chunks() works like parallel_chunks(), with the calling thread taking part;
+ * chunks go to whichever thread is free. One run at a time: it's not reentrant, and not meant to be
+ * called from several threads at once.
+ */
+class ThreadPool
+{
+public:
+    // thread_count threads in all, the caller of run_chunks() included
+    explicit ThreadPool(size_t thread_count = default_thread_count());
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+    ~ThreadPool();
+
+    size_t thread_count() const { return workers.size() + 1; };
+
+    template <typename F>
+    void run_chunks(size_t count, size_t chunks, F&& body);
+
+private:
+    // Kept alive by the workers taking part, so one that wakes up late finds it drained, never the next run
+    struct Run
+    {
+        std::function<void(size_t)> body;
+        size_t chunks;
+        std::atomic<size_t> next_chunk{0};
+        size_t finished = 0;
+        std::exception_ptr error;
+    };
+
+    void work();
+    // Runs chunks of the run until there are none left
+    void take_part(Run& run);
+
+    std::mutex mutex;
+    std::condition_variable run_posted;
+    std::condition_variable run_finished;
+    std::shared_ptr<Run> current;
+    uint64_t generation = 0;
+    bool stopping = false;
+    std::vector<std::thread> workers;
+};
+
+inline ThreadPool::ThreadPool(size_t thread_count) {
+    for (size_t i = 1; i < thread_count; i++)
+        workers.emplace_back(&ThreadPool::work, this);
+}
+
+inline ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    run_posted.notify_all();
+    for (auto& worker : workers)
+        worker.join();
+}
+
+inline void ThreadPool::work() {
+    uint64_t seen = 0;
+    while (true) {
+        std::shared_ptr<Run> run;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            run_posted.wait(lock, [&]() { return stopping || generation != seen; });
+            if (stopping)
+                return;
+            seen = generation;
+            run = current;
+        }
+        // Null if the run was over before this worker woke up
+        if (run)
+            take_part(*run);
+    }
+}
+
+inline void ThreadPool::take_part(Run& run) {
+    for (size_t chunk = run.next_chunk.fetch_add(1); chunk < run.chunks; chunk = run.next_chunk.fetch_add(1)) {
+        std::exception_ptr error;
+        try {
+            run.body(chunk);
+        } catch (...) {
+            error = std::current_exception();
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        if (error && !run.error)
+            run.error = error;
+        if (++run.finished == run.chunks)
+            run_finished.notify_all();
+    }
+}
+
+template <typename F>
+void ThreadPool::run_chunks(size_t count, size_t chunks, F&& body) {
+    chunks = std::max<size_t>(chunks, 1);
+    auto run = std::make_shared<Run>();
+    run->body = [&](size_t chunk) { body(chunk, chunk_begin(count, chunks, chunk), chunk_begin(count, chunks, chunk + 1)); };
+    run->chunks = chunks;
+    if (chunks > 1 && !workers.empty()) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            current = run;
+            generation++;
+        }
+        run_posted.notify_all();
+    }
+    take_part(*run);
+    std::unique_lock<std::mutex> lock(mutex);
+    run_finished.wait(lock, [&]() { return run->finished == run->chunks; });
+    current.reset();
+    if (run->error)
+        std::rethrow_exception(run->error);
+}
+
+/*
+ * =================================================================================================
+ */
+
+namespace detail {
+
+// Writes f(i) to element first + i of vec for i in [0, n), vec having been grown to first + n
+// elements by append_uninitialized(), on the chunks run_chunks(count, chunks, body) hands out
+template <typename Vector, typename F, typename RunChunks>
+void parallel_write(Vector& vec, size_t first, size_t n, F& f, size_t thread_count, RunChunks&& run_chunks) {
+    using T = typename Vector::value_type;
+    static const size_t page_bytes = sysconf(_SC_PAGESIZE);
+    vec.append_uninitialized(first + n - vec.size());
+    T* ptr = vec.data();
+    // Chunks of at least 64 KiB, moved to start at the first element beginning on a page
+    size_t chunks = std::clamp<size_t>(n * sizeof(T) / (size_t(1) << 16), 1, std::max<size_t>(thread_count, 1));
+    auto boundary = [&](size_t chunk) {
+        size_t index = first + chunk_begin(n, chunks, chunk);
+        if (chunk == 0 || chunk == chunks)
+            return index;
+        uintptr_t address = reinterpret_cast<uintptr_t>(ptr + index);
+        uintptr_t aligned = (address + page_bytes - 1) / page_bytes * page_bytes;
+        size_t moved = (aligned - address + sizeof(T) - 1) / sizeof(T);
+        return std::min(index + moved, first + n);
+    };
+    try {
+        run_chunks(n, chunks, [&](size_t chunk, size_t, size_t) {
+            size_t end = boundary(chunk + 1);
+            for (size_t i = boundary(chunk); i < end; i++)
+                ptr[i] = f(i - first);
+        });
+    } catch (...) {
+        vec.resize(first);
+        throw;
+    }
+}
+
+} // namespace detail
+
+// Replaces the contents of vec (an MmappedVector) with n elements, element i being f(i), or appends
+// n elements, the i-th of them f(i). The storage grows once, and the new elements are split into
+// one chunk per thread, starting on page boundaries, each written by its own thread. The pages of a
+// new mapping are thus first touched, and placed on the NUMA node of, the thread that fills them.
+// The result is the same as that of a sequential loop, however the threads are scheduled. If f
+// throws, none of the new elements are kept (so parallel_generate() leaves vec empty).
+template <typename Vector, typename F>
+void parallel_generate(Vector& vec, size_t n, F&& f, size_t thread_count = default_thread_count()) {
+    vec.clear();
+    detail::parallel_write(vec, 0, n, f, thread_count, [](size_t count, size_t chunks, auto&& body) { parallel_chunks(count, chunks, body); });
+}
+
+template <typename Vector, typename F>
+void parallel_generate(Vector& vec, size_t n, F&& f, ThreadPool& pool) {
+    vec.clear();
+    detail::parallel_write(vec, 0, n, f, pool.thread_count(), [&pool](size_t count, size_t chunks, auto&& body) { pool.run_chunks(count, chunks, body); });
+}
+
+template <typename Vector, typename F>
+void parallel_append(Vector& vec, size_t n, F&& f, size_t thread_count = default_thread_count()) {
+    detail::parallel_write(vec, vec.size(), n, f, thread_count, [](size_t count, size_t chunks, auto&& body) { parallel_chunks(count, chunks, body); });
+}
+
+template <typename Vector, typename F>
+void parallel_append(Vector& vec, size_t n, F&& f, ThreadPool& pool) {
+    detail::parallel_write(vec, vec.size(), n, f, pool.thread_count(), [&pool](size_t count, size_t chunks, auto&& body) { pool.run_chunks(count, chunks, body); });
+}
+
+// Behind the members of the same names of MmappedVector, which doesn't include this header
+template <typename Vector>
+struct ParallelWrites
+{
+    template <typename F, typename Threads>
+    static void generate(Vector& vec, size_t n, F&& f, Threads&& threads) { parallel_generate(vec, n, std::forward<F>(f), threads); };
+    template <typename F, typename Threads>
+    static void append(Vector& vec, size_t n, F&& f, Threads&& threads) { parallel_append(vec, n, std::forward<F>(f), threads); };
+};
+
+} // namespace mmapped_vector
+
+#endif // MMAPPED_VECTOR_PARALLEL_H
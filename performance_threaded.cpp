@@ -112,7 +112,6 @@ int main() {
     ThreadSafeVector<size_t> vec6;
     test_vector_correctness(vec6);
     std::cerr << "done" << std::endl; */
-    std::cerr << "Inelegant implementation: " << USE_INELEGANT_IMPLEMENTATION << std::endl;
     {
     Timer t("Running tests for MutexedVector");
     MutexedVector<size_t> vec7;
@@ -139,6 +138,11 @@ int main() {
     test_vector_correctness(vec11);
     }
     {
+    Timer t("Running tests for MmappedVector (FixedCapacityAllocator)");
+    MmappedVector<size_t, FixedCapacityAllocator<size_t, (size_t(1) << 36)>, true> vec13;
+    test_vector_correctness(vec13);
+    }
+    {
     Timer t("Running tests for ThreadSafeCounterVector");
     ThreadSafeCounterVector<size_t> vec12;
     test_vector_correctness(vec12);
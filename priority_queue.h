@@ -0,0 +1,225 @@
+/**
+ * @file priority_queue.h
+ * @brief A d-ary heap kept in an MmappedVector, for priority queues larger than memory.
+ * @author Michał Startek
+ * @version 0.1
+ * @copyright Copyright (c) Michał Startek 2024
+ */
+
+#ifndef MMAPPED_VECTOR_PRIORITY_QUEUE_H
+#define MMAPPED_VECTOR_PRIORITY_QUEUE_H
+
+#include <algorithm>
+#include <functional>
+#include <queue>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "mmapped_vector.h"
+#include "committed_lengths.h"
+
+
+namespace mmapped_vector {
+
+/*
+ * A priority queue in the manner of std::priority_queue: top() is the element that no other
+ * compares greater than (the largest, with std::less). The elements form an Arity-ary heap, the
+ * children of element i being elements Arity * i + 1 to Arity * i + Arity, so a heap of n elements
+ * is about log2(n) / log2(Arity) levels deep. A push or pop thus touches that many pages: with
+ * 2^31 elements, 16 levels with Arity 4, 11 with Arity 8, against 31 for a binary heap, and the
+ * children compared at each level lie next to each other, in one or two cache lines.
+ *
+ * With a file-backed allocator, the file is the heap array, and the number of elements is kept in
+ * file_name + ".lengths" (see CommittedLengths), recorded by flush() and on close. Reopened after
+ * a clean close, the queue carries on from what it held. Reopened after a crash, it has as many
+ * elements as at the last flush(), and the constructor rebuilds the heap, in time linear in its
+ * size. Pushes and pops move elements in place, though, so those are the elements in the first
+ * positions of the heap array at the time of the crash: elements pushed or popped since the last
+ * flush() may be lost, or be there twice.
+ */
+template <typename T, typename Compare = std::less<T>, template <typename> class AllocatorType = MallocAllocator, size_t Arity = 4>
+class MmappedPriorityQueue
+{
+    static_assert(Arity >= 2, "a heap needs at least two children per node");
+
+public:
+    using value_type = T;
+    using Vector = MmappedVector<T, AllocatorType<T>>;
+
+    explicit MmappedPriorityQueue(const Compare& compare = Compare()) : compare(compare) {};
+    // Keeps the heap in file_name, opening the heap already there; the remaining arguments go to the
+    // allocator
+    template <typename... Args>
+        requires std::is_constructible_v<AllocatorType<T>, std::string, Args...>
+    MmappedPriorityQueue(const std::string& file_name, const Compare& compare, Args... args);
+    template <typename... Args>
+        requires std::is_constructible_v<AllocatorType<T>, std::string, Args...>
+    explicit MmappedPriorityQueue(const std::string& file_name, Args... args) : MmappedPriorityQueue(file_name, Compare(), args...) {};
+    MmappedPriorityQueue(MmappedPriorityQueue&&) = default;
+    ~MmappedPriorityQueue() { committed.record_on_close(heap); };
+
+    size_t size() const { return heap.size(); };
+    bool empty() const { return heap.empty(); };
+    const T& top() const;
+
+    void push(const T& value);
+    // Pushes count elements from first: one by one, or, if that's more than the queue held, by
+    // rebuilding the whole heap, in time linear in its size
+    void push_range(const T* first, size_t count);
+    void pop();
+
+    // The k (or size(), if fewer) first elements, in order, leaving the queue as it is. Takes time
+    // O(k log k), whatever the size of the queue.
+    std::vector<T> top_k(size_t k) const;
+    // Removes them too
+    std::vector<T> pop_k(size_t k);
+
+    // Reorders the elements into a heap, in linear time
+    void rebuild();
+    void clear() { heap.clear(); };
+    void reserve(size_t count) { heap.reserve(count); };
+    // The elements, then their number
+    void flush();
+
+    // The heap array, e.g. to look at all the elements in no particular order
+    const Vector& elements() const { return heap; };
+
+private:
+    static size_t parent(size_t index) { return (index - 1) / Arity; };
+    static size_t first_child(size_t index) { return Arity * index + 1; };
+
+    // Moves the element at index up (down) until its parent is no smaller (its children are no greater)
+    void sift_up(size_t index);
+    void sift_down(size_t index);
+
+    Vector heap;
+    Compare compare;
+    CommittedLengths committed;
+};
+
+template <typename T, typename Compare, template <typename> class AllocatorType, size_t Arity>
+template <typename... Args>
+    requires std::is_constructible_v<AllocatorType<T>, std::string, Args...>
+MmappedPriorityQueue<T, Compare, AllocatorType, Arity>::MmappedPriorityQueue(const std::string& file_name, const Compare& compare, Args... args)
+    : heap(file_name, args...), compare(compare), committed(file_name + ".lengths") {
+    committed.restore(heap);
+    // After a crash, the elements moved since the last flush() are out of heap order
+    if (!committed.closed_cleanly())
+        rebuild();
+}
+
+template <typename T, typename Compare, template <typename> class AllocatorType, size_t Arity>
+const T& MmappedPriorityQueue<T, Compare, AllocatorType, Arity>::top() const {
+    if (heap.empty())
+        throw std::out_of_range("MmappedPriorityQueue::top: queue is empty");
+    return heap[0];
+}
+
+template <typename T, typename Compare, template <typename> class AllocatorType, size_t Arity>
+void MmappedPriorityQueue<T, Compare, AllocatorType, Arity>::sift_up(size_t index) {
+    T value = std::move(heap[index]);
+    while (index > 0 && compare(heap[parent(index)], value)) {
+        heap[index] = std::move(heap[parent(index)]);
+        index = parent(index);
+    }
+    heap[index] = std::move(value);
+}
+
+template <typename T, typename Compare, template <typename> class AllocatorType, size_t Arity>
+void MmappedPriorityQueue<T, Compare, AllocatorType, Arity>::sift_down(size_t index) {
+    size_t count = heap.size();
+    T value = std::move(heap[index]);
+    for (size_t child = first_child(index); child < count; child = first_child(index)) {
+        size_t best = child;
+        for (size_t other = child + 1; other < std::min(child + Arity, count); other++)
+            if (compare(heap[best], heap[other]))
+                best = other;
+        if (!compare(value, heap[best]))
+            break;
+        heap[index] = std::move(heap[best]);
+        index = best;
+    }
+    heap[index] = std::move(value);
+}
+
+template <typename T, typename Compare, template <typename> class AllocatorType, size_t Arity>
+void MmappedPriorityQueue<T, Compare, AllocatorType, Arity>::push(const T& value) {
+    heap.push_back(value);
+    sift_up(heap.size() - 1);
+}
+
+template <typename T, typename Compare, template <typename> class AllocatorType, size_t Arity>
+void MmappedPriorityQueue<T, Compare, AllocatorType, Arity>::push_range(const T* first, size_t count) {
+    size_t old_size = heap.size();
+    heap.append_range(first, count);
+    if (count > old_size) {
+        rebuild();
+    } else {
+        for (size_t index = old_size; index < heap.size(); index++)
+            sift_up(index);
+    }
+}
+
+template <typename T, typename Compare, template <typename> class AllocatorType, size_t Arity>
+void MmappedPriorityQueue<T, Compare, AllocatorType, Arity>::pop() {
+    if (heap.empty())
+        throw std::out_of_range("MmappedPriorityQueue::pop: queue is empty");
+    if (heap.size() > 1)
+        heap[0] = std::move(heap.back());
+    heap.pop_back();
+    if (!heap.empty())
+        sift_down(0);
+}
+
+template <typename T, typename Compare, template <typename> class AllocatorType, size_t Arity>
+void MmappedPriorityQueue<T, Compare, AllocatorType, Arity>::flush() {
+    heap.flush();
+    committed.record(true, heap);
+}
+
+template <typename T, typename Compare, template <typename> class AllocatorType, size_t Arity>
+void MmappedPriorityQueue<T, Compare, AllocatorType, Arity>::rebuild() {
+    if (heap.size() < 2)
+        return;
+    for (size_t index = parent(heap.size() - 1) + 1; index-- > 0;)
+        sift_down(index);
+}
+
+template <typename T, typename Compare, template <typename> class AllocatorType, size_t Arity>
+std::vector<T> MmappedPriorityQueue<T, Compare, AllocatorType, Arity>::top_k(size_t k) const {
+    // Only the children of elements already taken can come next
+    auto later = [this](size_t a, size_t b) { return compare(heap[a], heap[b]); };
+    std::priority_queue<size_t, std::vector<size_t>, decltype(later)> candidates(later);
+    std::vector<T> result;
+    k = std::min(k, heap.size());
+    result.reserve(k);
+    if (k > 0)
+        candidates.push(0);
+    while (result.size() < k) {
+        size_t index = candidates.top();
+        candidates.pop();
+        result.push_back(heap[index]);
+        for (size_t child = first_child(index); child < std::min(first_child(index) + Arity, heap.size()); child++)
+            candidates.push(child);
+    }
+    return result;
+}
+
+template <typename T, typename Compare, template <typename> class AllocatorType, size_t Arity>
+std::vector<T> MmappedPriorityQueue<T, Compare, AllocatorType, Arity>::pop_k(size_t k) {
+    std::vector<T> result;
+    k = std::min(k, heap.size());
+    result.reserve(k);
+    for (size_t i = 0; i < k; i++) {
+        result.push_back(heap[0]);
+        pop();
+    }
+    return result;
+}
+
+} // namespace mmapped_vector
+
+#endif // MMAPPED_VECTOR_PRIORITY_QUEUE_H
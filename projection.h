@@ -0,0 +1,191 @@
+/**
+ * @file projection.h
+ * @brief Views of a single field of a vector of records, and conversion to one vector per field.
+ * @author Michał Startek
+ * @version 0.1
+ * @copyright Copyright (c) Michał Startek 2024
+ */
+
+#ifndef MMAPPED_VECTOR_PROJECTION_H
+#define MMAPPED_VECTOR_PROJECTION_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <ranges>
+#include <span>
+#include <tuple>
+#include <type_traits>
+#include <vector>
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+#include "parallel.h"
+
+
+namespace mmapped_vector {
+
+namespace detail {
+
+template <typename>
+struct member_pointer_traits;
+
+template <typename F, typename R>
+struct member_pointer_traits<F R::*>
+{
+    using record = R;
+    using field = F;
+};
+
+} // namespace detail
+
+/*
+ * A random-access range over one field of a contiguous array of records, e.g.
+ * project<&Trade::price>(trades). Nothing is copied: element i is records[i].*Member, so the view
+ * stays valid as long as the records don't move (until the vector reallocates).
+ *
+ * gather() copies the field out into a contiguous buffer; with AVX2 it loads 8 (4-byte fields) or
+ * 4 (8-byte fields) elements per instruction, from addresses a stride apart.
+ */
+template <auto Member, typename Record>
+class FieldProjection
+{
+public:
+    using field_type = typename detail::member_pointer_traits<decltype(Member)>::field;
+    // const if the records are
+    using reference = std::conditional_t<std::is_const_v<Record>, const field_type&, field_type&>;
+
+    struct Get
+    {
+        reference operator()(Record& record) const { return record.*Member; };
+    };
+    using View = std::ranges::transform_view<std::span<Record>, Get>;
+
+    FieldProjection(Record* records, size_t count) : records(records), count(count), view(std::span<Record>(records, count), Get()) {};
+
+    size_t size() const { return count; };
+    bool empty() const { return count == 0; };
+    reference operator[](size_t index) const { return records[index].*Member; };
+    auto begin() const { return view.begin(); };
+    auto end() const { return view.end(); };
+
+    // Distance between consecutive elements, in bytes
+    static constexpr size_t stride() { return sizeof(Record); };
+
+    // Copies elements [begin, end) to out
+    void gather(size_t begin, size_t end, field_type* out) const;
+    std::vector<field_type> to_vector() const;
+
+    // op folded over the elements, starting from init. With several threads, each folds a
+    // contiguous part from init and the partial results are folded in order, so op must be
+    // associative and init its identity.
+    template <typename Op>
+    field_type reduce(field_type init, Op op, size_t thread_count = 1) const;
+    field_type sum(size_t thread_count = 1) const { return reduce(field_type(), std::plus<>(), thread_count); };
+    field_type min() const { return reduce(count > 0 ? (*this)[0] : field_type(), [](field_type a, field_type b) { return std::min(a, b); }); };
+    field_type max() const { return reduce(count > 0 ? (*this)[0] : field_type(), [](field_type a, field_type b) { return std::max(a, b); }); };
+    template <typename Predicate>
+    size_t count_if(Predicate predicate) const;
+
+private:
+    Record* records;
+    size_t count;
+    View view;
+};
+
+// Projection of a field over any vector with contiguous storage: MmappedVector, std::vector, span
+template <auto Member, typename Vector>
+auto project(Vector& vector) {
+    using Record = std::remove_reference_t<decltype(*vector.data())>;
+    static_assert(std::is_same_v<std::remove_const_t<Record>, typename detail::member_pointer_traits<decltype(Member)>::record>,
+                  "the member must belong to the vector's element type");
+    return FieldProjection<Member, Record>(vector.data(), vector.size());
+}
+
+template <auto Member, typename Record>
+void FieldProjection<Member, Record>::gather(size_t begin, size_t end, field_type* out) const {
+    size_t i = begin;
+#ifdef __AVX2__
+    // Offsets from a base advanced every step, so they fit the instructions' 32-bit indices
+    if constexpr(std::is_trivially_copyable_v<field_type> && (sizeof(field_type) == 4 || sizeof(field_type) == 8)
+                 && sizeof(Record) <= (size_t(1) << 27)) {
+        const char* base = reinterpret_cast<const char*>(&(records[i].*Member));
+        constexpr int s = static_cast<int>(sizeof(Record));
+        if constexpr(sizeof(field_type) == 4) {
+            const __m256i offsets = _mm256_setr_epi32(0, s, 2 * s, 3 * s, 4 * s, 5 * s, 6 * s, 7 * s);
+            for (; i + 8 <= end; i += 8, base += 8 * s)
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + (i - begin)),
+                                    _mm256_i32gather_epi32(reinterpret_cast<const int*>(base), offsets, 1));
+        } else {
+            const __m128i offsets = _mm_setr_epi32(0, s, 2 * s, 3 * s);
+            for (; i + 4 <= end; i += 4, base += 4 * s)
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + (i - begin)),
+                                    _mm256_i32gather_epi64(reinterpret_cast<const long long*>(base), offsets, 1));
+        }
+    }
+#endif
+    for (; i < end; i++)
+        out[i - begin] = records[i].*Member;
+}
+
+template <auto Member, typename Record>
+std::vector<typename FieldProjection<Member, Record>::field_type> FieldProjection<Member, Record>::to_vector() const {
+    std::vector<field_type> result(count);
+    gather(0, count, result.data());
+    return result;
+}
+
+template <auto Member, typename Record>
+template <typename Op>
+typename FieldProjection<Member, Record>::field_type FieldProjection<Member, Record>::reduce(field_type init, Op op, size_t thread_count) const {
+    size_t chunks = std::clamp<size_t>(count / (1 << 14), 1, std::max<size_t>(thread_count, 1));
+    std::vector<field_type> partial(chunks, init);
+    parallel_chunks(count, chunks, [&](size_t chunk, size_t begin, size_t end) {
+        field_type result = init;
+        for (size_t i = begin; i < end; i++)
+            result = op(result, records[i].*Member);
+        partial[chunk] = result;
+    });
+    field_type result = partial[0];
+    for (size_t chunk = 1; chunk < chunks; chunk++)
+        result = op(result, partial[chunk]);
+    return result;
+}
+
+template <auto Member, typename Record>
+template <typename Predicate>
+size_t FieldProjection<Member, Record>::count_if(Predicate predicate) const {
+    size_t result = 0;
+    for (size_t i = 0; i < count; i++)
+        result += predicate(records[i].*Member) ? 1 : 0;
+    return result;
+}
+
+/*
+ * =================================================================================================
+ */
+
+// Splits records into one vector per listed field, e.g.
+//     transpose<&Trade::time, &Trade::price>(std::span(trades.data(), trades.size()), std::tie(times, prices));
+// The outputs are resized to the number of records. Every thread reads its own contiguous part of
+// the records once, writing all fields of each record as it goes, so each record's cache lines are
+// fetched once however many fields are extracted.
+template <auto... Members, typename Record, typename... Outputs>
+void transpose(std::span<const Record> records, std::tuple<Outputs&...> outputs, size_t thread_count = default_thread_count()) {
+    static_assert(sizeof...(Members) == sizeof...(Outputs), "one output vector per field");
+    std::apply([&](auto&... output) { (output.resize(records.size()), ...); }, outputs);
+    auto destinations = std::apply([](auto&... output) { return std::make_tuple(output.data()...); }, outputs);
+    parallel_for(records.size(), [&](size_t begin, size_t end) {
+        std::apply([&](auto*... destination) {
+            for (size_t i = begin; i < end; i++)
+                ((destination[i] = records[i].*Members), ...);
+        }, destinations);
+    }, thread_count);
+}
+
+} // namespace mmapped_vector
+
+#endif // MMAPPED_VECTOR_PROJECTION_H
@@ -0,0 +1,423 @@
+/**
+ * @file python_module.cpp
+ * @brief Python bindings: MmapVector and MmapFileVector of the basic numeric types, exposed through
+ * the buffer protocol so that numpy.asarray(vec) aliases the mapping instead of copying it.
+ * @author Michał Startek
+ * @version 0.1
+ * @copyright Copyright (c) Michał Startek 2024
+ *
+ * Build with `make python`. From Python:
+ *
+ *   import mmapped_vector, numpy
+ *   vec = mmapped_vector.Vector("float64", "data.bin")
+ *   vec.append(1.5)
+ *   arr = numpy.asarray(vec)     # no copy
+ *
+ * While any buffer (numpy array, memoryview) is exported, operations that would move the mapping
+ * raise BufferError; appends that fit in the current capacity are still allowed, but existing
+ * arrays keep the length they had when they were created. flush() releases the GIL; while it runs,
+ * operations that change the vector raise BufferError too.
+ */
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include <memory>
+#include <string>
+#include <string_view>
+#include <limits>
+#include <type_traits>
+
+#include "mmapped_vector.h"
+
+
+namespace {
+
+using namespace mmapped_vector;
+
+class VectorBase
+{
+public:
+    virtual ~VectorBase() = default;
+
+    virtual char* data() = 0;
+    virtual size_t size() const = 0;
+    virtual size_t capacity() const = 0;
+    virtual size_t item_size() const = 0;
+    // struct module format character
+    virtual const char* format() const = 0;
+
+    // These set a Python exception and return false on failure
+    virtual bool append(PyObject* value) = 0;
+    virtual bool set(size_t index, PyObject* value) = 0;
+    virtual PyObject* get(size_t index) = 0;
+    virtual void reserve(size_t new_capacity) = 0;
+    virtual void flush() = 0;
+};
+
+template <typename T>
+bool from_python(PyObject* value, T& result) {
+    if constexpr(std::is_floating_point_v<T>) {
+        double converted = PyFloat_AsDouble(value);
+        if (converted == -1.0 && PyErr_Occurred())
+            return false;
+        result = static_cast<T>(converted);
+    } else if constexpr(std::is_signed_v<T>) {
+        long long converted = PyLong_AsLongLong(value);
+        if (converted == -1 && PyErr_Occurred())
+            return false;
+        if (converted < std::numeric_limits<T>::min() || converted > std::numeric_limits<T>::max()) {
+            PyErr_SetString(PyExc_OverflowError, "value out of range for the vector's dtype");
+            return false;
+        }
+        result = static_cast<T>(converted);
+    } else {
+        unsigned long long converted = PyLong_AsUnsignedLongLong(value);
+        if (converted == static_cast<unsigned long long>(-1) && PyErr_Occurred())
+            return false;
+        if (converted > std::numeric_limits<T>::max()) {
+            PyErr_SetString(PyExc_OverflowError, "value out of range for the vector's dtype");
+            return false;
+        }
+        result = static_cast<T>(converted);
+    }
+    return true;
+}
+
+template <typename T>
+PyObject* to_python(T value) {
+    if constexpr(std::is_floating_point_v<T>)
+        return PyFloat_FromDouble(value);
+    else if constexpr(std::is_signed_v<T>)
+        return PyLong_FromLongLong(value);
+    else
+        return PyLong_FromUnsignedLongLong(value);
+}
+
+template <typename T, typename V>
+class TypedVector : public VectorBase
+{
+public:
+    template <typename... Args>
+    TypedVector(const char* format, Args&&... args) : vec(std::forward<Args>(args)...), format_char(format) {};
+
+    char* data() override { return reinterpret_cast<char*>(vec.data()); };
+    size_t size() const override { return vec.size(); };
+    size_t capacity() const override { return vec.capacity(); };
+    size_t item_size() const override { return sizeof(T); };
+    const char* format() const override { return format_char; };
+
+    bool append(PyObject* value) override {
+        T converted;
+        if (!from_python(value, converted))
+            return false;
+        vec.push_back(converted);
+        return true;
+    };
+    bool set(size_t index, PyObject* value) override {
+        T converted;
+        if (!from_python(value, converted))
+            return false;
+        vec[index] = converted;
+        return true;
+    };
+    PyObject* get(size_t index) override { return to_python(vec[index]); };
+    void reserve(size_t new_capacity) override { vec.reserve(new_capacity); };
+    void flush() override { vec.flush(); };
+
+private:
+    V vec;
+    const char* format_char;
+};
+
+// Files named *.npy get a .npy header, so numpy.load(path, mmap_mode='r') can open them too
+template <typename T>
+std::unique_ptr<VectorBase> make_typed(const char* format, const char* path) {
+    if (path && std::string_view(path).ends_with(".npy"))
+        return std::make_unique<TypedVector<T, MmapFileVector<T>>>(format, path, FileLayout::npy);
+    if (path)
+        return std::make_unique<TypedVector<T, MmapFileVector<T>>>(format, path);
+    return std::make_unique<TypedVector<T, MmapVector<T>>>(format);
+}
+
+// Accepts numpy dtype names and struct format characters
+std::unique_ptr<VectorBase> make_vector(const std::string& dtype, const char* path) {
+    if (dtype == "int8" || dtype == "b")     return make_typed<int8_t>("b", path);
+    if (dtype == "uint8" || dtype == "B")    return make_typed<uint8_t>("B", path);
+    if (dtype == "int16" || dtype == "h")    return make_typed<int16_t>("h", path);
+    if (dtype == "uint16" || dtype == "H")   return make_typed<uint16_t>("H", path);
+    if (dtype == "int32" || dtype == "i")    return make_typed<int32_t>("i", path);
+    if (dtype == "uint32" || dtype == "I")   return make_typed<uint32_t>("I", path);
+    if (dtype == "int64" || dtype == "q")    return make_typed<int64_t>("q", path);
+    if (dtype == "uint64" || dtype == "Q")   return make_typed<uint64_t>("Q", path);
+    if (dtype == "float32" || dtype == "f")  return make_typed<float>("f", path);
+    if (dtype == "float64" || dtype == "d")  return make_typed<double>("d", path);
+    return nullptr;
+}
+
+/*
+ * =================================================================================================
+ * The Python type
+ */
+
+struct PyVector {
+    PyObject_HEAD
+    VectorBase* vec;
+    // Number of buffers currently exported; the mapping must not move while it's nonzero
+    Py_ssize_t exports;
+    // Number of flush() calls running without the GIL; the vector must not change while it's nonzero
+    Py_ssize_t flushes;
+};
+
+bool check_open(PyVector* self) {
+    if (!self->vec) {
+        PyErr_SetString(PyExc_ValueError, "vector is not initialized");
+        return false;
+    }
+    return true;
+}
+
+bool check_not_flushing(PyVector* self) {
+    if (self->flushes > 0) {
+        PyErr_SetString(PyExc_BufferError, "cannot change a vector while it is being flushed");
+        return false;
+    }
+    return true;
+}
+
+bool check_can_move(PyVector* self) {
+    if (self->exports > 0) {
+        PyErr_SetString(PyExc_BufferError, "cannot resize a vector while its buffer is exported");
+        return false;
+    }
+    return true;
+}
+
+int PyVector_init(PyVector* self, PyObject* args, PyObject* kwargs) {
+    static const char* keywords[] = {"dtype", "path", nullptr};
+    const char* dtype;
+    const char* path = nullptr;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "s|z", const_cast<char**>(keywords), &dtype, &path))
+        return -1;
+    if (self->exports > 0) {
+        PyErr_SetString(PyExc_BufferError, "cannot reinitialize a vector while its buffer is exported");
+        return -1;
+    }
+    if (!check_not_flushing(self))
+        return -1;
+    try {
+        std::unique_ptr<VectorBase> vec = make_vector(dtype, path);
+        if (!vec) {
+            PyErr_Format(PyExc_TypeError, "unsupported dtype: %s", dtype);
+            return -1;
+        }
+        delete self->vec;
+        self->vec = vec.release();
+    } catch (const std::exception& e) {
+        PyErr_SetString(PyExc_OSError, e.what());
+        return -1;
+    }
+    return 0;
+}
+
+void PyVector_dealloc(PyVector* self) {
+    PyTypeObject* type = Py_TYPE(self);
+    delete self->vec;
+    type->tp_free(reinterpret_cast<PyObject*>(self));
+    Py_DECREF(type);
+}
+
+PyObject* PyVector_append(PyVector* self, PyObject* value) {
+    if (!check_open(self) || !check_not_flushing(self))
+        return nullptr;
+    if (self->vec->size() >= self->vec->capacity() && !check_can_move(self))
+        return nullptr;
+    try {
+        if (!self->vec->append(value))
+            return nullptr;
+    } catch (const std::exception& e) {
+        PyErr_SetString(PyExc_OSError, e.what());
+        return nullptr;
+    }
+    Py_RETURN_NONE;
+}
+
+PyObject* PyVector_reserve(PyVector* self, PyObject* arg) {
+    if (!check_open(self) || !check_not_flushing(self))
+        return nullptr;
+    Py_ssize_t new_capacity = PyLong_AsSsize_t(arg);
+    if (new_capacity == -1 && PyErr_Occurred())
+        return nullptr;
+    if (new_capacity < 0) {
+        PyErr_SetString(PyExc_ValueError, "capacity must not be negative");
+        return nullptr;
+    }
+    if (static_cast<size_t>(new_capacity) > self->vec->capacity() && !check_can_move(self))
+        return nullptr;
+    try {
+        self->vec->reserve(new_capacity);
+    } catch (const std::exception& e) {
+        PyErr_SetString(PyExc_OSError, e.what());
+        return nullptr;
+    }
+    Py_RETURN_NONE;
+}
+
+PyObject* PyVector_flush(PyVector* self, PyObject*) {
+    if (!check_open(self))
+        return nullptr;
+    std::string error;
+    // Other threads run meanwhile, and may call into this vector
+    self->flushes++;
+    Py_BEGIN_ALLOW_THREADS
+    try {
+        self->vec->flush();
+    } catch (const std::exception& e) {
+        error = e.what();
+    }
+    Py_END_ALLOW_THREADS
+    self->flushes--;
+    if (!error.empty()) {
+        PyErr_SetString(PyExc_OSError, error.c_str());
+        return nullptr;
+    }
+    Py_RETURN_NONE;
+}
+
+PyObject* PyVector_get_capacity(PyVector* self, void*) {
+    if (!check_open(self))
+        return nullptr;
+    return PyLong_FromSize_t(self->vec->capacity());
+}
+
+PyObject* PyVector_get_format(PyVector* self, void*) {
+    if (!check_open(self))
+        return nullptr;
+    return PyUnicode_FromString(self->vec->format());
+}
+
+Py_ssize_t PyVector_length(PyVector* self) {
+    if (!check_open(self))
+        return -1;
+    return self->vec->size();
+}
+
+PyObject* PyVector_item(PyVector* self, Py_ssize_t index) {
+    if (!check_open(self))
+        return nullptr;
+    if (index < 0 || static_cast<size_t>(index) >= self->vec->size()) {
+        PyErr_SetString(PyExc_IndexError, "vector index out of range");
+        return nullptr;
+    }
+    return self->vec->get(index);
+}
+
+int PyVector_ass_item(PyVector* self, Py_ssize_t index, PyObject* value) {
+    if (!check_open(self))
+        return -1;
+    if (!value) {
+        PyErr_SetString(PyExc_TypeError, "vector elements cannot be deleted");
+        return -1;
+    }
+    if (index < 0 || static_cast<size_t>(index) >= self->vec->size()) {
+        PyErr_SetString(PyExc_IndexError, "vector index out of range");
+        return -1;
+    }
+    return self->vec->set(index, value) ? 0 : -1;
+}
+
+int PyVector_getbuffer(PyVector* self, Py_buffer* view, int flags) {
+    if (!check_open(self)) {
+        view->obj = nullptr;
+        return -1;
+    }
+    // The shape lives as long as the export, as the vector may grow in the meantime
+    Py_ssize_t* shape = static_cast<Py_ssize_t*>(PyMem_Malloc(2 * sizeof(Py_ssize_t)));
+    if (!shape) {
+        view->obj = nullptr;
+        PyErr_NoMemory();
+        return -1;
+    }
+    shape[0] = self->vec->size();
+    shape[1] = self->vec->item_size();
+
+    view->obj = reinterpret_cast<PyObject*>(self);
+    Py_INCREF(self);
+    view->buf = self->vec->data();
+    view->len = shape[0] * shape[1];
+    view->readonly = 0;
+    view->itemsize = shape[1];
+    view->format = (flags & PyBUF_FORMAT) ? const_cast<char*>(self->vec->format()) : nullptr;
+    view->ndim = 1;
+    view->shape = (flags & PyBUF_ND) ? &shape[0] : nullptr;
+    view->strides = (flags & PyBUF_STRIDES) == PyBUF_STRIDES ? &shape[1] : nullptr;
+    view->suboffsets = nullptr;
+    view->internal = shape;
+    self->exports++;
+    return 0;
+}
+
+void PyVector_releasebuffer(PyVector* self, Py_buffer* view) {
+    PyMem_Free(view->internal);
+    self->exports--;
+}
+
+PyMethodDef PyVector_methods[] = {
+    {"append", reinterpret_cast<PyCFunction>(PyVector_append), METH_O, "Adds an element to the end of the vector"},
+    {"reserve", reinterpret_cast<PyCFunction>(PyVector_reserve), METH_O, "Makes room for at least n elements"},
+    {"flush", reinterpret_cast<PyCFunction>(PyVector_flush), METH_NOARGS, "Writes the used part of a file-backed vector to disk"},
+    {nullptr, nullptr, 0, nullptr}
+};
+
+PyGetSetDef PyVector_getset[] = {
+    {"capacity", reinterpret_cast<getter>(PyVector_get_capacity), nullptr, "Number of elements that fit without moving the mapping", nullptr},
+    {"format", reinterpret_cast<getter>(PyVector_get_format), nullptr, "struct module format of the elements", nullptr},
+    {nullptr, nullptr, nullptr, nullptr, nullptr}
+};
+
+PyType_Slot PyVector_slots[] = {
+    {Py_tp_doc, const_cast<char*>("Vector(dtype, path=None): an anonymous mapping, or a file-backed one when path is given")},
+    {Py_tp_new, reinterpret_cast<void*>(PyType_GenericNew)},
+    {Py_tp_init, reinterpret_cast<void*>(PyVector_init)},
+    {Py_tp_dealloc, reinterpret_cast<void*>(PyVector_dealloc)},
+    {Py_tp_methods, PyVector_methods},
+    {Py_tp_getset, PyVector_getset},
+    {Py_sq_length, reinterpret_cast<void*>(PyVector_length)},
+    {Py_sq_item, reinterpret_cast<void*>(PyVector_item)},
+    {Py_sq_ass_item, reinterpret_cast<void*>(PyVector_ass_item)},
+    {Py_bf_getbuffer, reinterpret_cast<void*>(PyVector_getbuffer)},
+    {Py_bf_releasebuffer, reinterpret_cast<void*>(PyVector_releasebuffer)},
+    {0, nullptr}
+};
+
+PyType_Spec PyVector_spec = {
+    "mmapped_vector.Vector",
+    sizeof(PyVector),
+    0,
+    Py_TPFLAGS_DEFAULT,
+    PyVector_slots
+};
+
+PyModuleDef module_definition = {
+    PyModuleDef_HEAD_INIT,
+    "mmapped_vector",
+    "Memory-mapped vectors, usable as numpy arrays without copying",
+    -1,
+    nullptr, nullptr, nullptr, nullptr, nullptr
+};
+
+} // namespace
+
+
+PyMODINIT_FUNC PyInit_mmapped_vector() {
+    PyObject* module = PyModule_Create(&module_definition);
+    if (!module)
+        return nullptr;
+    PyObject* type = PyType_FromSpec(&PyVector_spec);
+    if (!type || PyModule_AddObject(module, "Vector", type) < 0) {
+        Py_XDECREF(type);
+        Py_DECREF(module);
+        return nullptr;
+    }
+    return module;
+}
@@ -0,0 +1,353 @@
+/**
+ * @file sharded_vector.h
+ * @brief A vector appended to by many threads, each into its own shard, and read as one sequence.
+ * @author Michał Startek
+ * @version 0.1
+ * @copyright Copyright (c) Michał Startek 2024
+ */
+
+#ifndef MMAPPED_VECTOR_SHARDED_VECTOR_H
+#define MMAPPED_VECTOR_SHARDED_VECTOR_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <unistd.h>
+
+#include "mmapped_vector.h"
+#include "parallel.h"
+
+
+namespace mmapped_vector {
+
+/*
+ * Every thread appends to a shard of its own, a plain (not thread-safe) MmappedVector, so appends
+ * share nothing between threads: no counter, no lock, not even a cache line. The calling thread's
+ * shard is found through a thread_local cache, after a locked lookup on its first append. Shards
+ * are keyed by std::thread::id, so a thread started after another has ended may continue its shard.
+ *
+ * Read as a whole, the elements are shard 0's, then shard 1's, and so on, shards numbered in
+ * the order their threads first appended. Reads go through prefix sums of the shard sizes, rebuilt
+ * on the first read after an append. Reads must not overlap with appends (have the writers joined,
+ * or otherwise synchronised with, before reading); within that rule, marking the index stale costs
+ * an append a relaxed load of a flag in its own shard, which compiles to a plain load.
+ *
+ * consolidate() copies the shards, in parallel, into one contiguous vector.
+ */
+template <typename T, template <typename> class AllocatorType = MallocAllocator>
+class ShardedVector
+{
+public:
+    using value_type = T;
+    using Vector = MmappedVector<T, AllocatorType<T>>;
+
+    ShardedVector();
+    // Keeps shard i in base_name + ".shard" + i, opening the shards already there; the remaining
+    // arguments go to the allocators of all shards
+    template <typename... Args>
+        requires std::is_constructible_v<AllocatorType<T>, std::string, Args...>
+    explicit ShardedVector(const std::string& base_name, Args... args);
+    ShardedVector(const ShardedVector&) = delete;
+    ShardedVector& operator=(const ShardedVector&) = delete;
+
+    // Appends to the calling thread's shard
+    void push_back(const T& value);
+    void append_range(const T* first, size_t count);
+    // The calling thread's shard, for other operations on it
+    Vector& local();
+
+    size_t size() const;
+    bool empty() const { return size() == 0; };
+    size_t shard_count() const;
+    const Vector& shard(size_t index) const;
+
+    // Element `index` of the whole sequence
+    const T& operator[](size_t index) const;
+    const T& at(size_t index) const;
+
+    class const_iterator;
+    const_iterator begin() const;
+    const_iterator end() const;
+
+    // Calls f(element) for every element, a shard at a time, in order
+    template <typename F>
+    void for_each(F&& f) const;
+
+    // Copies the whole sequence to the end of out, in parallel; the shards are left as they are
+    template <typename OutVector>
+    void consolidate(OutVector& out, size_t thread_count = default_thread_count()) const;
+
+    // Empties all shards; not while any thread appends
+    void clear();
+    void flush();
+
+private:
+    struct alignas(64) Shard
+    {
+        explicit Shard(std::unique_ptr<Vector> vec) : vec(std::move(vec)) {};
+
+        std::unique_ptr<Vector> vec;
+        // Whether the prefix sums include this shard's current size
+        std::atomic<bool> indexed{false};
+    };
+
+    Shard& own_shard();
+    Shard& add_shard();
+    void mark_appended(Shard& shard);
+    // Rebuilds the prefix sums if any shard changed since they were built
+    void refresh_index() const;
+
+    static uint64_t next_id() {
+        static std::atomic<uint64_t> counter{0};
+        return ++counter;
+    };
+
+    // Never reused, unlike addresses, so a thread's cache can't point into a destroyed vector
+    const uint64_t id = next_id();
+    std::function<std::unique_ptr<Vector>(size_t index)> make_vector;
+    mutable std::mutex mutex;
+    std::vector<std::unique_ptr<Shard>> shards;
+    std::unordered_map<std::thread::id, Shard*> owners;
+    mutable std::atomic<bool> index_stale{true};
+    // prefix[i] is the number of elements in shards before shard i
+    mutable std::vector<size_t> prefix;
+};
+
+template <typename T, template <typename> class AllocatorType>
+ShardedVector<T, AllocatorType>::ShardedVector() : make_vector([](size_t) { return std::make_unique<Vector>(); }), prefix{0} {
+}
+
+template <typename T, template <typename> class AllocatorType>
+template <typename... Args>
+    requires std::is_constructible_v<AllocatorType<T>, std::string, Args...>
+ShardedVector<T, AllocatorType>::ShardedVector(const std::string& base_name, Args... args)
+    : make_vector([base_name, args...](size_t index) { return std::make_unique<Vector>(base_name + ".shard" + std::to_string(index), args...); }), prefix{0} {
+    // Shards of an earlier run aren't owned by any thread; threads appending now get new ones
+    for (size_t index = 0; access((base_name + ".shard" + std::to_string(index)).c_str(), F_OK) == 0; index++)
+        add_shard();
+}
+
+template <typename T, template <typename> class AllocatorType>
+typename ShardedVector<T, AllocatorType>::Shard& ShardedVector<T, AllocatorType>::add_shard() {
+    std::lock_guard<std::mutex> lock(mutex);
+    shards.push_back(std::make_unique<Shard>(make_vector(shards.size())));
+    index_stale.store(true, std::memory_order_relaxed);
+    return *shards.back();
+}
+
+template <typename T, template <typename> class AllocatorType>
+typename ShardedVector<T, AllocatorType>::Shard& ShardedVector<T, AllocatorType>::own_shard() {
+    struct Cache
+    {
+        uint64_t owner = 0;
+        Shard* shard = nullptr;
+    };
+    static thread_local Cache cache;
+    if (cache.owner == id)
+        return *cache.shard;
+
+    Shard* shard;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto found = owners.find(std::this_thread::get_id());
+        shard = found != owners.end() ? found->second : nullptr;
+    }
+    if (!shard) {
+        shard = &add_shard();
+        std::lock_guard<std::mutex> lock(mutex);
+        owners[std::this_thread::get_id()] = shard;
+    }
+    cache = Cache{id, shard};
+    return *shard;
+}
+
+template <typename T, template <typename> class AllocatorType> inline
+void ShardedVector<T, AllocatorType>::mark_appended(Shard& shard) {
+    if (shard.indexed.load(std::memory_order_relaxed)) {
+        shard.indexed.store(false, std::memory_order_relaxed);
+        index_stale.store(true, std::memory_order_relaxed);
+    }
+}
+
+template <typename T, template <typename> class AllocatorType> inline
+void ShardedVector<T, AllocatorType>::push_back(const T& value) {
+    Shard& shard = own_shard();
+    shard.vec->push_back(value);
+    mark_appended(shard);
+}
+
+template <typename T, template <typename> class AllocatorType>
+void ShardedVector<T, AllocatorType>::append_range(const T* first, size_t count) {
+    Shard& shard = own_shard();
+    shard.vec->append_range(first, count);
+    mark_appended(shard);
+}
+
+// Anything may change the shard's size, so the index is assumed stale
+template <typename T, template <typename> class AllocatorType>
+typename ShardedVector<T, AllocatorType>::Vector& ShardedVector<T, AllocatorType>::local() {
+    Shard& shard = own_shard();
+    shard.indexed.store(false, std::memory_order_relaxed);
+    index_stale.store(true, std::memory_order_relaxed);
+    return *shard.vec;
+}
+
+template <typename T, template <typename> class AllocatorType>
+void ShardedVector<T, AllocatorType>::refresh_index() const {
+    if (!index_stale.load(std::memory_order_relaxed))
+        return;
+    std::lock_guard<std::mutex> lock(mutex);
+    prefix.resize(shards.size() + 1);
+    prefix[0] = 0;
+    for (size_t i = 0; i < shards.size(); i++) {
+        shards[i]->indexed.store(true, std::memory_order_relaxed);
+        prefix[i + 1] = prefix[i] + shards[i]->vec->size();
+    }
+    index_stale.store(false, std::memory_order_relaxed);
+}
+
+template <typename T, template <typename> class AllocatorType>
+size_t ShardedVector<T, AllocatorType>::size() const {
+    refresh_index();
+    return prefix.back();
+}
+
+template <typename T, template <typename> class AllocatorType>
+size_t ShardedVector<T, AllocatorType>::shard_count() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return shards.size();
+}
+
+template <typename T, template <typename> class AllocatorType>
+const typename ShardedVector<T, AllocatorType>::Vector& ShardedVector<T, AllocatorType>::shard(size_t index) const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return *shards.at(index)->vec;
+}
+
+template <typename T, template <typename> class AllocatorType>
+const T& ShardedVector<T, AllocatorType>::operator[](size_t index) const {
+    refresh_index();
+    // The last shard starting at or before index; empty shards start where the next one does
+    size_t shard_index = std::upper_bound(prefix.begin(), prefix.end(), index) - prefix.begin() - 1;
+    return (*shards[shard_index]->vec)[index - prefix[shard_index]];
+}
+
+template <typename T, template <typename> class AllocatorType>
+const T& ShardedVector<T, AllocatorType>::at(size_t index) const {
+    if (index >= size())
+        throw std::out_of_range("ShardedVector::at: index out of range");
+    return (*this)[index];
+}
+
+template <typename T, template <typename> class AllocatorType>
+template <typename F>
+void ShardedVector<T, AllocatorType>::for_each(F&& f) const {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (const auto& shard : shards)
+        for (const T& element : *shard->vec)
+            f(element);
+}
+
+template <typename T, template <typename> class AllocatorType>
+template <typename OutVector>
+void ShardedVector<T, AllocatorType>::consolidate(OutVector& out, size_t thread_count) const {
+    refresh_index();
+    std::lock_guard<std::mutex> lock(mutex);
+    size_t first = out.size();
+    out.resize(first + prefix.back());
+    T* destination = out.data() + first;
+    // Equal parts of the output, each copied from the shards it overlaps
+    parallel_for(prefix.back(), [&](size_t begin, size_t end) {
+        size_t shard_index = std::upper_bound(prefix.begin(), prefix.end(), begin) - prefix.begin() - 1;
+        for (size_t position = begin; position < end; shard_index++) {
+            size_t shard_end = std::min(prefix[shard_index + 1], end);
+            if (shard_end > position)
+                std::memcpy(destination + position, shards[shard_index]->vec->data() + (position - prefix[shard_index]), (shard_end - position) * sizeof(T));
+            position = std::max(position, shard_end);
+        }
+    }, thread_count);
+}
+
+template <typename T, template <typename> class AllocatorType>
+void ShardedVector<T, AllocatorType>::clear() {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto& shard : shards) {
+        shard->vec->clear();
+        shard->indexed.store(false, std::memory_order_relaxed);
+    }
+    index_stale.store(true, std::memory_order_relaxed);
+}
+
+template <typename T, template <typename> class AllocatorType>
+void ShardedVector<T, AllocatorType>::flush() {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto& shard : shards)
+        shard->vec->flush();
+}
+
+/*
+ * =================================================================================================
+ */
+
+// Walks the sequence a shard at a time; valid until the next append
+template <typename T, template <typename> class AllocatorType>
+class ShardedVector<T, AllocatorType>::const_iterator
+{
+public:
+    using iterator_category = std::forward_iterator_tag;
+    using value_type = T;
+    using difference_type = ptrdiff_t;
+    using pointer = const T*;
+    using reference = const T&;
+
+    const_iterator() = default;
+    const_iterator(const ShardedVector* owner, size_t shard, size_t position) : owner(owner), shard(shard), position(position) { skip_empty(); };
+
+    reference operator*() const { return (*owner->shards[shard]->vec)[position]; };
+    pointer operator->() const { return &**this; };
+    const_iterator& operator++() {
+        position++;
+        skip_empty();
+        return *this;
+    };
+    const_iterator operator++(int) {
+        const_iterator previous = *this;
+        ++*this;
+        return previous;
+    };
+    bool operator==(const const_iterator& other) const { return shard == other.shard && position == other.position; };
+
+private:
+    void skip_empty() {
+        while (shard < owner->shards.size() && position == owner->shards[shard]->vec->size()) {
+            shard++;
+            position = 0;
+        }
+    };
+
+    const ShardedVector* owner = nullptr;
+    size_t shard = 0;
+    size_t position = 0;
+};
+
+template <typename T, template <typename> class AllocatorType>
+typename ShardedVector<T, AllocatorType>::const_iterator ShardedVector<T, AllocatorType>::begin() const {
+    return const_iterator(this, 0, 0);
+}
+
+template <typename T, template <typename> class AllocatorType>
+typename ShardedVector<T, AllocatorType>::const_iterator ShardedVector<T, AllocatorType>::end() const {
+    return const_iterator(this, shards.size(), 0);
+}
+
+} // namespace mmapped_vector
+
+#endif // MMAPPED_VECTOR_SHARDED_VECTOR_H
@@ -0,0 +1,260 @@
+/**
+ * @file snapshot.h
+ * @brief Read-only point-in-time views of an MmappedVector.
+ * @author Michał Startek
+ * @version 0.1
+ * @copyright Copyright (c) Michał Startek 2024
+ */
+
+#ifndef MMAPPED_VECTOR_SNAPSHOT_H
+#define MMAPPED_VECTOR_SNAPSHOT_H
+
+#include <sys/mman.h>
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <vector>
+#include <stdexcept>
+
+#include "allocators.h"
+
+
+namespace mmapped_vector {
+
+/*
+ * When the vector's memory is a shared mapping of a file descriptor (MmapMemfdAllocator, or
+ * MmapFileAllocator with MAP_SHARED), a snapshot is a MAP_PRIVATE mapping of the same descriptor:
+ * taking it costs one mmap(), and until a page is written it shares the vector's physical page.
+ * Before MmappedVector::update() changes an element below a snapshot's length, the page holding
+ * it is rewritten with its current contents through the snapshot's mapping. That write makes the
+ * kernel copy the page into the snapshot, which from then on no longer sees the vector's changes.
+ *
+ * Other allocators have no descriptor to map, and their snapshots are plain copies.
+ *
+ * Appends never touch a snapshot, and update() is isolated as described. Writes that bypass
+ * update() (operator[], data(), appends after pop_back() or clear()) below a snapshot's length show
+ * through in its untouched pages. Before the vector shrinks its backing file below a snapshot's
+ * length (resize(), shrink_to_fit(), or its destructor, after a clear() or pop_back()), the
+ * snapshot's pages past the new end are copied out of the file, as if they had all been preserved.
+ */
+template <typename T>
+class SnapshotState
+{
+public:
+    // The elements start fd_offset bytes into fd
+    SnapshotState(const T* data, size_t length, int fd, size_t fd_offset = 0);
+    SnapshotState(const SnapshotState&) = delete;
+    SnapshotState& operator=(const SnapshotState&) = delete;
+    ~SnapshotState();
+
+    // Detaches the page(s) holding element `index` from the vector, whose memory is at `current`
+    void preserve(size_t index, const T* current);
+    // Detaches the pages past the first file_bytes bytes of the file, before it's cut to that size
+    void detach_beyond(size_t file_bytes);
+
+    const T* ptr;
+    const size_t length;
+    const bool copy_on_write;
+private:
+    char* mapping;
+    size_t fd_offset;
+    size_t mapped_bytes;
+    std::vector<bool> preserved_pages;
+};
+
+template <typename T>
+SnapshotState<T>::SnapshotState(const T* data, size_t length, int fd, size_t fd_offset)
+    : ptr(nullptr), length(length), copy_on_write(fd != -1), fd_offset(copy_on_write ? fd_offset : 0) {
+    size_t bytes = this->fd_offset + length * sizeof(T);
+    mapped_bytes = std::max<size_t>((bytes + page_size - 1) / page_size, 1) * page_size;
+    void* mapped;
+    if (copy_on_write)
+        mapped = mmap(nullptr, mapped_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    else
+        mapped = mmap(nullptr, mapped_bytes, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (mapped == MAP_FAILED)
+        throw std::runtime_error("SnapshotState::ctor: mmap failed: " + mmapped_vector::get_error_message("mmap"));
+
+    mapping = static_cast<char*>(mapped);
+    if (copy_on_write)
+        preserved_pages.assign(mapped_bytes / page_size, false);
+    else
+        std::memcpy(mapping, data, bytes);
+    ptr = reinterpret_cast<const T*>(mapping + this->fd_offset);
+}
+
+template <typename T>
+SnapshotState<T>::~SnapshotState() {
+    munmap(mapping, mapped_bytes);
+}
+
+template <typename T>
+void SnapshotState<T>::preserve(size_t index, const T* current) {
+    if (!copy_on_write || index >= length)
+        return;
+    // Byte positions are relative to the start of the file
+    size_t data_end = fd_offset + length * sizeof(T);
+    size_t first_page = (fd_offset + index * sizeof(T)) / page_size;
+    size_t last_page = (fd_offset + (index + 1) * sizeof(T) - 1) / page_size;
+    for (size_t page = first_page; page <= last_page; page++) {
+        if (preserved_pages[page])
+            continue;
+        size_t begin = std::max(page * page_size, fd_offset);
+        size_t end = std::min((page + 1) * page_size, data_end);
+        std::memcpy(mapping + begin, reinterpret_cast<const char*>(current) + (begin - fd_offset), end - begin);
+        preserved_pages[page] = true;
+    }
+}
+
+template <typename T>
+void SnapshotState<T>::detach_beyond(size_t file_bytes) {
+    if (!copy_on_write || file_bytes >= mapped_bytes)
+        return;
+    size_t first_page = file_bytes / page_size;
+    size_t bytes = mapped_bytes - first_page * page_size;
+    char* tail = mapping + first_page * page_size;
+    // The copy replaces the pages in one step, so readers of the snapshot never see them missing
+    void* copy = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (copy == MAP_FAILED)
+        throw std::runtime_error("SnapshotState::detach_beyond: mmap failed: " + mmapped_vector::get_error_message("mmap"));
+    std::memcpy(copy, tail, bytes);
+    if (mremap(copy, bytes, bytes, MREMAP_MAYMOVE | MREMAP_FIXED, tail) == MAP_FAILED) {
+        munmap(copy, bytes);
+        throw std::runtime_error("SnapshotState::detach_beyond: mremap failed: " + mmapped_vector::get_error_message("mremap"));
+    }
+    std::fill(preserved_pages.begin() + first_page, preserved_pages.end(), true);
+}
+
+/*
+ * =================================================================================================
+ */
+
+// A read-only view of a vector's first size() elements, as they were when it was taken.
+// Cheap to copy; the memory is released when the last copy goes away.
+template <typename T>
+class Snapshot
+{
+public:
+    using value_type = T;
+    using size_type = size_t;
+    using const_reference = const T&;
+    using const_pointer = const T*;
+
+    explicit Snapshot(std::shared_ptr<const SnapshotState<T>> state) : state(std::move(state)) {};
+
+    size_t size() const { return state->length; };
+    bool empty() const { return state->length == 0; };
+    const T& operator[](size_t index) const { return state->ptr[index]; };
+    const T& at(size_t pos) const;
+    const T* data() const { return state->ptr; };
+    const T* begin() const { return state->ptr; };
+    const T* end() const { return state->ptr + state->length; };
+
+private:
+    std::shared_ptr<const SnapshotState<T>> state;
+};
+
+template <typename T>
+const T& Snapshot<T>::at(size_t pos) const {
+    if (pos >= state->length) {
+        throw std::out_of_range("Snapshot::at: index out of range");
+    }
+    return state->ptr[pos];
+};
+
+/*
+ * =================================================================================================
+ */
+
+// The vector's list of live copy-on-write snapshots
+template <typename T>
+class SnapshotRegistry
+{
+public:
+    SnapshotRegistry() = default;
+    SnapshotRegistry(SnapshotRegistry&& other) noexcept;
+    SnapshotRegistry& operator=(SnapshotRegistry&& other) noexcept;
+
+    Snapshot<T> create(const T* data, size_t length, int fd, size_t fd_offset = 0);
+
+    // Called before element `index` is changed in place
+    inline void preserve(size_t index, const T* current) {
+        if (live_snapshots.load(std::memory_order_acquire) != 0)
+            preserve_slow(index, current);
+    };
+
+    // Called before the backing file is cut to file_bytes bytes
+    inline void detach_beyond(size_t file_bytes) {
+        if (live_snapshots.load(std::memory_order_acquire) != 0)
+            detach_beyond_slow(file_bytes);
+    };
+
+private:
+    void preserve_slow(size_t index, const T* current);
+    void detach_beyond_slow(size_t file_bytes);
+
+    std::mutex mutex;
+    std::vector<std::weak_ptr<SnapshotState<T>>> snapshots;
+    std::atomic<size_t> live_snapshots = 0;
+};
+
+template <typename T>
+SnapshotRegistry<T>::SnapshotRegistry(SnapshotRegistry&& other) noexcept : snapshots(std::move(other.snapshots)) {
+    live_snapshots.store(snapshots.size());
+    other.live_snapshots.store(0);
+}
+
+template <typename T>
+SnapshotRegistry<T>& SnapshotRegistry<T>::operator=(SnapshotRegistry&& other) noexcept {
+    if (this != &other) {
+        snapshots = std::move(other.snapshots);
+        live_snapshots.store(snapshots.size());
+        other.live_snapshots.store(0);
+    }
+    return *this;
+}
+
+template <typename T>
+Snapshot<T> SnapshotRegistry<T>::create(const T* data, size_t length, int fd, size_t fd_offset) {
+    auto state = std::make_shared<SnapshotState<T>>(data, length, fd, fd_offset);
+    if (state->copy_on_write) {
+        std::lock_guard<std::mutex> lock(mutex);
+        snapshots.push_back(state);
+        live_snapshots.store(snapshots.size(), std::memory_order_release);
+    }
+    return Snapshot<T>(std::move(state));
+}
+
+template <typename T>
+void SnapshotRegistry<T>::preserve_slow(size_t index, const T* current) {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto it = snapshots.begin(); it != snapshots.end();) {
+        if (auto state = it->lock()) {
+            state->preserve(index, current);
+            ++it;
+        } else {
+            it = snapshots.erase(it);
+        }
+    }
+    live_snapshots.store(snapshots.size(), std::memory_order_release);
+}
+
+template <typename T>
+void SnapshotRegistry<T>::detach_beyond_slow(size_t file_bytes) {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto it = snapshots.begin(); it != snapshots.end();) {
+        if (auto state = it->lock()) {
+            state->detach_beyond(file_bytes);
+            ++it;
+        } else {
+            it = snapshots.erase(it);
+        }
+    }
+    live_snapshots.store(snapshots.size(), std::memory_order_release);
+}
+
+} // namespace mmapped_vector
+
+#endif // MMAPPED_VECTOR_SNAPSHOT_H
@@ -0,0 +1,66 @@
+"""
+Tests of the Python bindings. Build them with `make python`, then run `make python_test`.
+"""
+
+import os
+import tempfile
+
+import numpy
+
+import mmapped_vector
+
+
+def test_aliasing():
+    vec = mmapped_vector.Vector("float64")
+    for i in range(10):
+        vec.append(i * 0.5)
+    arr = numpy.asarray(vec)
+    assert arr.dtype == numpy.float64 and arr.shape == (10,)
+    # Same memory, no copy
+    arr[3] = -1.0
+    assert vec[3] == -1.0
+    vec[4] = 7.0
+    assert arr[4] == 7.0
+
+
+def test_buffer_error_while_exported():
+    vec = mmapped_vector.Vector("int32")
+    vec.append(1)
+    view = memoryview(vec)
+    # Appends that fit in the capacity are fine
+    while len(vec) < vec.capacity:
+        vec.append(2)
+    for operation in (lambda: vec.append(3),
+                      lambda: vec.reserve(vec.capacity * 2),
+                      lambda: vec.__init__("int32")):
+        try:
+            operation()
+        except BufferError:
+            pass
+        else:
+            raise AssertionError("no BufferError while the buffer is exported")
+    assert view[0] == 1
+    view.release()
+    vec.append(3)
+    assert vec[len(vec) - 1] == 3
+
+
+def test_file_reopen():
+    with tempfile.TemporaryDirectory() as directory:
+        path = os.path.join(directory, "values.bin")
+        vec = mmapped_vector.Vector("int64", path)
+        for i in range(1000):
+            vec.append(i * i)
+        vec.flush()
+        del vec
+        reopened = mmapped_vector.Vector("int64", path)
+        assert len(reopened) == 1000
+        assert numpy.array_equal(numpy.asarray(reopened), numpy.arange(1000, dtype=numpy.int64) ** 2)
+
+
+if __name__ == "__main__":
+    for name, test in list(globals().items()):
+        if name.startswith("test_"):
+            print("Running", name)
+            test()
+    print("done")
@@ -0,0 +1,374 @@
+/**
+ * @file timeseries.h
+ * @brief A (timestamp, double) series, compressed in fixed blocks in the style of Facebook's Gorilla.
+ * @author Michał Startek
+ * @version 0.1
+ * @copyright Copyright (c) Michał Startek 2024
+ */
+
+#ifndef MMAPPED_VECTOR_TIMESERIES_H
+#define MMAPPED_VECTOR_TIMESERIES_H
+
+#include <algorithm>
+#include <bit>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "mmapped_vector.h"
+#include "committed_lengths.h"
+
+
+namespace mmapped_vector {
+
+/*
+ * Points are appended, in time order, to an uncompressed head block. Once the head holds
+ * block_points points, it's compressed and moved to the end of the data, and the block index gets
+ * an entry with its time range, so range queries decode only the blocks they overlap.
+ *
+ * The compression follows Pelkonen et al., "Gorilla: A Fast, Scalable, In-Memory Time Series
+ * Database" (2015). Timestamps are stored as deltas of deltas, which are 0 (one bit) for regular
+ * sampling. Each value is XORed with the previous one, and only the bits between the leading and
+ * trailing zeros of the result are kept, reusing the previous window when they fit in it. Slowly
+ * changing metrics take 1-2 bytes per point, instead of 16.
+ *
+ * A file-backed series is kept in base_name + ".data", ".blocks", ".head_times" and ".head_values",
+ * and their lengths in base_name + ".lengths" (see CommittedLengths), recorded by flush() and on
+ * close. Reopened after a crash, the series holds the points it held at the last flush(). Sealing
+ * empties the head, and new points then overwrite flushed ones, so the first append after a seal
+ * flushes, if the last flush recorded any points in the head.
+ */
+template <template <typename> class AllocatorType = MallocAllocator>
+class MmappedTimeSeries
+{
+public:
+    static constexpr size_t block_points = 1024;
+
+    struct Point
+    {
+        int64_t time;
+        double value;
+    };
+
+    struct BlockInfo
+    {
+        int64_t first_time;
+        int64_t last_time;
+        uint64_t data_offset;   // where the block's bits start in the data
+        uint64_t point_count;
+    };
+
+    MmappedTimeSeries() = default;
+    template <typename... Args>
+        requires std::is_constructible_v<AllocatorType<uint8_t>, std::string, Args...>
+    explicit MmappedTimeSeries(const std::string& base_name, Args&&... args);
+    MmappedTimeSeries(MmappedTimeSeries&&) = default;
+    ~MmappedTimeSeries() { committed.record_on_close(data, blocks, head_times, head_values); };
+
+    // Timestamps must not decrease
+    void append(int64_t time, double value);
+
+    size_t size() const { return sealed_points + head_times.size(); };
+    bool empty() const { return size() == 0; };
+    size_t block_count() const { return blocks.size(); };
+    const BlockInfo& block(size_t index) const { return blocks[index]; };
+    // Bytes taken by the compressed blocks
+    size_t compressed_bytes() const { return data.size(); };
+
+    // Decodes a sealed block into times and values, which must have room for its point_count points
+    void decode_block(size_t index, int64_t* times, double* values) const;
+
+    // Calls f(time, value) for every point with begin <= time < end, in order
+    template <typename F>
+    void for_each_in_range(int64_t begin, int64_t end, F&& f) const;
+    std::vector<Point> range(int64_t begin, int64_t end) const;
+
+    // Data, then the index, then the head, so a crash never leaves an index entry without its data,
+    // then the lengths of all four
+    void flush();
+
+private:
+    class BitWriter;
+    class BitReader;
+
+    void seal_head();
+    void recover();
+
+    MmappedVector<uint8_t, AllocatorType<uint8_t>> data;
+    MmappedVector<BlockInfo, AllocatorType<BlockInfo>> blocks;
+    MmappedVector<int64_t, AllocatorType<int64_t>> head_times;
+    MmappedVector<double, AllocatorType<double>> head_values;
+    CommittedLengths committed;
+    size_t sealed_points = 0;
+};
+
+/*
+ * =================================================================================================
+ */
+
+// Bits go out most significant first
+template <template <typename> class AllocatorType>
+class MmappedTimeSeries<AllocatorType>::BitWriter
+{
+public:
+    void write(uint64_t bits, unsigned count) {
+        for (unsigned i = count; i > 0; i--) {
+            current = static_cast<uint8_t>((current << 1) | ((bits >> (i - 1)) & 1));
+            if (++used == 8) {
+                bytes.push_back(current);
+                current = 0;
+                used = 0;
+            }
+        }
+    }
+
+    const std::vector<uint8_t>& finish() {
+        if (used > 0)
+            bytes.push_back(static_cast<uint8_t>(current << (8 - used)));
+        used = 0;
+        return bytes;
+    }
+
+private:
+    std::vector<uint8_t> bytes;
+    uint8_t current = 0;
+    unsigned used = 0;
+};
+
+template <template <typename> class AllocatorType>
+class MmappedTimeSeries<AllocatorType>::BitReader
+{
+public:
+    BitReader(const uint8_t* bytes, size_t length) : bytes(bytes), length(length) {};
+
+    uint64_t read(unsigned count) {
+        uint64_t result = 0;
+        while (count > 0) {
+            if (position >= length)
+                throw std::runtime_error("MmappedTimeSeries::decode_block: block data truncated. The file is probably corrupted.");
+            unsigned available = 8 - bit;
+            unsigned taken = std::min(available, count);
+            uint64_t chunk = (bytes[position] >> (available - taken)) & ((1u << taken) - 1);
+            result = (result << taken) | chunk;
+            count -= taken;
+            bit += taken;
+            if (bit == 8) {
+                bit = 0;
+                position++;
+            }
+        }
+        return result;
+    }
+
+    bool read_bit() { return read(1) != 0; };
+
+private:
+    const uint8_t* bytes;
+    size_t length;
+    size_t position = 0;
+    unsigned bit = 0;
+};
+
+/*
+ * =================================================================================================
+ */
+
+template <template <typename> class AllocatorType>
+template <typename... Args>
+    requires std::is_constructible_v<AllocatorType<uint8_t>, std::string, Args...>
+MmappedTimeSeries<AllocatorType>::MmappedTimeSeries(const std::string& base_name, Args&&... args)
+    : data(base_name + ".data", args...), blocks(base_name + ".blocks", args...),
+      head_times(base_name + ".head_times", args...), head_values(base_name + ".head_values", args...),
+      committed(base_name + ".lengths") {
+    committed.restore(data, blocks, head_times, head_values);
+    recover();
+}
+
+template <template <typename> class AllocatorType>
+void MmappedTimeSeries<AllocatorType>::recover() {
+    for (const BlockInfo& info : blocks)
+        sealed_points += info.point_count;
+    if (!blocks.empty()) {
+        const BlockInfo& last = blocks.back();
+        if (data.size() < last.data_offset)
+            throw std::runtime_error("MmappedTimeSeries::ctor: the block index refers past the data. The file is probably corrupted.");
+        // A crash after sealing the head but before clearing it leaves the sealed points in the head.
+        // With the lengths recorded, that's only seen in files written without them.
+        if (last.point_count > 0 && head_times.size() >= last.point_count && head_times.size() == head_values.size()
+                && head_times[0] == last.first_time && head_times[last.point_count - 1] == last.last_time) {
+            std::copy(head_times.begin() + last.point_count, head_times.end(), head_times.begin());
+            std::copy(head_values.begin() + last.point_count, head_values.end(), head_values.begin());
+            head_times.resize(head_times.size() - last.point_count);
+            head_values.resize(head_values.size() - last.point_count);
+        }
+    }
+    // Points whose value never got written
+    size_t head_size = std::min(head_times.size(), head_values.size());
+    head_times.resize(head_size);
+    head_values.resize(head_size);
+}
+
+template <template <typename> class AllocatorType>
+void MmappedTimeSeries<AllocatorType>::append(int64_t time, double value) {
+    int64_t last_time = !head_times.empty() ? head_times.back() : !blocks.empty() ? blocks.back().last_time : time;
+    if (time < last_time)
+        throw std::invalid_argument("MmappedTimeSeries::append: timestamps must not decrease");
+    if (head_times.size() < committed.recorded_length(2) || head_values.size() < committed.recorded_length(3))
+        flush();
+    head_values.push_back(value);
+    head_times.push_back(time);
+    if (head_times.size() == block_points)
+        seal_head();
+}
+
+template <template <typename> class AllocatorType>
+void MmappedTimeSeries<AllocatorType>::seal_head() {
+    const size_t count = head_times.size();
+    BitWriter writer;
+
+    // Timestamps. Deltas of deltas are zigzag-encoded, then stored in the smallest bucket they fit.
+    writer.write(static_cast<uint64_t>(head_times[0]), 64);
+    int64_t previous_delta = 0;
+    for (size_t i = 1; i < count; i++) {
+        int64_t delta = head_times[i] - head_times[i - 1];
+        int64_t delta_of_delta = delta - previous_delta;
+        previous_delta = delta;
+        uint64_t zigzag = (static_cast<uint64_t>(delta_of_delta) << 1) ^ static_cast<uint64_t>(delta_of_delta >> 63);
+        if (zigzag == 0)
+            writer.write(0b0, 1);
+        else if (zigzag < (1u << 7))
+            writer.write((0b10ull << 7) | zigzag, 2 + 7);
+        else if (zigzag < (1u << 9))
+            writer.write((0b110ull << 9) | zigzag, 3 + 9);
+        else if (zigzag < (1u << 12))
+            writer.write((0b1110ull << 12) | zigzag, 4 + 12);
+        else if (zigzag < (1ull << 32))
+            writer.write((0b11110ull << 32) | zigzag, 5 + 32);
+        else {
+            writer.write(0b11111, 5);
+            writer.write(zigzag, 64);
+        }
+    }
+
+    // Values
+    uint64_t previous = std::bit_cast<uint64_t>(head_values[0]);
+    writer.write(previous, 64);
+    unsigned window_leading = 65, window_trailing = 0;   // no window yet
+    for (size_t i = 1; i < count; i++) {
+        uint64_t current = std::bit_cast<uint64_t>(head_values[i]);
+        uint64_t difference = current ^ previous;
+        previous = current;
+        if (difference == 0) {
+            writer.write(0b0, 1);
+            continue;
+        }
+        unsigned leading = std::countl_zero(difference), trailing = std::countr_zero(difference);
+        if (leading >= window_leading && trailing >= window_trailing) {
+            writer.write(0b10, 2);
+            writer.write(difference >> window_trailing, 64 - window_leading - window_trailing);
+        } else {
+            unsigned meaningful = 64 - leading - trailing;
+            writer.write(0b11, 2);
+            writer.write(leading, 6);
+            writer.write(meaningful - 1, 6);
+            writer.write(difference >> trailing, meaningful);
+            window_leading = leading;
+            window_trailing = trailing;
+        }
+    }
+
+    const std::vector<uint8_t>& bytes = writer.finish();
+    BlockInfo info{head_times[0], head_times[count - 1], data.size(), count};
+    data.append_range(bytes.data(), bytes.size());
+    blocks.push_back(info);
+    sealed_points += count;
+    head_times.clear();
+    head_values.clear();
+}
+
+template <template <typename> class AllocatorType>
+void MmappedTimeSeries<AllocatorType>::decode_block(size_t index, int64_t* times, double* values) const {
+    const BlockInfo& info = blocks[index];
+    size_t end = index + 1 < blocks.size() ? blocks[index + 1].data_offset : data.size();
+    if (info.point_count == 0)
+        return;
+    BitReader reader(data.data() + info.data_offset, end - info.data_offset);
+
+    times[0] = static_cast<int64_t>(reader.read(64));
+    int64_t delta = 0;
+    for (size_t i = 1; i < info.point_count; i++) {
+        uint64_t zigzag;
+        if (!reader.read_bit())
+            zigzag = 0;
+        else if (!reader.read_bit())
+            zigzag = reader.read(7);
+        else if (!reader.read_bit())
+            zigzag = reader.read(9);
+        else if (!reader.read_bit())
+            zigzag = reader.read(12);
+        else if (!reader.read_bit())
+            zigzag = reader.read(32);
+        else
+            zigzag = reader.read(64);
+        delta += static_cast<int64_t>((zigzag >> 1) ^ (~(zigzag & 1) + 1));
+        times[i] = times[i - 1] + delta;
+    }
+
+    uint64_t previous = reader.read(64);
+    values[0] = std::bit_cast<double>(previous);
+    unsigned window_leading = 0, window_trailing = 0;
+    for (size_t i = 1; i < info.point_count; i++) {
+        if (reader.read_bit()) {
+            if (reader.read_bit()) {
+                window_leading = static_cast<unsigned>(reader.read(6));
+                window_trailing = 64 - window_leading - (static_cast<unsigned>(reader.read(6)) + 1);
+            }
+            previous ^= reader.read(64 - window_leading - window_trailing) << window_trailing;
+        }
+        values[i] = std::bit_cast<double>(previous);
+    }
+}
+
+template <template <typename> class AllocatorType>
+template <typename F>
+void MmappedTimeSeries<AllocatorType>::for_each_in_range(int64_t begin, int64_t end, F&& f) const {
+    if (begin >= end)
+        return;
+    // First block that may hold points at or after begin; blocks are in time order
+    const BlockInfo* first = std::partition_point(blocks.begin(), blocks.end(), [begin](const BlockInfo& info) { return info.last_time < begin; });
+    std::vector<int64_t> times;
+    std::vector<double> values;
+    for (const BlockInfo* info = first; info != blocks.end() && info->first_time < end; ++info) {
+        times.resize(info->point_count);
+        values.resize(info->point_count);
+        decode_block(info - blocks.begin(), times.data(), values.data());
+        for (size_t i = 0; i < info->point_count; i++)
+            if (times[i] >= begin && times[i] < end)
+                f(times[i], values[i]);
+    }
+    const int64_t* head_begin = std::lower_bound(head_times.begin(), head_times.end(), begin);
+    for (const int64_t* time = head_begin; time != head_times.end() && *time < end; ++time)
+        f(*time, head_values[time - head_times.begin()]);
+}
+
+template <template <typename> class AllocatorType>
+std::vector<typename MmappedTimeSeries<AllocatorType>::Point> MmappedTimeSeries<AllocatorType>::range(int64_t begin, int64_t end) const {
+    std::vector<Point> points;
+    for_each_in_range(begin, end, [&points](int64_t time, double value) { points.push_back(Point{time, value}); });
+    return points;
+}
+
+template <template <typename> class AllocatorType>
+void MmappedTimeSeries<AllocatorType>::flush() {
+    data.flush();
+    blocks.flush();
+    head_times.flush();
+    head_values.flush();
+    committed.record(true, data, blocks, head_times, head_values);
+}
+
+} // namespace mmapped_vector
+
+#endif // MMAPPED_VECTOR_TIMESERIES_H